@@ -68,6 +68,7 @@ namespace farm::config
         constexpr const char* CONFIG_SUFFIX  = "/config";      // Суффикс для топика конфигурации
         constexpr const char* COMMAND_SUFFIX = "/command";    // Суффикс для топика команд
         constexpr const char* LOG_SUFFIX     = "/log";         // Суффикс для топика логов
+        constexpr const char* COMMAND_ACK_SUFFIX = "/command_ack"; // Суффикс для топика подтверждений команд
 
         // Константы для работы с MQTT подключением
         constexpr unsigned long CHECK_INTERVAL = 5000;           // 5 секунд между проверками соединения
@@ -44,6 +44,12 @@ namespace farm::net
         uint8_t reconnectAttempts = 0;
         
         unsigned long lastReconnectTime = 0;
+
+        // Трассировка /data: время от публикации последних данных до PUBACK брокера
+        // (очередь AsyncMqttClient + брокер), уходит со следующей публикацией
+        volatile uint16_t lastDataPacketId = 0;
+        volatile unsigned long lastDataPublishedAt = 0;
+        volatile long lastDataPubackMs = -1;
         
         // Колбэки для MQTT
         void onMqttConnect(bool sessionPresent);
@@ -57,7 +63,10 @@ namespace farm::net
         bool setupMQTTClient();
         
         // Обработка полученной команды из топика /command
-        void handleCommand(const CommandCode& command);
+        bool handleCommand(const CommandCode& command);
+
+        // Подтверждение команды в топик /command_ack: результат и время от приёма до срабатывания актуатора
+        void publishCommandAck(const String& commandId, int command, bool ok, unsigned long handleMs);
 
         // Имя устройства, буффер для setClientId (необходим для решения проблемы с const char* и c_str()!)
         char deviceIdBuffer[mqtt::DEVICE_ID_MAX_LENGTH];
@@ -86,8 +95,9 @@ namespace farm::net
         // Поддержание MQTT соединения - вызывать в цикле loop()
         void maintainConnection();
         
-        // Публикация данных в топик /data
-        bool publishData(uint8_t qos = mqtt::QOS_1, bool retain = true);
+        // Публикация данных в топик /data. readMillis - millis() на момент опроса датчиков:
+        // вместе с данными уходит трассировка для замера задержек на сервере
+        bool publishData(unsigned long readMillis, uint8_t qos = mqtt::QOS_1, bool retain = true);
         
         // Публикация в произвольный топик
         bool publishToTopic(const String& topic, const String& payload, 
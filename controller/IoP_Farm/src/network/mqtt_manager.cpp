@@ -1,6 +1,7 @@
 #include "network/mqtt_manager.h"
 #include "logic/actuators_manager.h"
 #include <WiFi.h>
+#include <GyverNTP.h>
 
 namespace farm::net
 {
@@ -346,6 +347,16 @@ namespace farm::net
         {
             logger->log(Level::Info, 
                       "[MQTT] Обработка полученной команды");
+
+            unsigned long receivedAt = millis();
+
+            // id команды берём из самого сообщения: в сохранённом конфиге команд может остаться id прошлой
+            String commandId;
+            JsonDocument commandDoc;
+            if (!deserializeJson(commandDoc, message) && commandDoc["command_id"].is<const char*>())
+            {
+                commandId = commandDoc["command_id"].as<String>();
+            }
             
             bool updated = configManager->updateFromJson(ConfigType::Command, message);
             if (updated) 
@@ -356,12 +367,14 @@ namespace farm::net
                 int commandInt = configManager->getValue<int>(ConfigType::Command, "command");
                 
                 CommandCode command = static_cast<CommandCode>(commandInt);
-                handleCommand(command);
+                bool result = handleCommand(command);
+                publishCommandAck(commandId, commandInt, result, millis() - receivedAt);
             }
             else 
             {
                 logger->log(Level::Error, 
                           "[MQTT] Ошибка обработки полученной команды");
+                publishCommandAck(commandId, -1, false, millis() - receivedAt);
             }
         }
         
@@ -372,6 +385,12 @@ namespace farm::net
     
     void MQTTManager::onMqttPublish(uint16_t packetId)
     {
+        if (packetId == lastDataPacketId)
+        {
+            lastDataPubackMs = millis() - lastDataPublishedAt;
+            lastDataPacketId = 0;
+        }
+
         digitalWrite(pins::LED_PIN, HIGH);
         delay(10);
         digitalWrite(pins::LED_PIN, LOW);
@@ -425,7 +444,7 @@ namespace farm::net
         return success;
     }
     
-    void MQTTManager::handleCommand(const CommandCode& command)
+    bool MQTTManager::handleCommand(const CommandCode& command)
     {
         logger->log(Level::Info, 
                   "[MQTT] Обработка команды %d", static_cast<int>(command));
@@ -447,13 +466,34 @@ namespace farm::net
                           "[MQTT] Ошибка при обработке команды %d в ActuatorsManager", 
                           static_cast<int>(command));
             }
+            return result;
         }
         else
         {
             logger->log(Level::Error, 
                       "[MQTT] Не удалось получить экземпляр ActuatorsManager для обработки команды");
+            return false;
         }
     }
+
+    void MQTTManager::publishCommandAck(const String& commandId, int command, bool ok, unsigned long handleMs)
+    {
+        String deviceId = configManager->hasKey(ConfigType::Mqtt, "deviceId") 
+            ? configManager->getValue<String>(ConfigType::Mqtt, "deviceId")
+            : DEFAULT_DEVICE_ID;
+
+        JsonDocument ack;
+        ack["command_id"] = commandId;
+        ack["command"]    = command;
+        ack["ok"]         = ok;
+        ack["handle_ms"]  = handleMs;
+
+        String payload;
+        serializeJson(ack, payload);
+
+        // Подтверждение не сохраняется на брокере: оно нужно только ожидающему шлюзу
+        publishToTopic("/" + deviceId + COMMAND_ACK_SUFFIX, payload, mqtt::QOS_1, false);
+    }
     
     void MQTTManager::maintainConnection()
     {
@@ -493,7 +533,7 @@ namespace farm::net
     }
     
     // Публикация данных в MQTT
-    bool MQTTManager::publishData(uint8_t qos, bool retain)
+    bool MQTTManager::publishData(unsigned long readMillis, uint8_t qos, bool retain)
     {
         if (!isClientConnected()) 
         {
@@ -505,12 +545,40 @@ namespace farm::net
         String dataTopic = getMqttTopic(ConfigType::Data);
         
         String jsonData = configManager->getConfigJson(ConfigType::Data);
+
+        // Трассировка: read_to_pub_ms и puback_ms - по millis(), время опроса и публикации -
+        // по NTP (только после синхронизации, тогда же device_ts - время опроса датчиков)
+        JsonDocument doc;
+        if (!deserializeJson(doc, jsonData))
+        {
+            unsigned long now = millis();
+            JsonObject trace = doc["trace"].to<JsonObject>();
+            trace["read_to_pub_ms"] = now - readMillis;
+            if (lastDataPubackMs >= 0)
+            {
+                trace["puback_ms"] = lastDataPubackMs;
+            }
+            if (NTP.online())
+            {
+                uint64_t pubUnixMs = static_cast<uint64_t>(NTP.getUnix()) * 1000 + NTP.ms();
+                uint64_t readUnixMs = pubUnixMs - (now - readMillis);
+                doc["device_ts"] = readUnixMs / 1000;
+                trace["read_ms"] = readUnixMs;
+                trace["pub_ms"] = pubUnixMs;
+            }
+            jsonData = "";
+            serializeJson(doc, jsonData);
+        }
         
         // Публикуем данные (QoS=1, retain=true)
         uint16_t packetId = mqttClient.publish(dataTopic.c_str(), qos, retain, jsonData.c_str());
         
         if (packetId > 0)
         {
+            lastDataPubackMs = -1;
+            lastDataPublishedAt = millis();
+            lastDataPacketId = packetId;
+
             logger->log(Level::Farm, 
                       "[MQTT] Данные #%d опубликованы в топик '%s'", 
                       packetId, dataTopic.c_str());
@@ -243,7 +243,7 @@ namespace farm::sensors
             // Если подключены к MQTT, публикуем данные
             if (mqttManager && mqttManager->isClientConnected()) 
             {
-                bool published = mqttManager->publishData();
+                bool published = mqttManager->publishData(currentTime);
                 
                 if (!published) 
                 {
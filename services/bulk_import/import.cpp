@@ -0,0 +1,721 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <endian.h>
+#include <sqlite3.h>
+#include <nlohmann/json.hpp>
+
+// Массовая загрузка истории показаний в sensor_data (переезд фермы, восстановление
+// из копии). Входные форматы:
+//   csv    - первая строка - имена колонок (timestamp_unix, 6 полей датчиков,
+//            необязательные device, device_ts, seq, received_unix; прочие пропускаются)
+//   jsonl  - объект на строку с теми же ключами; подходит и полезная нагрузка MQTT
+//            (device_ts без timestamp_unix)
+//   binary - записи порта 1488 (56 байт в сетевом порядке), устройство из --device
+//
+// Конвейер: поток чтения режет вход на блоки по границам строк (записей), несколько
+// потоков разбирают блоки, основной поток вставляет строки в исходном порядке
+// (из повторов одного показания побеждает последнее, как в data.cpp).
+// На время загрузки: крупные транзакции, synchronous=OFF, индекс по времени
+// удаляется и строится один раз в конце. Уникальный индекс (device, device_ts)
+// остаётся - по нему повторный импорт того же файла не дублирует строки.
+// Строки, не новее ts_watermark, увеличивают late_epoch - читатели сбросят кэши;
+// каждая транзакция увеличивает import_seq (ETag свежих ответов LOGS).
+// Импортированные строки не попадают в журнал data.cpp: DATA --rebuild их не восстановит
+
+const std::string DB_PATH = "/home/tovarichkek/services/data_server_farm/data.db";
+const std::string DEFAULT_DEVICE = "farm001";
+const int64_t DEFAULT_BATCH_ROWS = 500000;
+const size_t BLOCK_SIZE = 4 * 1024 * 1024;
+const size_t BINARY_RECORD_SIZE = 56;
+// Блоков в работе (прочитано, но не записано) на поток разбора - ограничивает память
+const size_t BLOCKS_PER_PARSER = 4;
+const int64_t PROGRESS_INTERVAL_MS = 5000;
+// Первые ошибки разбора печатаются, остальные только считаются
+const size_t MAX_REPORTED_ERRORS = 10;
+
+const char* SENSOR_FIELDS[] = {
+    "temperature_DHT22", "temperature_DS18B20", "humidity",
+    "water_level", "soil_moisture", "light_intensity"
+};
+const size_t SENSOR_FIELDS_COUNT = 6;
+
+struct ImportOptions {
+    std::string db = DB_PATH;
+    std::string format;
+    std::string device = DEFAULT_DEVICE;
+    std::vector<std::string> inputs;
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    int64_t batch_rows = DEFAULT_BATCH_ROWS;
+    bool keep_indexes = false;
+};
+
+struct Row {
+    int64_t timestamp_unix = 0;
+    double fields[SENSOR_FIELDS_COUNT] = {};
+    std::string device;             // пусто - устройство по умолчанию (--device)
+    int64_t device_ts = 0;
+    bool has_seq = false;
+    int64_t seq = 0;
+    bool has_received = false;
+    int64_t received_unix = 0;
+};
+
+struct Block {
+    uint64_t index = 0;
+    int64_t first_line = 0;         // номер первой строки блока во входе (с 1)
+    std::string source;
+    std::string data;
+};
+
+struct ParsedBlock {
+    std::vector<Row> rows;
+    int64_t errors = 0;
+    std::vector<std::string> messages;
+};
+
+// Колонки CSV и ключи JSONL
+enum Column {
+    COL_IGNORED = -1,
+    COL_TIMESTAMP = 0,
+    COL_FIELD_FIRST = 1,            // 1..6 - поля датчиков по порядку SENSOR_FIELDS
+    COL_DEVICE = 1 + SENSOR_FIELDS_COUNT,
+    COL_DEVICE_TS,
+    COL_SEQ,
+    COL_RECEIVED
+};
+
+int column_by_name(const std::string& name) {
+    if (name == "timestamp_unix") return COL_TIMESTAMP;
+    for (size_t i = 0; i < SENSOR_FIELDS_COUNT; i++) {
+        if (name == SENSOR_FIELDS[i]) return COL_FIELD_FIRST + static_cast<int>(i);
+    }
+    if (name == "device") return COL_DEVICE;
+    if (name == "device_ts") return COL_DEVICE_TS;
+    if (name == "seq") return COL_SEQ;
+    if (name == "received_unix") return COL_RECEIVED;
+    return COL_IGNORED;
+}
+
+int64_t steady_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void print_usage() {
+    std::cerr << "Usage: IMPORT --format csv|jsonl|binary [--db <path>] [--device <id>] [--threads N]\n"
+              << "              [--batch-rows N] [--keep-indexes] <file>... (- for stdin)\n"
+              << "--device - device for binary records and rows without a device column\n"
+              << "--keep-indexes - do not drop the time index (import while DATA/LOGS are running)" << std::endl;
+}
+
+ImportOptions parse_args(int argc, char* argv[]) {
+    ImportOptions opts;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--keep-indexes") {
+            opts.keep_indexes = true;
+            continue;
+        }
+        if (arg.size() < 2 || arg.compare(0, 2, "--") != 0) {
+            opts.inputs.push_back(arg);
+            continue;
+        }
+        if (i + 1 >= argc) throw std::runtime_error("Missing value for " + arg);
+        std::string value = argv[++i];
+        if (arg == "--db") opts.db = value;
+        else if (arg == "--format") opts.format = value;
+        else if (arg == "--device") opts.device = value;
+        else if (arg == "--threads") opts.threads = static_cast<unsigned>(std::stoul(value));
+        else if (arg == "--batch-rows") opts.batch_rows = std::stoll(value);
+        else throw std::runtime_error("Unknown option: " + arg);
+    }
+    if (opts.format != "csv" && opts.format != "jsonl" && opts.format != "binary")
+        throw std::runtime_error("Unknown format: " + opts.format);
+    if (opts.inputs.empty()) throw std::runtime_error("No input files");
+    if (opts.threads == 0 || opts.batch_rows <= 0 || opts.device.empty())
+        throw std::runtime_error("Invalid threads, batch size or device");
+    return opts;
+}
+
+// Границы ячейки без пробелов и кавычек по краям
+void trim_cell(const char*& begin, const char*& end) {
+    while (begin < end && (*begin == ' ' || *begin == '"')) begin++;
+    while (end > begin && (end[-1] == ' ' || end[-1] == '"' || end[-1] == '\r')) end--;
+}
+
+// Значение должно занимать ячейку целиком
+bool parse_number(const char* begin, const char* end, double& out) {
+    char buf[64];
+    size_t len = static_cast<size_t>(end - begin);
+    if (len == 0 || len >= sizeof(buf)) return false;
+    memcpy(buf, begin, len);
+    buf[len] = '\0';
+    char* stop;
+    out = strtod(buf, &stop);
+    return stop == buf + len;
+}
+
+bool parse_integer(const char* begin, const char* end, int64_t& out) {
+    char buf[32];
+    size_t len = static_cast<size_t>(end - begin);
+    if (len == 0 || len >= sizeof(buf)) return false;
+    memcpy(buf, begin, len);
+    buf[len] = '\0';
+    char* stop;
+    out = strtoll(buf, &stop, 10);
+    return stop == buf + len;
+}
+
+// Разбор блока одного формата. Строка с ошибкой пропускается и считается
+class BlockParser {
+    const ImportOptions& opts;
+    std::vector<int> csv_columns;
+
+    void fail(ParsedBlock& out, const Block& block, int64_t line, const std::string& what) {
+        out.errors++;
+        if (out.messages.size() < MAX_REPORTED_ERRORS) {
+            out.messages.push_back(block.source + ":" + std::to_string(line) + ": " + what);
+        }
+    }
+
+    // Общая проверка строки: все поля датчиков и время есть
+    static bool complete(const bool* seen, std::string& what) {
+        if (!seen[COL_TIMESTAMP] && !seen[COL_DEVICE_TS]) {
+            what = "no timestamp_unix or device_ts";
+            return false;
+        }
+        for (size_t i = 0; i < SENSOR_FIELDS_COUNT; i++) {
+            if (!seen[COL_FIELD_FIRST + i]) {
+                what = std::string("no ") + SENSOR_FIELDS[i];
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Время устройства по умолчанию совпадает со временем показания: так строка попадает
+    // под уникальный индекс, и повторная загрузка её не дублирует
+    static void fill_times(Row& r, const bool* seen) {
+        if (!seen[COL_TIMESTAMP]) r.timestamp_unix = r.device_ts;
+        if (!seen[COL_DEVICE_TS]) r.device_ts = r.timestamp_unix;
+    }
+
+    bool set_value(Row& r, int column, const char* begin, const char* end) {
+        switch (column) {
+        case COL_DEVICE:
+            r.device.assign(begin, end);
+            return true;
+        case COL_TIMESTAMP:
+            return parse_integer(begin, end, r.timestamp_unix);
+        case COL_DEVICE_TS:
+            return parse_integer(begin, end, r.device_ts);
+        case COL_SEQ:
+            return r.has_seq = parse_integer(begin, end, r.seq);
+        case COL_RECEIVED:
+            return r.has_received = parse_integer(begin, end, r.received_unix);
+        default:
+            return parse_number(begin, end, r.fields[column - COL_FIELD_FIRST]);
+        }
+    }
+
+    void parse_csv(const Block& block, ParsedBlock& out) {
+        const char* p = block.data.data();
+        const char* data_end = p + block.data.size();
+        int64_t line = block.first_line;
+        for (; p < data_end; line++) {
+            const char* eol = static_cast<const char*>(memchr(p, '\n', data_end - p));
+            if (!eol) eol = data_end;
+            const char* line_begin = p;
+            p = eol + 1;
+            if (eol == line_begin || (eol - line_begin == 1 && *line_begin == '\r')) continue;
+
+            Row r;
+            bool seen[COL_RECEIVED + 1] = {};
+            bool ok = true;
+            std::string what;
+            size_t col = 0;
+            for (const char* cell = line_begin; ok && cell <= eol; col++) {
+                const char* comma = static_cast<const char*>(memchr(cell, ',', eol - cell));
+                if (!comma) comma = eol;
+                int column = col < csv_columns.size() ? csv_columns[col] : COL_IGNORED;
+                const char* begin = cell;
+                const char* end = comma;
+                trim_cell(begin, end);
+                // Пустая ячейка - значения нет
+                if (column != COL_IGNORED && begin != end) {
+                    ok = set_value(r, column, begin, end);
+                    seen[column] = ok;
+                    if (!ok) what = "bad value in column " + std::to_string(col + 1);
+                }
+                cell = comma + 1;
+            }
+            if (ok) ok = complete(seen, what);
+            if (!ok) {
+                fail(out, block, line, what);
+                continue;
+            }
+            fill_times(r, seen);
+            out.rows.push_back(std::move(r));
+        }
+    }
+
+    void parse_jsonl(const Block& block, ParsedBlock& out) {
+        const char* p = block.data.data();
+        const char* data_end = p + block.data.size();
+        int64_t line = block.first_line;
+        for (; p < data_end; line++) {
+            const char* eol = static_cast<const char*>(memchr(p, '\n', data_end - p));
+            if (!eol) eol = data_end;
+            const char* line_begin = p;
+            p = eol + 1;
+            if (std::all_of(line_begin, eol, [](char c) { return isspace(static_cast<unsigned char>(c)); })) continue;
+
+            auto j = nlohmann::json::parse(line_begin, eol, nullptr, false);
+            if (j.is_discarded() || !j.is_object()) {
+                fail(out, block, line, "invalid JSON");
+                continue;
+            }
+            Row r;
+            bool seen[COL_RECEIVED + 1] = {};
+            bool ok = true;
+            std::string what;
+            for (auto it = j.begin(); ok && it != j.end(); ++it) {
+                int column = column_by_name(it.key());
+                if (column == COL_IGNORED || it->is_null()) continue;
+                const auto& v = it.value();
+                if (column == COL_DEVICE) {
+                    ok = v.is_string();
+                    if (ok) r.device = v.get<std::string>();
+                } else if (column < COL_FIELD_FIRST || column > COL_DEVICE) {
+                    ok = v.is_number_integer();
+                    int64_t value = ok ? v.get<int64_t>() : 0;
+                    if (column == COL_TIMESTAMP) r.timestamp_unix = value;
+                    else if (column == COL_DEVICE_TS) r.device_ts = value;
+                    else if (column == COL_SEQ) r.seq = value, r.has_seq = ok;
+                    else r.received_unix = value, r.has_received = ok;
+                } else {
+                    ok = v.is_number();
+                    if (ok) r.fields[column - COL_FIELD_FIRST] = v.get<double>();
+                }
+                seen[column] = ok;
+                if (!ok) what = "bad value of " + it.key();
+            }
+            if (ok) ok = complete(seen, what);
+            if (!ok) {
+                fail(out, block, line, what);
+                continue;
+            }
+            fill_times(r, seen);
+            out.rows.push_back(std::move(r));
+        }
+    }
+
+    // Блок бинарного формата всегда кратен размеру записи (см. InputReader)
+    void parse_binary(const Block& block, ParsedBlock& out) {
+        size_t count = block.data.size() / BINARY_RECORD_SIZE;
+        out.rows.resize(count);
+        const char* p = block.data.data();
+        for (size_t i = 0; i < count; i++, p += BINARY_RECORD_SIZE) {
+            Row& r = out.rows[i];
+            uint64_t net[1 + SENSOR_FIELDS_COUNT];
+            memcpy(net, p, sizeof(net));
+            r.timestamp_unix = static_cast<int64_t>(be64toh(net[0]));
+            for (size_t f = 0; f < SENSOR_FIELDS_COUNT; f++) {
+                uint64_t bits = be64toh(net[1 + f]);
+                memcpy(&r.fields[f], &bits, sizeof(double));
+            }
+            r.device_ts = r.timestamp_unix;
+        }
+    }
+
+public:
+    explicit BlockParser(const ImportOptions& opts) : opts(opts) {}
+
+    // Заголовок CSV: номера колонок по именам
+    void set_csv_header(const std::string& header) {
+        csv_columns.clear();
+        size_t begin = 0;
+        while (begin <= header.size()) {
+            size_t end = header.find(',', begin);
+            if (end == std::string::npos) end = header.size();
+            const char* name_begin = header.data() + begin;
+            const char* name_end = header.data() + end;
+            trim_cell(name_begin, name_end);
+            csv_columns.push_back(column_by_name(std::string(name_begin, name_end)));
+            begin = end + 1;
+        }
+    }
+
+    ParsedBlock parse(const Block& block) {
+        ParsedBlock out;
+        if (opts.format == "csv") parse_csv(block, out);
+        else if (opts.format == "jsonl") parse_jsonl(block, out);
+        else parse_binary(block, out);
+        return out;
+    }
+};
+
+// Чтение входа блоками по BLOCK_SIZE, разрезанными по последнему '\n'
+// (для binary - по границе записи); хвост переносится в следующий блок
+class InputReader {
+    const ImportOptions& opts;
+    FILE* file = nullptr;
+    std::string source;
+    std::string carry;
+    int64_t next_line = 1;
+    bool eof = false;
+
+public:
+    InputReader(const ImportOptions& opts, const std::string& path) : opts(opts), source(path) {
+        file = path == "-" ? stdin : fopen(path.c_str(), "rb");
+        if (!file) throw std::runtime_error("Cannot open " + path);
+    }
+
+    ~InputReader() {
+        if (file && file != stdin) fclose(file);
+    }
+
+    InputReader(const InputReader&) = delete;
+    InputReader& operator=(const InputReader&) = delete;
+
+    // Первая строка файла (заголовок CSV)
+    std::string read_line() {
+        std::string line;
+        int c;
+        while ((c = fgetc(file)) != EOF && c != '\n') line.push_back(static_cast<char>(c));
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        next_line++;
+        return line;
+    }
+
+    // false - вход закончился. Блок может быть пустым, если строка длиннее BLOCK_SIZE
+    bool next(Block& block) {
+        if (eof && carry.empty()) return false;
+        block.source = source;
+        block.first_line = next_line;
+        block.data.swap(carry);
+        carry.clear();
+
+        size_t have = block.data.size();
+        block.data.resize(have + BLOCK_SIZE);
+        size_t got = fread(&block.data[have], 1, BLOCK_SIZE, file);
+        block.data.resize(have + got);
+        if (got < BLOCK_SIZE) {
+            if (ferror(file)) throw std::runtime_error("Read error in " + source);
+            eof = true;
+        }
+
+        size_t cut = block.data.size();
+        if (opts.format == "binary") {
+            cut -= cut % BINARY_RECORD_SIZE;
+            if (eof && cut != block.data.size()) {
+                std::cerr << source << ": trailing " << block.data.size() - cut
+                          << " bytes are not a whole record, skipped" << std::endl;
+                block.data.resize(cut);
+            }
+        } else if (!eof) {
+            size_t newline = block.data.rfind('\n');
+            cut = newline == std::string::npos ? 0 : newline + 1;
+        }
+        if (!eof) {
+            carry.assign(block.data, cut, std::string::npos);
+            block.data.resize(cut);
+        }
+        if (opts.format != "binary") next_line += std::count(block.data.begin(), block.data.end(), '\n');
+        return true;
+    }
+};
+
+// Вставка в sensor_data крупными транзакциями
+class BulkWriter {
+    sqlite3* db = nullptr;
+    sqlite3_stmt* upsert_stmt = nullptr;
+    sqlite3_stmt* increment_stmt = nullptr;
+    const ImportOptions& opts;
+    int64_t ts_watermark = 0;   // прочитана в начале текущей транзакции
+    int64_t in_transaction = 0;
+    bool late = false;
+
+    void exec(const char* sql) {
+        if (sqlite3_exec(db, sql, nullptr, nullptr, nullptr) != SQLITE_OK) {
+            throw std::runtime_error(sqlite3_errmsg(db));
+        }
+    }
+
+    int64_t read_state(const char* name) {
+        int64_t value = 0;
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db, "SELECT value FROM ingest_state WHERE name = ?;", -1, &stmt, nullptr) == SQLITE_OK) {
+            sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+            if (sqlite3_step(stmt) == SQLITE_ROW) value = sqlite3_column_int64(stmt, 0);
+            sqlite3_finalize(stmt);
+        }
+        return value;
+    }
+
+    void prepare(sqlite3_stmt** stmt, const char* sql) {
+        if (sqlite3_prepare_v2(db, sql, -1, stmt, nullptr) != SQLITE_OK) {
+            throw std::runtime_error(std::string(sqlite3_errmsg(db)) + " (run DATA once to migrate an old database)");
+        }
+    }
+
+public:
+    BulkWriter(const ImportOptions& opts) : opts(opts) {
+        if (sqlite3_open(opts.db.c_str(), &db) != SQLITE_OK) {
+            throw std::runtime_error(sqlite3_errmsg(db));
+        }
+        sqlite3_busy_timeout(db, 5000);
+        // Пропавшие при сбое данные загружаются заново тем же файлом
+        exec("PRAGMA journal_mode=WAL;");
+        exec("PRAGMA synchronous=OFF;");
+        exec("PRAGMA cache_size=-262144;");
+        exec("PRAGMA temp_store=MEMORY;");
+
+        // Схема как в data.cpp: загрузка в новую БД для переезда фермы
+        exec("CREATE TABLE IF NOT EXISTS sensor_data ("
+             "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+             "timestamp_unix INTEGER,"
+             "temperature_DHT22 REAL,"
+             "temperature_DS18B20 REAL,"
+             "humidity REAL,"
+             "water_level REAL,"
+             "soil_moisture REAL,"
+             "light_intensity REAL,"
+             "device TEXT NOT NULL DEFAULT 'farm001',"
+             "device_ts INTEGER,"
+             "seq INTEGER,"
+             "received_unix INTEGER);");
+        exec("CREATE UNIQUE INDEX IF NOT EXISTS ux_sensor_data_device_ts "
+             "ON sensor_data(device, device_ts);");
+        exec("CREATE TABLE IF NOT EXISTS ingest_state ("
+             "name TEXT PRIMARY KEY,"
+             "value INTEGER NOT NULL);");
+        // Без --keep-indexes индексы по времени строятся в finish(). Если загрузка
+        // прервётся, их восстановит data.cpp при следующем запуске
+        if (!opts.keep_indexes) {
+            exec("DROP INDEX IF EXISTS ix_sensor_data_timestamp;");
+            exec("DROP INDEX IF EXISTS ix_sensor_data_device_timestamp;");
+        }
+
+        prepare(&upsert_stmt, "INSERT INTO sensor_data (timestamp_unix, "
+            "temperature_DHT22, temperature_DS18B20, humidity, "
+            "water_level, soil_moisture, light_intensity, "
+            "device, device_ts, seq, received_unix) "
+            "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?) "
+            "ON CONFLICT(device, device_ts) DO UPDATE SET "
+            "timestamp_unix = excluded.timestamp_unix, "
+            "temperature_DHT22 = excluded.temperature_DHT22, "
+            "temperature_DS18B20 = excluded.temperature_DS18B20, "
+            "humidity = excluded.humidity, "
+            "water_level = excluded.water_level, "
+            "soil_moisture = excluded.soil_moisture, "
+            "light_intensity = excluded.light_intensity, "
+            "seq = excluded.seq, "
+            "received_unix = excluded.received_unix;");
+        prepare(&increment_stmt, "INSERT INTO ingest_state (name, value) VALUES (?, 1) "
+            "ON CONFLICT(name) DO UPDATE SET value = value + 1;");
+    }
+
+    ~BulkWriter() {
+        sqlite3_finalize(upsert_stmt);
+        sqlite3_finalize(increment_stmt);
+        sqlite3_close(db);
+    }
+
+    BulkWriter(const BulkWriter&) = delete;
+    BulkWriter& operator=(const BulkWriter&) = delete;
+
+    void insert(const std::vector<Row>& rows) {
+        for (const auto& r : rows) {
+            if (in_transaction == 0) {
+                // DATA меняет отметку, пока идёт загрузка с --keep-indexes
+                exec("BEGIN IMMEDIATE;");
+                ts_watermark = read_state("ts_watermark");
+            }
+            const std::string& device = r.device.empty() ? opts.device : r.device;
+            sqlite3_reset(upsert_stmt);
+            sqlite3_bind_int64(upsert_stmt, 1, r.timestamp_unix);
+            for (size_t i = 0; i < SENSOR_FIELDS_COUNT; i++) {
+                sqlite3_bind_double(upsert_stmt, 2 + i, r.fields[i]);
+            }
+            sqlite3_bind_text(upsert_stmt, 8, device.c_str(), static_cast<int>(device.size()), SQLITE_STATIC);
+            sqlite3_bind_int64(upsert_stmt, 9, r.device_ts);
+            if (r.has_seq) sqlite3_bind_int64(upsert_stmt, 10, r.seq);
+            else sqlite3_bind_null(upsert_stmt, 10);
+            if (r.has_received) sqlite3_bind_int64(upsert_stmt, 11, r.received_unix);
+            else sqlite3_bind_null(upsert_stmt, 11);
+            if (sqlite3_step(upsert_stmt) != SQLITE_DONE) {
+                throw std::runtime_error(std::string("Insert error: ") + sqlite3_errmsg(db));
+            }
+            late |= r.timestamp_unix <= ts_watermark;
+            if (++in_transaction >= opts.batch_rows) commit();
+        }
+    }
+
+    void increment_state(const char* name) {
+        sqlite3_reset(increment_stmt);
+        sqlite3_bind_text(increment_stmt, 1, name, -1, SQLITE_STATIC);
+        if (sqlite3_step(increment_stmt) != SQLITE_DONE) {
+            throw std::runtime_error(std::string("State error: ") + sqlite3_errmsg(db));
+        }
+    }
+
+    // Счётчики меняются в той же транзакции, что и строки (как write_batch в data.cpp), и
+    // увеличиваются в самой БД - DATA их тоже меняет. import_seq - для ETag открытых диапазонов
+    // и последнего показания в LOGS: journal_seq импорт не трогает, это отметка журнала DATA
+    void commit() {
+        if (in_transaction == 0) return;
+        if (late) increment_state("late_epoch");
+        increment_state("import_seq");
+        exec("COMMIT;");
+        late = false;
+        in_transaction = 0;
+    }
+
+    void finish() {
+        commit();
+        exec("CREATE INDEX IF NOT EXISTS ix_sensor_data_timestamp ON sensor_data(timestamp_unix);");
+        exec("CREATE INDEX IF NOT EXISTS ix_sensor_data_device_timestamp ON sensor_data(device, timestamp_unix);");
+        exec("PRAGMA wal_checkpoint(TRUNCATE);");
+    }
+};
+
+// Потоки разбора: блоки берутся из очереди, результаты складываются по номеру блока,
+// писатель забирает их строго по порядку
+class ParsePipeline {
+    BlockParser& parser;
+    std::deque<Block> pending;
+    std::map<uint64_t, ParsedBlock> parsed;
+    std::mutex mtx;
+    std::condition_variable work_cv;
+    std::condition_variable done_cv;
+    std::vector<std::thread> threads;
+    bool closed = false;
+
+    void worker() {
+        while (true) {
+            Block block;
+            {
+                std::unique_lock<std::mutex> lock(mtx);
+                work_cv.wait(lock, [this] { return closed || !pending.empty(); });
+                if (pending.empty()) return;
+                block = std::move(pending.front());
+                pending.pop_front();
+            }
+            ParsedBlock result = parser.parse(block);
+            std::lock_guard<std::mutex> lock(mtx);
+            parsed.emplace(block.index, std::move(result));
+            done_cv.notify_all();
+        }
+    }
+
+public:
+    ParsePipeline(BlockParser& parser, unsigned thread_count) : parser(parser) {
+        for (unsigned i = 0; i < thread_count; i++) threads.emplace_back(&ParsePipeline::worker, this);
+    }
+
+    ~ParsePipeline() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            closed = true;
+        }
+        work_cv.notify_all();
+        for (auto& t : threads) t.join();
+    }
+
+    void push(Block block) {
+        std::lock_guard<std::mutex> lock(mtx);
+        pending.push_back(std::move(block));
+        work_cv.notify_one();
+    }
+
+    ParsedBlock take(uint64_t index) {
+        std::unique_lock<std::mutex> lock(mtx);
+        done_cv.wait(lock, [&] { return parsed.count(index) > 0; });
+        ParsedBlock result = std::move(parsed[index]);
+        parsed.erase(index);
+        return result;
+    }
+};
+
+int main(int argc, char* argv[]) {
+    ImportOptions opts;
+    try {
+        opts = parse_args(argc, argv);
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        print_usage();
+        return 1;
+    }
+
+    int64_t rows = 0, errors = 0;
+    int64_t started = steady_ms();
+    int64_t index_ms = 0;
+    try {
+        BulkWriter writer(opts);
+        BlockParser parser(opts);
+        int64_t last_progress = started;
+        size_t in_flight_limit = opts.threads * BLOCKS_PER_PARSER;
+
+        for (const auto& path : opts.inputs) {
+            InputReader reader(opts, path);
+            if (opts.format == "csv") parser.set_csv_header(reader.read_line());
+
+            // Пул пересоздаётся на каждый файл: у CSV-файлов могут быть разные заголовки
+            ParsePipeline pipeline(parser, opts.threads);
+            uint64_t read_blocks = 0, written_blocks = 0;
+            bool more = true;
+            while (more || written_blocks < read_blocks) {
+                while (more && read_blocks - written_blocks < in_flight_limit) {
+                    Block block;
+                    more = reader.next(block);
+                    if (block.data.empty()) continue;
+                    block.index = read_blocks++;
+                    pipeline.push(std::move(block));
+                }
+                if (written_blocks == read_blocks) continue;
+
+                ParsedBlock result = pipeline.take(written_blocks++);
+                for (const auto& message : result.messages) std::cerr << message << std::endl;
+                errors += result.errors;
+                writer.insert(result.rows);
+                rows += static_cast<int64_t>(result.rows.size());
+
+                int64_t now = steady_ms();
+                if (now - last_progress >= PROGRESS_INTERVAL_MS) {
+                    last_progress = now;
+                    std::cerr << "Imported " << rows << " rows, "
+                              << static_cast<int64_t>(rows * 1000.0 / std::max<int64_t>(1, now - started))
+                              << " rows/s" << std::endl;
+                }
+            }
+        }
+        int64_t index_started = steady_ms();
+        writer.finish();
+        index_ms = steady_ms() - index_started;
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Import error: " << e.what() << std::endl;
+        return 1;
+    }
+
+    double seconds = std::max<int64_t>(1, steady_ms() - started) / 1000.0;
+    std::cout << "Imported " << rows << " rows (" << errors << " bad lines skipped) in " << seconds << " s, "
+              << static_cast<int64_t>(rows / seconds) << " rows/s, "
+              << static_cast<int64_t>(rows / seconds * 60) << " rows/min; index build "
+              << index_ms / 1000.0 << " s" << std::endl;
+    return errors > 0 ? 2 : 0;
+}
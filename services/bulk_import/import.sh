@@ -0,0 +1 @@
+g++ -std=c++17 -O2 -pthread -o IMPORT import.cpp     -lsqlite3
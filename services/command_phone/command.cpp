@@ -4,9 +4,17 @@
 #include <chrono>
 #include <ctime>
 #include <thread>
+#include <mutex>
+#include <future>
+#include <map>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cstdlib>
 #include <boost/asio.hpp>
 #include <mqtt/async_client.h>
 #include <nlohmann/json.hpp>
+#include "../common/trace_stats.h"
 
 namespace asio = boost::asio;
 using boost::asio::ip::tcp;
@@ -14,10 +22,75 @@ using json = nlohmann::json;
 
 // Конфигурация (изменённые значения)
 const std::string MQTT_BROKER = "tcp://localhost:1883";
-const std::string MQTT_TOPIC = "/farm001/command";  // Изменён топик
+const std::string DEFAULT_DEVICE = "farm001";
+const std::string MQTT_ACK_TOPIC = "/+/command_ack";
 const int TCP_PORT = 1490;                         // Изменён порт
 const std::string LOG_FILE = "/var/log/phone_command.log";
 
+// Сколько телефон ждёт подтверждения от фермы, и как часто гистограммы задержек пишутся в лог
+const int ACK_TIMEOUT_MS = 10000;
+const int STATS_REPORT_INTERVAL_SEC = 600;
+
+std::string command_topic(const std::string& device) {
+    return "/" + device + "/command";
+}
+
+// Имена кодов CommandCode из controller/IoP_Farm/include/config/constants.h
+std::string command_name(int code) {
+    static const char* names[] = {
+        "ESP_RESTART", "PUMP_ON", "PUMP_OFF", "GROWLIGHT_ON", "GROWLIGHT_OFF",
+        "HEATLAMP_ON", "HEATLAMP_OFF", "FARM_ON", "FARM_OFF"
+    };
+    if(code >= 0 && code < static_cast<int>(sizeof(names) / sizeof(names[0]))) return names[code];
+    return "CODE_" + std::to_string(code);
+}
+
+int64_t unix_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Этапы пути команды: телефон -> шлюз -> брокер -> устройство -> актуатор.
+//   phone_to_gateway - по sent_ms телефона (зависит от точности его часов)
+//   gateway_to_broker - от приёма запроса до PUBACK брокера
+//   broker_device_transit - доставка до устройства и подтверждение обратно, без обработки на устройстве
+//   device_to_actuator - от приёма сообщения устройством до срабатывания актуатора (handle_ms)
+//   total - от приёма запроса шлюзом до подтверждения
+// Для каждого этапа - гистограмма по каждой команде; отдельно считаются таймауты
+class LatencyStats {
+    std::map<std::string, std::map<std::string, LatencyHistogram>> stages;
+    std::map<std::string, uint64_t> timeouts;
+    std::mutex mtx;
+
+public:
+    void add(const std::string& stage, const std::string& command, int64_t ms) {
+        std::lock_guard<std::mutex> lock(mtx);
+        stages[stage][command].add(ms);
+    }
+
+    void add_timeout(const std::string& command) {
+        std::lock_guard<std::mutex> lock(mtx);
+        timeouts[command]++;
+    }
+
+    json to_json() {
+        std::lock_guard<std::mutex> lock(mtx);
+        json out = json::object();
+        for(const auto& [stage, by_command] : stages) {
+            for(const auto& [command, histogram] : by_command) {
+                out["stages"][stage][command] = histogram.to_json();
+            }
+        }
+        out["timeouts"] = timeouts;
+        return out;
+    }
+};
+
+// Ожидающая подтверждения команда
+struct PendingCommand {
+    std::promise<std::pair<json, int64_t>> ack;     // тело подтверждения и время его прихода
+};
+
 class Logger {
     std::ofstream log_file;
     
@@ -44,64 +117,205 @@ public:
     }
 };
 
-class MqttSender {
+class MqttSender : public virtual mqtt::callback {
     mqtt::async_client client;
-    
+    std::map<std::string, std::shared_ptr<PendingCommand>> pending;
+    std::mutex pending_mutex;
+
 public:
     MqttSender() : client(MQTT_BROKER, "command_phone_gateway") {
+        client.set_callback(*this);
         client.connect()->wait();
+        client.subscribe(MQTT_ACK_TOPIC, 1)->wait();
     }
 
-    void send_message(const std::string& payload) {
-        auto msg = mqtt::make_message(MQTT_TOPIC, payload);  // Отправка в новый топик
+    void send_message(const std::string& topic, const std::string& payload) {
+        auto msg = mqtt::make_message(topic, payload);
         msg->set_qos(1);
         client.publish(msg)->wait();
     }
+
+    // Регистрация до публикации: подтверждение может прийти раньше, чем вернётся publish
+    std::shared_ptr<PendingCommand> expect_ack(const std::string& command_id) {
+        auto command = std::make_shared<PendingCommand>();
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        pending[command_id] = command;
+        return command;
+    }
+
+    void forget(const std::string& command_id) {
+        std::lock_guard<std::mutex> lock(pending_mutex);
+        pending.erase(command_id);
+    }
+
+    void message_arrived(mqtt::const_message_ptr msg) override {
+        int64_t arrived_ms = unix_ms();
+        try {
+            json ack = json::parse(msg->get_payload());
+            std::string command_id = ack.value("command_id", "");
+
+            std::shared_ptr<PendingCommand> command;
+            {
+                std::lock_guard<std::mutex> lock(pending_mutex);
+                auto it = pending.find(command_id);
+                if(it == pending.end()) return;     // опоздавшее или чужое подтверждение
+                command = it->second;
+                pending.erase(it);
+            }
+            command->ack.set_value({ack, arrived_ms});
+        }
+        catch(const std::exception& e) {
+            std::cerr << "Bad command ack: " << e.what() << std::endl;
+        }
+    }
 };
 
-void handle_client(tcp::socket socket, MqttSender& sender, Logger& logger) {
+std::string next_command_id() {
+    static std::atomic<uint64_t> counter{0};
+    return std::to_string(unix_ms()) + "-" + std::to_string(counter++);
+}
+
+// Ответ телефону одной строкой JSON после подтверждения или таймаута:
+//   {"command_id":..., "status":"ack"|"timeout", "ok":..., "latency_ms":{...}}
+// Запрос {"stats": true} возвращает гистограммы задержек
+void handle_client(tcp::socket socket, MqttSender& sender, LatencyStats& stats, Logger& logger) {
     try {
         std::string client_ip = socket.remote_endpoint().address().to_string();
         
         asio::streambuf buf;
         asio::read_until(socket, buf, '\n');
+        int64_t received_ms = unix_ms();
         
         std::istream is(&buf);
         std::string data;
         std::getline(is, data);
         
-        json parsed_config = json::parse(data);
-        
-        logger.log(client_ip, data);
-        sender.send_message(data);
-        
-        std::cout << "Processed request from: " << client_ip << std::endl;
+        json request = json::parse(data);
+        if(!request.is_object() || !request.contains("command")) {
+            if(request.is_object() && request.value("stats", false)) {
+                asio::write(socket, asio::buffer(stats.to_json().dump() + "\n"));
+            }
+            return;
+        }
+
+        std::string device = DEFAULT_DEVICE;
+        if(request.contains("device") && request["device"].is_string()) {
+            device = request["device"].get<std::string>();
+        }
+        int64_t phone_sent_ms = 0;
+        if(request.contains("sent_ms") && request["sent_ms"].is_number_integer()) {
+            phone_sent_ms = request["sent_ms"].get<int64_t>();
+        }
+        std::string command = command_name(request["command"].get<int>());
+        std::string command_id = next_command_id();
+
+        // Служебные поля телефона устройству не нужны, id команды - нужен
+        request.erase("device");
+        request.erase("sent_ms");
+        request["command_id"] = command_id;
+
+        logger.log(client_ip, request.dump());
+        auto pending = sender.expect_ack(command_id);
+        auto ack_future = pending->ack.get_future();
+        try {
+            sender.send_message(command_topic(device), request.dump());
+        } catch(...) {
+            sender.forget(command_id);
+            throw;
+        }
+        int64_t published_ms = unix_ms();
+
+        json reply = {{"command_id", command_id}};
+        json latency = {{"gateway_to_broker", published_ms - received_ms}};
+        if(phone_sent_ms > 0) latency["phone_to_gateway"] = received_ms - phone_sent_ms;
+
+        if(ack_future.wait_for(std::chrono::milliseconds(ACK_TIMEOUT_MS)) == std::future_status::ready) {
+            auto [ack, ack_ms] = ack_future.get();
+            int64_t handle_ms = ack.value("handle_ms", static_cast<int64_t>(0));
+            latency["broker_device_transit"] = ack_ms - published_ms - handle_ms;
+            latency["device_to_actuator"] = handle_ms;
+            latency["total"] = ack_ms - received_ms;
+            reply["status"] = "ack";
+            reply["ok"] = ack.value("ok", false);
+        } else {
+            sender.forget(command_id);
+            stats.add_timeout(command);
+            reply["status"] = "timeout";
+            reply["ok"] = false;
+        }
+        for(const auto& [stage, ms] : latency.items()) stats.add(stage, command, ms.get<int64_t>());
+        reply["latency_ms"] = latency;
+
+        asio::write(socket, asio::buffer(reply.dump() + "\n"));
+        std::cout << "Processed " << command << " from " << client_ip << ": " << reply.dump() << std::endl;
     }
     catch(const std::exception& e) {
         std::cerr << "Error: " << e.what() << std::endl;
     }
 }
 
-int main() {
+// Слушающий сокет с SO_REUSEPORT: таких на порту может быть несколько, подключения между ними
+// распределяет ядро, и единственный поток accept перестаёт быть узким местом
+tcp::acceptor make_acceptor(asio::io_context& io_context) {
+    tcp::acceptor acceptor(io_context);
+    acceptor.open(tcp::v4());
+    acceptor.set_option(tcp::acceptor::reuse_address(true));
+    acceptor.set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+    acceptor.bind(tcp::endpoint(tcp::v4(), TCP_PORT));
+    acceptor.listen();
+    return acceptor;
+}
+
+// --acceptors N: число потоков приёма подключений (по умолчанию 1)
+unsigned acceptor_count(int argc, char* argv[]) {
+    if(argc > 2 && std::string(argv[1]) == "--acceptors") return std::max(1, std::atoi(argv[2]));
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
     try {
         std::ofstream tmp(LOG_FILE, std::ios::app);
         tmp.close();
 
         asio::io_context io_context;
-        tcp::acceptor acceptor(io_context, tcp::endpoint(tcp::v4(), TCP_PORT));  // Порт 1490
+        std::vector<tcp::acceptor> acceptors;
+        for(unsigned i = 0; i < acceptor_count(argc, argv); i++) {
+            acceptors.push_back(make_acceptor(io_context));  // Порт 1490
+        }
         MqttSender sender;
+        LatencyStats stats;
         Logger logger;
 
+        // Периодический срез гистограмм в журнал службы: по нему видно регрессии задержки команд
+        std::thread([&stats]() {
+            while(true) {
+                std::this_thread::sleep_for(std::chrono::seconds(STATS_REPORT_INTERVAL_SEC));
+                std::cout << "Command latency: " << stats.to_json().dump() << std::endl;
+            }
+        }).detach();
+
         std::cout << "Phone Command Service started on port " << TCP_PORT << std::endl;
 
-        while(true) {
-            tcp::socket socket(io_context);
-            acceptor.accept(socket);
-            
-            std::thread([s = std::move(socket), &sender, &logger]() mutable {
-                handle_client(std::move(s), sender, logger);
+        auto accept_loop = [&](tcp::acceptor& acceptor) {
+            while(true) {
+                tcp::socket socket(io_context);
+                acceptor.accept(socket);
+
+                std::thread([s = std::move(socket), &sender, &stats, &logger]() mutable {
+                    handle_client(std::move(s), sender, stats, logger);
+                }).detach();
+            }
+        };
+        for(size_t i = 1; i < acceptors.size(); i++) {
+            std::thread([&accept_loop, &acceptor = acceptors[i]]() {
+                try {
+                    accept_loop(acceptor);
+                } catch(const std::exception& e) {
+                    std::cerr << "Acceptor error: " << e.what() << std::endl;
+                }
             }).detach();
         }
+        accept_loop(acceptors[0]);
     }
     catch(const std::exception& e) {
         std::cerr << "Fatal error: " << e.what() << std::endl;
@@ -0,0 +1,110 @@
+#pragma once
+
+// Задержки по участкам пути показания "датчик -> телефон", по устройствам.
+// Гистограммы с фиксированными границами корзин, накопленные с запуска службы.
+// Раз в минуту снимок пишется в таблицу latency_stats (service, device, hop) - data.cpp
+// и logs.cpp пишут один формат, по нему считает утилита LATENCY. Гистограмма этапов
+// команд command.cpp - та же
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <utility>
+#include <iterator>
+#include <algorithm>
+#include <cstdint>
+#include <nlohmann/json.hpp>
+
+class LatencyHistogram {
+public:
+    // Участки от миллисекунд (брокер, запись в БД) до минут (ожидание опроса телефоном)
+    static constexpr int64_t BOUNDS_MS[] = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000,
+                                            20000, 30000, 60000, 120000, 300000, 600000, 1800000, 3600000};
+    static constexpr size_t BUCKETS = sizeof(BOUNDS_MS) / sizeof(BOUNDS_MS[0]) + 1;
+
+private:
+    uint64_t counts[BUCKETS] = {};
+    uint64_t total = 0;
+    uint64_t negative = 0;
+    int64_t sum_ms = 0;
+    int64_t max_ms = 0;
+
+public:
+    // Отрицательное значение на участке между разными часами - расхождение часов:
+    // считается как 0 и отдельно
+    void add(int64_t ms) {
+        if (ms < 0) negative++;
+        ms = std::max<int64_t>(ms, 0);
+        size_t i = std::lower_bound(std::begin(BOUNDS_MS), std::end(BOUNDS_MS), ms) - std::begin(BOUNDS_MS);
+        counts[i]++;
+        total++;
+        sum_ms += ms;
+        max_ms = std::max(max_ms, ms);
+    }
+
+    // Верхняя граница корзины, в которую попадает перцентиль q
+    int64_t percentile(double q) const {
+        if (total == 0) return 0;
+        uint64_t rank = static_cast<uint64_t>(q * (total - 1)) + 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= rank) return i < BUCKETS - 1 ? std::min(BOUNDS_MS[i], max_ms) : max_ms;
+        }
+        return max_ms;
+    }
+
+    nlohmann::json to_json() const {
+        nlohmann::json buckets = nlohmann::json::object();
+        for (size_t i = 0; i < BUCKETS; i++) {
+            if (counts[i] == 0) continue;
+            buckets[i < BUCKETS - 1 ? "le_" + std::to_string(BOUNDS_MS[i]) : "inf"] = counts[i];
+        }
+        return {
+            {"count", total},
+            {"negative", negative},
+            {"mean_ms", total ? sum_ms / static_cast<int64_t>(total) : 0},
+            {"p50_ms", percentile(0.5)},
+            {"p90_ms", percentile(0.9)},
+            {"p99_ms", percentile(0.99)},
+            {"max_ms", max_ms},
+            {"buckets", buckets}
+        };
+    }
+};
+
+class TraceStats {
+    std::map<std::pair<std::string, std::string>, LatencyHistogram> hops;   // (устройство, участок)
+    std::mutex mtx;
+
+public:
+    struct Entry {
+        std::string device;
+        std::string hop;
+        std::string histogram;  // JSON
+    };
+
+    void add(const std::string& device, const std::string& hop, int64_t ms) {
+        std::lock_guard<std::mutex> lock(mtx);
+        hops[{device.empty() ? "_all" : device, hop}].add(ms);
+    }
+
+    std::vector<Entry> snapshot() {
+        std::lock_guard<std::mutex> lock(mtx);
+        std::vector<Entry> entries;
+        for (const auto& [key, histogram] : hops) {
+            entries.push_back({key.first, key.second, histogram.to_json().dump()});
+        }
+        return entries;
+    }
+
+    nlohmann::json to_json() {
+        std::lock_guard<std::mutex> lock(mtx);
+        nlohmann::json out = nlohmann::json::object();
+        for (const auto& [key, histogram] : hops) {
+            out[key.first][key.second] = histogram.to_json();
+        }
+        return out;
+    }
+};
@@ -4,6 +4,14 @@
 #include <chrono>
 #include <ctime>
 #include <thread>
+#include <mutex>
+#include <map>
+#include <vector>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <algorithm>
 #include <boost/asio.hpp>
 #include <mqtt/async_client.h>
 #include <nlohmann/json.hpp>
@@ -14,9 +22,149 @@ using json = nlohmann::json;
 
 // Конфигурация
 const std::string MQTT_BROKER = "tcp://localhost:1883";
-const std::string MQTT_TOPIC = "/farm001/config";
+const std::string DEFAULT_DEVICE = "farm001";
 const int TCP_PORT = 1489;
 const std::string LOG_FILE = "/var/log/phone_command.log";
+// Последний принятый конфиг каждого устройства: с ним сравниваются новые
+const std::string ACCEPTED_FILE = "/home/tovarichkek/services/control_phone_config/accepted_config.json";
+
+std::string config_topic(const std::string& device) {
+    return "/" + device + "/config";
+}
+
+// Схема ключей controller/IoP_Farm/data/default_config.json.
+// Контроллер сливает пришедший JSON с текущим конфигом, поэтому можно слать только изменённые ключи
+enum class KeyType { Number, Time };
+
+struct KeySchema {
+    const char* key;
+    KeyType type;
+    double min;
+    double max;
+};
+
+const KeySchema CONFIG_SCHEMA[] = {
+    {"pump_interval_days",   KeyType::Number, 0.1, 365},
+    {"pump_start",           KeyType::Time,   0,   0},
+    {"pump_volume_ml",       KeyType::Number, 1,   10000},
+    {"heatlamp_target_temp", KeyType::Number, 0,   50},
+    {"growlight_on",         KeyType::Time,   0,   0},
+    {"growlight_off",        KeyType::Time,   0,   0},
+};
+
+const KeySchema* find_key(const std::string& key) {
+    for(const auto& k : CONFIG_SCHEMA) {
+        if(key == k.key) return &k;
+    }
+    return nullptr;
+}
+
+// "H:MM" / "HH:MM" -> "HH:MM": контроллер берёт часы и минуты по фиксированным позициям
+bool canonical_time(const std::string& value, std::string& out) {
+    // Строго H:MM или HH:MM - без пробелов и знаков, которые пропустил бы sscanf
+    size_t colon = value.find(':');
+    if(colon < 1 || colon > 2 || value.size() != colon + 3) return false;
+    for(size_t i = 0; i < value.size(); i++) {
+        if(i != colon && !std::isdigit(static_cast<unsigned char>(value[i]))) return false;
+    }
+    int hour = std::stoi(value.substr(0, colon));
+    int minute = std::stoi(value.substr(colon + 1));
+    if(hour > 23 || minute > 59) return false;
+    char buf[6];
+    std::snprintf(buf, sizeof(buf), "%02d:%02d", hour, minute);
+    out = buf;
+    return true;
+}
+
+// Проверяет конфиг по схеме и приводит значения к каноническому виду
+// (целые числа без дробной части, время с ведущим нулём). Ошибки - в errors
+json canonicalize_config(const json& config, std::vector<std::string>& errors) {
+    json canonical = json::object();
+    if(!config.is_object()) {
+        errors.push_back("config must be a JSON object");
+        return canonical;
+    }
+    for(const auto& [key, value] : config.items()) {
+        const KeySchema* schema = find_key(key);
+        if(!schema) {
+            errors.push_back("unknown key: " + key);
+            continue;
+        }
+        if(schema->type == KeyType::Time) {
+            std::string time;
+            if(!value.is_string() || !canonical_time(value.get<std::string>(), time)) {
+                errors.push_back(key + ": expected time HH:MM");
+                continue;
+            }
+            canonical[key] = time;
+        } else {
+            if(!value.is_number()) {
+                errors.push_back(key + ": expected number");
+                continue;
+            }
+            double number = value.get<double>();
+            if(!std::isfinite(number) || number < schema->min || number > schema->max) {
+                errors.push_back(key + ": out of range [" + json(schema->min).dump() + ", " +
+                                 json(schema->max).dump() + "]");
+                continue;
+            }
+            if(number == std::floor(number)) canonical[key] = static_cast<int64_t>(number);
+            else canonical[key] = number;
+        }
+    }
+    return canonical;
+}
+
+// Хранилище последних принятых конфигов по устройствам (переживает перезапуск службы)
+class AcceptedConfigs {
+    json configs = json::object();
+    std::mutex mtx;
+
+    void save() {
+        std::string tmp_path = ACCEPTED_FILE + ".tmp";
+        {
+            std::ofstream out(tmp_path, std::ios::trunc);
+            out << configs.dump(4);
+            if(!out) throw std::runtime_error("Cannot write " + tmp_path);
+        }
+        if(std::rename(tmp_path.c_str(), ACCEPTED_FILE.c_str()) != 0) {
+            throw std::runtime_error("Cannot replace " + ACCEPTED_FILE);
+        }
+    }
+
+public:
+    AcceptedConfigs() {
+        std::ifstream in(ACCEPTED_FILE);
+        if(in.is_open()) {
+            try {
+                configs = json::parse(in);
+            } catch(const std::exception& e) {
+                std::cerr << "Ignoring broken " << ACCEPTED_FILE << ": " << e.what() << std::endl;
+            }
+        }
+        if(!configs.is_object()) configs = json::object();
+    }
+
+    // Под одной блокировкой: вычисляет изменённые ключи, публикует их и запоминает результат.
+    // force - отправить весь пришедший конфиг (например, после сброса контроллера)
+    template<class Publish>
+    json apply(const std::string& device, const json& canonical, bool force, Publish publish) {
+        std::lock_guard<std::mutex> lock(mtx);
+        json& accepted = configs[device];
+        if(!accepted.is_object()) accepted = json::object();
+
+        json changed = json::object();
+        for(const auto& [key, value] : canonical.items()) {
+            if(force || !accepted.contains(key) || accepted[key] != value) changed[key] = value;
+        }
+        if(changed.empty()) return changed;
+
+        publish(changed.dump());
+        accepted.update(changed);
+        save();
+        return changed;
+    }
+};
 
 class Logger {
     std::ofstream log_file;
@@ -52,14 +200,20 @@ public:
         client.connect()->wait();
     }
 
-    void send_message(const std::string& payload) {
-        auto msg = mqtt::make_message(MQTT_TOPIC, payload);
+    void send_message(const std::string& topic, const std::string& payload) {
+        auto msg = mqtt::make_message(topic, payload);
         msg->set_qos(1);
         client.publish(msg)->wait();
     }
 };
 
-void handle_client(tcp::socket socket, MqttSender& sender, Logger& logger) {
+// Ответ телефону одной строкой JSON:
+//   {"status":"ok","changed":{...}} | {"status":"unchanged"} | {"status":"error","errors":[...]}
+void send_reply(tcp::socket& socket, const json& reply) {
+    asio::write(socket, asio::buffer(reply.dump() + "\n"));
+}
+
+void handle_client(tcp::socket socket, MqttSender& sender, AcceptedConfigs& accepted, Logger& logger) {
     try {
         std::string client_ip = socket.remote_endpoint().address().to_string();
         
@@ -70,12 +224,43 @@ void handle_client(tcp::socket socket, MqttSender& sender, Logger& logger) {
         std::string data;
         std::getline(is, data);
         
-        // Явно используем результат парсинга
-        json parsed_config = json::parse(data); // Валидация JSON
-        
-        logger.log(client_ip, data);
-        sender.send_message(data);
-        
+        json parsed_config = json::parse(data);
+
+        // Служебные поля запроса в контроллер не уходят
+        std::string device = DEFAULT_DEVICE;
+        bool force = false;
+        if(parsed_config.is_object()) {
+            if(parsed_config.contains("device") && parsed_config["device"].is_string()) {
+                device = parsed_config["device"].get<std::string>();
+            }
+            if(parsed_config.contains("force") && parsed_config["force"].is_boolean()) {
+                force = parsed_config["force"].get<bool>();
+            }
+            parsed_config.erase("device");
+            parsed_config.erase("force");
+        }
+
+        std::vector<std::string> errors;
+        json canonical = canonicalize_config(parsed_config, errors);
+        if(!errors.empty()) {
+            logger.log(client_ip, "REJECTED " + data);
+            send_reply(socket, {{"status", "error"}, {"errors", errors}});
+            std::cerr << "Rejected config from " << client_ip << ": " << errors.front() << std::endl;
+            return;
+        }
+
+        json changed = accepted.apply(device, canonical, force, [&](const std::string& payload) {
+            sender.send_message(config_topic(device), payload);
+        });
+
+        if(changed.empty()) {
+            send_reply(socket, {{"status", "unchanged"}});
+            std::cout << "Config from " << client_ip << " unchanged, nothing published" << std::endl;
+            return;
+        }
+
+        logger.log(client_ip, changed.dump());
+        send_reply(socket, {{"status", "ok"}, {"changed", changed}});
         std::cout << "Processed request from: " << client_ip << std::endl;
     }
     catch(const std::exception& e) {
@@ -83,27 +268,61 @@ void handle_client(tcp::socket socket, MqttSender& sender, Logger& logger) {
     }
 }
 
-int main() {
+// Слушающий сокет с SO_REUSEPORT: таких на порту может быть несколько, подключения между ними
+// распределяет ядро, и единственный поток accept перестаёт быть узким местом
+tcp::acceptor make_acceptor(asio::io_context& io_context) {
+    tcp::acceptor acceptor(io_context);
+    acceptor.open(tcp::v4());
+    acceptor.set_option(tcp::acceptor::reuse_address(true));
+    acceptor.set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+    acceptor.bind(tcp::endpoint(tcp::v4(), TCP_PORT));
+    acceptor.listen();
+    return acceptor;
+}
+
+// --acceptors N: число потоков приёма подключений (по умолчанию 1)
+unsigned acceptor_count(int argc, char* argv[]) {
+    if(argc > 2 && std::string(argv[1]) == "--acceptors") return std::max(1, std::atoi(argv[2]));
+    return 1;
+}
+
+int main(int argc, char* argv[]) {
     try {
         // Создание лог-файла с правами
         std::ofstream tmp(LOG_FILE, std::ios::app);
         tmp.close();
 
         asio::io_context io_context;
-        tcp::acceptor acceptor(io_context, tcp::endpoint(tcp::v4(), TCP_PORT));
+        std::vector<tcp::acceptor> acceptors;
+        for(unsigned i = 0; i < acceptor_count(argc, argv); i++) {
+            acceptors.push_back(make_acceptor(io_context));
+        }
         MqttSender sender;
+        AcceptedConfigs accepted;
         Logger logger;
 
         std::cout << "Phone Command Service started on port " << TCP_PORT << std::endl;
 
-        while(true) {
-            tcp::socket socket(io_context);
-            acceptor.accept(socket);
-            
-            std::thread([s = std::move(socket), &sender, &logger]() mutable {
-                handle_client(std::move(s), sender, logger);
+        auto accept_loop = [&](tcp::acceptor& acceptor) {
+            while(true) {
+                tcp::socket socket(io_context);
+                acceptor.accept(socket);
+
+                std::thread([s = std::move(socket), &sender, &accepted, &logger]() mutable {
+                    handle_client(std::move(s), sender, accepted, logger);
+                }).detach();
+            }
+        };
+        for(size_t i = 1; i < acceptors.size(); i++) {
+            std::thread([&accept_loop, &acceptor = acceptors[i]]() {
+                try {
+                    accept_loop(acceptor);
+                } catch(const std::exception& e) {
+                    std::cerr << "Acceptor error: " << e.what() << std::endl;
+                }
             }).detach();
         }
+        accept_loop(acceptors[0]);
     }
     catch(const std::exception& e) {
         std::cerr << "Fatal error: " << e.what() << std::endl;
@@ -0,0 +1,179 @@
+#pragma once
+
+// Потоковое обнаружение аномалий в показаниях.
+// На каждый ряд (устройство, поле) хранится O(1) состояния: EWMA среднего и
+// дисперсии, последнее значение и его время. На вход подаются показания по
+// порядку времени (после буфера переупорядочивания), на выход - события:
+//   sensor_fault - датчик вернул код ошибки (-100 / -50) или 85 °C у DS18B20 (значение после сброса)
+//   out_of_range - значение вне физических пределов поля
+//   rate         - скорость изменения выше допустимой (для уровня воды - падение, утечка)
+//   deviation    - отклонение от EWMA больше DEVIATION_Z сигм
+//   stale        - устройство молчит дольше STALE_AFTER_SEC
+// Событие отправляется при возникновении (state = "raised") и при возврате
+// в норму (state = "resolved"), повторные показания в том же состоянии молчат
+
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+struct FieldLimits {
+    const char* field;
+    double min;
+    double max;
+    double max_rise_per_min;    // 0 - не проверяется
+    double max_drop_per_min;    // 0 - не проверяется
+    double min_stddev;          // нижняя граница сигмы, чтобы ровный ряд не давал ложных срабатываний
+};
+
+// Порядок полей - как в SENSOR_FIELDS (data.cpp).
+// Уровень воды, влажность и освещённость - в процентах, температуры - в °C
+const FieldLimits FIELD_LIMITS[] = {
+    {"temperature_DHT22",   -40.0,  80.0,  5.0,  5.0, 0.5},
+    {"temperature_DS18B20", -10.0,  60.0,  3.0,  3.0, 0.3},
+    {"humidity",              0.0, 100.0, 30.0, 30.0, 2.0},
+    {"water_level",           0.0, 120.0,  0.0,  5.0, 1.0},
+    {"soil_moisture",         0.0, 100.0, 30.0, 30.0, 2.0},
+    {"light_intensity",       0.0, 100.0,  0.0,  0.0, 5.0},
+};
+
+struct AlertEvent {
+    std::string device;
+    std::string field;          // пустое для stale
+    std::string kind;
+    bool raised;
+    double value;
+    double expected;            // EWMA на момент события
+    int64_t timestamp_unix;
+};
+
+class AnomalyDetector {
+public:
+    static constexpr double EWMA_ALPHA = 0.05;
+    static constexpr double DEVIATION_Z = 6.0;
+    static constexpr uint64_t WARMUP_SAMPLES = 30;
+    static constexpr int64_t MAX_RATE_GAP_SEC = 600;
+    static constexpr int64_t STALE_AFTER_SEC = 60;
+    static constexpr double DS18B20_RESET_VALUE = 85.0;
+    static constexpr double SENSOR_ERROR_VALUE = -100.0;
+    static constexpr double NO_DATA_VALUE = -50.0;
+
+private:
+    enum Kind { FAULT = 1, RANGE = 2, RATE = 4, DEVIATION = 8 };
+
+    struct SeriesState {
+        double mean = 0;
+        double var = 0;
+        double last_value = 0;
+        int64_t last_ts = 0;
+        uint64_t samples = 0;
+        unsigned active = 0;    // маска поднятых событий
+    };
+
+    struct DeviceState {
+        int64_t last_seen_unix = 0;     // время сервера, а не устройства: часы фермы могут стоять
+        int64_t last_ts = 0;
+        bool stale = false;
+        std::vector<SeriesState> series;
+    };
+
+    std::map<std::string, DeviceState> devices;
+
+    static const char* kind_name(Kind kind) {
+        switch(kind) {
+            case FAULT: return "sensor_fault";
+            case RANGE: return "out_of_range";
+            case RATE: return "rate";
+            default: return "deviation";
+        }
+    }
+
+    static bool is_fault(const FieldLimits& limits, double value) {
+        if (std::isnan(value) || value == SENSOR_ERROR_VALUE || value == NO_DATA_VALUE) return true;
+        return std::string(limits.field) == "temperature_DS18B20" && value == DS18B20_RESET_VALUE;
+    }
+
+    // Поднимает или снимает событие, если его состояние изменилось
+    static void update(std::vector<AlertEvent>& out, const std::string& device, const FieldLimits& limits,
+                       SeriesState& s, Kind kind, bool active, double value, int64_t ts) {
+        bool was_active = s.active & kind;
+        if (active == was_active) return;
+        s.active = active ? (s.active | kind) : (s.active & ~kind);
+        out.push_back({device, limits.field, kind_name(kind), active, value, s.mean, ts});
+    }
+
+public:
+    // Показания одного сообщения. received_unix - время прихода на сервер
+    std::vector<AlertEvent> observe(const std::string& device, int64_t ts, int64_t received_unix,
+                                    const double* values) {
+        std::vector<AlertEvent> out;
+        const size_t count = sizeof(FIELD_LIMITS) / sizeof(FIELD_LIMITS[0]);
+
+        DeviceState& d = devices[device];
+        if (d.series.empty()) d.series.resize(count);
+        d.last_seen_unix = std::max(d.last_seen_unix, received_unix);
+        if (d.stale) {
+            d.stale = false;
+            out.push_back({device, "", "stale", false, 0, 0, ts});
+        }
+        // Повтор или опоздавшее показание уже учтено в статистике
+        if (ts <= d.last_ts) return out;
+        d.last_ts = ts;
+
+        for (size_t i = 0; i < count; i++) {
+            const FieldLimits& limits = FIELD_LIMITS[i];
+            SeriesState& s = d.series[i];
+            double x = values[i];
+
+            bool fault = is_fault(limits, x);
+            update(out, device, limits, s, FAULT, fault, x, ts);
+            if (fault) continue;
+
+            bool out_of_range = x < limits.min || x > limits.max;
+            update(out, device, limits, s, RANGE, out_of_range, x, ts);
+            if (out_of_range) continue;
+
+            if (s.samples > 0) {
+                int64_t dt = ts - s.last_ts;
+                bool too_fast = false;
+                if (dt > 0 && dt <= MAX_RATE_GAP_SEC) {
+                    double per_min = (x - s.last_value) * 60.0 / dt;
+                    too_fast = (limits.max_rise_per_min > 0 && per_min > limits.max_rise_per_min) ||
+                               (limits.max_drop_per_min > 0 && -per_min > limits.max_drop_per_min);
+                }
+                update(out, device, limits, s, RATE, too_fast, x, ts);
+            }
+
+            double diff = x - s.mean;
+            if (s.samples >= WARMUP_SAMPLES) {
+                double sigma = std::max(std::sqrt(s.var), limits.min_stddev);
+                update(out, device, limits, s, DEVIATION, std::fabs(diff) > DEVIATION_Z * sigma, x, ts);
+            }
+
+            if (s.samples == 0) {
+                s.mean = x;
+            } else {
+                s.mean += EWMA_ALPHA * diff;
+                s.var = (1 - EWMA_ALPHA) * (s.var + EWMA_ALPHA * diff * diff);
+            }
+            s.last_value = x;
+            s.last_ts = ts;
+            s.samples++;
+        }
+        return out;
+    }
+
+    // Вызывается по таймеру: устройства, от которых давно нет показаний
+    std::vector<AlertEvent> check_stale(int64_t now_unix) {
+        std::vector<AlertEvent> out;
+        for (auto& [device, d] : devices) {
+            if (!d.stale && now_unix - d.last_seen_unix > STALE_AFTER_SEC) {
+                d.stale = true;
+                out.push_back({device, "", "stale", true, 0, 0, now_unix});
+            }
+        }
+        return out;
+    }
+};
@@ -0,0 +1,564 @@
+#pragma once
+
+// Встроенный MQTT 3.1.1 брокер (DATA --broker) вместо внешнего mosquitto.
+// Устройства и остальные службы подключаются к нему как раньше, по tcp://localhost:1883.
+// Сообщения по фильтрам subscribe_local уходят обработчикам в процессе напрямую, в потоке
+// соединения отправителя и до PUBACK: показание подтверждается устройству, только когда
+// оно уже в журнале, без второго сетевого перехода и копии через клиента paho.
+// Поддерживаются QoS 0 и 1 (подписка на QoS 2 получает 1, публикация с QoS 2 закрывает
+// соединение), retained-сообщения, will и постоянные сессии (clean session = 0): подписки и
+// неподтверждённые QoS 1 переживают отключение клиента и досылаются при переподключении.
+// В пути у подписчика не больше MAX_QUEUED QoS 1, остальные ждут PUBACK в очереди сессии
+// (до MAX_QUEUED, старые вытесняются с предупреждением). Сессии и retained живут в памяти процесса.
+// Поток на соединение: клиентов у фермы единицы. Запись в сокет - под мьютексом соединения
+// с таймаутом SEND_TIMEOUT_SEC, зависший подписчик отключается и не держит отправителя
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <stdexcept>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+struct BrokerMessage {
+    std::string topic;
+    std::string payload;
+    int qos = 0;
+    bool retain = false;
+};
+
+// Фильтр подписки MQTT: + - один уровень, # - последний уровень и всё ниже.
+// Топики на $ не попадают под фильтры, начинающиеся с подстановки
+inline bool topic_matches(const std::string& filter, const std::string& topic) {
+    if (!topic.empty() && topic[0] == '$' && !filter.empty() && (filter[0] == '+' || filter[0] == '#')) return false;
+    size_t f = 0, t = 0;
+    while (true) {
+        size_t f_end = std::min(filter.find('/', f), filter.size());
+        size_t t_end = std::min(topic.find('/', t), topic.size());
+        if (filter.compare(f, f_end - f, "#") == 0) return true;
+        if (filter.compare(f, f_end - f, "+") != 0 &&
+            filter.compare(f, f_end - f, topic, t, t_end - t) != 0) return false;
+        bool filter_last = f_end == filter.size();
+        bool topic_last = t_end == topic.size();
+        if (filter_last || topic_last) {
+            // "a/#" подходит и для самого "a"
+            return topic_last && (filter_last || filter.compare(f_end, std::string::npos, "/#") == 0);
+        }
+        f = f_end + 1;
+        t = t_end + 1;
+    }
+}
+
+inline bool valid_filter(const std::string& filter) {
+    if (filter.empty()) return false;
+    for (size_t i = 0; i < filter.size(); i++) {
+        bool level_start = i == 0 || filter[i - 1] == '/';
+        bool level_end = i + 1 == filter.size() || filter[i + 1] == '/';
+        if (filter[i] == '+' && (!level_start || !level_end)) return false;
+        if (filter[i] == '#' && (!level_start || i + 1 != filter.size())) return false;
+    }
+    return true;
+}
+
+class MqttBroker {
+public:
+    using LocalHandler = std::function<void(const std::string& topic, const std::string& payload)>;
+
+    static constexpr size_t MAX_PACKET = 256 * 1024;
+    static constexpr size_t MAX_QUEUED = 1000;      // QoS 1 на сессию: в пути и ждущие переподключения
+    static constexpr int CONNECT_TIMEOUT_SEC = 10;
+    static constexpr int SEND_TIMEOUT_SEC = 5;
+
+private:
+    enum PacketType : uint8_t {
+        CONNECT = 1, CONNACK = 2, PUBLISH = 3, PUBACK = 4, SUBSCRIBE = 8, SUBACK = 9,
+        UNSUBSCRIBE = 10, UNSUBACK = 11, PINGREQ = 12, PINGRESP = 13, DISCONNECT = 14
+    };
+
+    struct Packet {
+        uint8_t header = 0;
+        std::string body;
+        uint8_t type() const { return header >> 4; }
+    };
+
+    // Разбор тела пакета: при нехватке байт - исключение, соединение закрывается
+    class Reader {
+        const std::string& body;
+        size_t pos = 0;
+
+        void need(size_t n) const {
+            if (body.size() - pos < n) throw std::runtime_error("malformed packet");
+        }
+
+    public:
+        explicit Reader(const std::string& body) : body(body) {}
+        bool done() const { return pos == body.size(); }
+        uint8_t u8() {
+            need(1);
+            return static_cast<uint8_t>(body[pos++]);
+        }
+        uint16_t u16() {
+            uint16_t hi = u8();
+            return static_cast<uint16_t>(hi << 8 | u8());
+        }
+        std::string str() {
+            size_t n = u16();
+            need(n);
+            std::string s = body.substr(pos, n);
+            pos += n;
+            return s;
+        }
+        std::string rest() {
+            std::string s = body.substr(pos);
+            pos = body.size();
+            return s;
+        }
+    };
+
+    struct Connection {
+        int fd;
+        bool open = true;
+        std::mutex write_mutex;
+        explicit Connection(int fd) : fd(fd) {}
+    };
+
+    struct Session {
+        std::string client_id;
+        bool clean = true;
+        std::map<std::string, int> subscriptions;       // фильтр -> выданный QoS
+        std::map<uint16_t, BrokerMessage> inflight;     // отправлены с QoS 1, ждут PUBACK
+        std::deque<BrokerMessage> queued;               // QoS 1, пришедшие, пока клиент отключён
+        uint16_t next_id = 1;
+        std::shared_ptr<Connection> connection;         // пусто - клиент отключён
+    };
+
+    using Outgoing = std::vector<std::pair<std::shared_ptr<Connection>, std::string>>;
+
+    unsigned short port;
+    int listen_fd = -1;
+    std::thread acceptor;
+    std::vector<std::pair<std::string, LocalHandler>> local;
+    std::map<std::string, std::shared_ptr<Session>> sessions;
+    std::map<std::string, BrokerMessage> retained;
+    uint64_t anonymous = 0;
+    std::mutex mtx;
+
+    static void put_u16(std::string& out, uint16_t v) {
+        out += static_cast<char>(v >> 8);
+        out += static_cast<char>(v & 0xFF);
+    }
+
+    static std::string packet(uint8_t header, const std::string& body) {
+        std::string out(1, static_cast<char>(header));
+        size_t length = body.size();
+        do {
+            uint8_t byte = length % 128;
+            length /= 128;
+            if (length > 0) byte |= 0x80;
+            out += static_cast<char>(byte);
+        } while (length > 0);
+        return out + body;
+    }
+
+    static std::string ack(PacketType type, uint16_t id) {
+        std::string body;
+        put_u16(body, id);
+        return packet(type << 4, body);
+    }
+
+    static std::string publish_packet(const BrokerMessage& m, uint16_t id, bool dup) {
+        std::string body;
+        put_u16(body, static_cast<uint16_t>(m.topic.size()));
+        body += m.topic;
+        if (m.qos > 0) put_u16(body, id);
+        body += m.payload;
+        return packet(static_cast<uint8_t>(PUBLISH << 4 | (dup ? 0x08 : 0) | m.qos << 1 | (m.retain ? 1 : 0)), body);
+    }
+
+    static bool read_exact(int fd, char* data, size_t n) {
+        while (n > 0) {
+            ssize_t got = recv(fd, data, n, 0);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) return false;
+            data += got;
+            n -= static_cast<size_t>(got);
+        }
+        return true;
+    }
+
+    // false - соединение закрыто, ошибка или истёк keep-alive
+    static bool read_packet(int fd, Packet& p) {
+        char header;
+        if (!read_exact(fd, &header, 1)) return false;
+        p.header = static_cast<uint8_t>(header);
+        size_t length = 0;
+        for (int shift = 0;; shift += 7) {
+            char byte;
+            if (shift > 21 || !read_exact(fd, &byte, 1)) return false;
+            length |= static_cast<size_t>(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) break;
+        }
+        if (length > MAX_PACKET) throw std::runtime_error("packet too large");
+        p.body.resize(length);
+        return read_exact(fd, &p.body[0], length);
+    }
+
+    static void set_timeout(int fd, int option, int seconds) {
+        timeval tv{seconds, 0};
+        setsockopt(fd, SOL_SOCKET, option, &tv, sizeof(tv));
+    }
+
+    // Под write_mutex соединения
+    static void write_all(Connection& c, const std::string& bytes) {
+        size_t sent = 0;
+        while (c.open && sent < bytes.size()) {
+            ssize_t n = ::send(c.fd, bytes.data() + sent, bytes.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                // Поток чтения этого соединения проснётся и уберёт его
+                shutdown(c.fd, SHUT_RDWR);
+                c.open = false;
+                return;
+            }
+            sent += static_cast<size_t>(n);
+        }
+    }
+
+    static void send(Connection& c, const std::string& bytes) {
+        std::lock_guard<std::mutex> lock(c.write_mutex);
+        write_all(c, bytes);
+    }
+
+    static void drop(Connection& c) {
+        std::lock_guard<std::mutex> lock(c.write_mutex);
+        if (c.open) shutdown(c.fd, SHUT_RDWR);
+        c.open = false;
+    }
+
+    static void flush(const Outgoing& out) {
+        for (const auto& [connection, bytes] : out) send(*connection, bytes);
+    }
+
+    // Под mtx
+    static uint16_t take_id(Session& s) {
+        while (s.next_id == 0 || s.inflight.count(s.next_id)) s.next_id++;
+        return s.next_id++;
+    }
+
+    // Под mtx: QoS 1 ждёт PUBACK в inflight. При отключённом клиенте и полном inflight
+    // (медленный подписчик) - в очереди сессии по порядку, досылается по мере PUBACK.
+    // Переполненная очередь вытесняет самое старое сообщение с предупреждением в журнал
+    static void deliver(Session& s, BrokerMessage m, Outgoing& out) {
+        if (!s.connection && m.qos == 0) return;
+        if (m.qos > 0 && (!s.connection || s.inflight.size() >= MAX_QUEUED || !s.queued.empty())) {
+            if (s.queued.size() >= MAX_QUEUED) {
+                std::cerr << "MQTT broker: session " << s.client_id << " queue is full, dropping QoS 1 message on "
+                          << s.queued.front().topic << std::endl;
+                s.queued.pop_front();
+            }
+            s.queued.push_back(std::move(m));
+            return;
+        }
+        uint16_t id = 0;
+        if (m.qos > 0) {
+            id = take_id(s);
+            s.inflight[id] = m;
+        }
+        out.emplace_back(s.connection, publish_packet(m, id, false));
+    }
+
+    // Под mtx: очередь сессии - в inflight, пока есть место
+    static void release_queued(Session& s, Outgoing& out) {
+        while (s.connection && !s.queued.empty() && s.inflight.size() < MAX_QUEUED) {
+            uint16_t id = take_id(s);
+            s.inflight[id] = std::move(s.queued.front());
+            s.queued.pop_front();
+            out.emplace_back(s.connection, publish_packet(s.inflight[id], id, false));
+        }
+    }
+
+    void route(const BrokerMessage& m) {
+        for (const auto& [filter, handler] : local) {
+            if (topic_matches(filter, m.topic)) handler(m.topic, m.payload);
+        }
+        Outgoing out;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (m.retain) {
+                if (m.payload.empty()) retained.erase(m.topic);
+                else retained[m.topic] = m;
+            }
+            for (auto& [id, s] : sessions) {
+                // Пересекающиеся подписки - одна копия с наибольшим QoS
+                int qos = -1;
+                for (const auto& [filter, granted] : s->subscriptions) {
+                    if (topic_matches(filter, m.topic)) qos = std::max(qos, granted);
+                }
+                if (qos < 0) continue;
+                deliver(*s, {m.topic, m.payload, std::min(qos, m.qos), false}, out);
+            }
+        }
+        flush(out);
+    }
+
+    // CONNACK и досылка сессии - под write_mutex соединения, чтобы чужие публикации
+    // не обогнали CONNACK. Пусто - подключение отклонено
+    std::shared_ptr<Session> handle_connect(const std::shared_ptr<Connection>& c, const Packet& p,
+                                            std::unique_ptr<BrokerMessage>& will, int& keep_alive) {
+        Reader r(p.body);
+        std::string protocol = r.str();
+        uint8_t level = r.u8();
+        uint8_t flags = r.u8();
+        keep_alive = r.u16();
+        std::string client_id = r.str();
+        if (flags & 0x04) {
+            will.reset(new BrokerMessage);
+            will->topic = r.str();
+            will->payload = r.str();
+            will->qos = std::min((flags >> 3) & 3, 1);
+            will->retain = flags & 0x20;
+        }
+        if (flags & 0x80) r.str();      // имя и пароль не проверяются: брокер слушает ферму
+        if (flags & 0x40) r.str();
+        bool clean = flags & 0x02;
+
+        std::lock_guard<std::mutex> writing(c->write_mutex);
+        auto refuse = [&](uint8_t code) {
+            std::string body(1, 0);
+            body += static_cast<char>(code);
+            write_all(*c, packet(CONNACK << 4, body));
+            return nullptr;
+        };
+        if (protocol != "MQTT" || level != 4) return refuse(1);
+        if (client_id.empty() && !clean) return refuse(2);
+
+        std::shared_ptr<Session> session;
+        std::shared_ptr<Connection> previous;
+        bool present = false;
+        std::vector<std::string> resend;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            if (client_id.empty()) client_id = "auto-" + std::to_string(++anonymous);
+            auto it = sessions.find(client_id);
+            if (it != sessions.end()) {
+                previous = it->second->connection;
+                it->second->connection.reset();
+                if (!clean && !it->second->clean) {
+                    session = it->second;
+                    present = true;
+                }
+            }
+            if (!session) {
+                session = std::make_shared<Session>();
+                session->client_id = client_id;
+                sessions[client_id] = session;
+            }
+            session->clean = clean;
+            session->connection = c;
+            // Неподтверждённые - повторно с DUP, затем накопленные за время отключения
+            for (const auto& [id, m] : session->inflight) resend.push_back(publish_packet(m, id, true));
+            Outgoing out;
+            release_queued(*session, out);
+            for (auto& [connection, bytes] : out) resend.push_back(std::move(bytes));
+        }
+        // Клиент с тем же id вытесняет прежнее соединение
+        if (previous) drop(*previous);
+
+        std::string body(1, present ? 1 : 0);
+        body += static_cast<char>(0);
+        write_all(*c, packet(CONNACK << 4, body));
+        for (const auto& bytes : resend) write_all(*c, bytes);
+        return session;
+    }
+
+    void handle_publish(Connection& c, const Packet& p) {
+        Reader r(p.body);
+        BrokerMessage m;
+        m.qos = (p.header >> 1) & 3;
+        m.retain = p.header & 1;
+        if (m.qos > 1) throw std::runtime_error("QoS 2 is not supported");
+        m.topic = r.str();
+        if (m.topic.empty() || m.topic.find_first_of("+#") != std::string::npos) {
+            throw std::runtime_error("invalid topic " + m.topic);
+        }
+        uint16_t id = m.qos > 0 ? r.u16() : 0;
+        m.payload = r.rest();
+        route(m);
+        if (m.qos > 0) send(c, ack(PUBACK, id));
+    }
+
+    void handle_subscribe(const std::shared_ptr<Session>& session, Connection& c, const Packet& p) {
+        if ((p.header & 0x0F) != 0x02) throw std::runtime_error("malformed SUBSCRIBE");
+        Reader r(p.body);
+        uint16_t id = r.u16();
+        std::string codes;
+        Outgoing out;
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            do {
+                std::string filter = r.str();
+                int qos = r.u8() & 3;
+                if (!valid_filter(filter)) {
+                    codes += static_cast<char>(0x80);
+                    continue;
+                }
+                int granted = std::min(qos, 1);
+                session->subscriptions[filter] = granted;
+                codes += static_cast<char>(granted);
+                for (const auto& [topic, m] : retained) {
+                    if (!topic_matches(filter, topic)) continue;
+                    deliver(*session, {topic, m.payload, std::min(granted, m.qos), true}, out);
+                }
+            } while (!r.done());
+        }
+        std::string body;
+        put_u16(body, id);
+        send(c, packet(SUBACK << 4, body + codes));
+        flush(out);
+    }
+
+    void handle_unsubscribe(const std::shared_ptr<Session>& session, Connection& c, const Packet& p) {
+        Reader r(p.body);
+        uint16_t id = r.u16();
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            do {
+                session->subscriptions.erase(r.str());
+            } while (!r.done());
+        }
+        send(c, ack(UNSUBACK, id));
+    }
+
+    void serve(int fd) {
+        auto c = std::make_shared<Connection>(fd);
+        std::shared_ptr<Session> session;
+        std::unique_ptr<BrokerMessage> will;
+        bool graceful = false;
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        set_timeout(fd, SO_RCVTIMEO, CONNECT_TIMEOUT_SEC);
+        set_timeout(fd, SO_SNDTIMEO, SEND_TIMEOUT_SEC);
+        try {
+            Packet p;
+            int keep_alive = 0;
+            if (read_packet(fd, p) && p.type() == CONNECT) session = handle_connect(c, p, will, keep_alive);
+            // Полтора интервала keep-alive без пакетов - клиент пропал (0 - без проверки)
+            if (session) set_timeout(fd, SO_RCVTIMEO, keep_alive > 0 ? keep_alive * 3 / 2 + 1 : 0);
+            while (session && read_packet(fd, p)) {
+                switch (p.type()) {
+                case PUBLISH:
+                    handle_publish(*c, p);
+                    break;
+                case PUBACK: {
+                    Reader r(p.body);
+                    uint16_t id = r.u16();
+                    Outgoing out;
+                    {
+                        std::lock_guard<std::mutex> lock(mtx);
+                        session->inflight.erase(id);
+                        release_queued(*session, out);
+                    }
+                    flush(out);
+                    break;
+                }
+                case SUBSCRIBE:
+                    handle_subscribe(session, *c, p);
+                    break;
+                case UNSUBSCRIBE:
+                    handle_unsubscribe(session, *c, p);
+                    break;
+                case PINGREQ:
+                    send(*c, packet(PINGRESP << 4, ""));
+                    break;
+                case DISCONNECT:
+                    graceful = true;
+                    break;
+                default:
+                    throw std::runtime_error("unexpected packet type " + std::to_string(p.type()));
+                }
+                if (graceful) break;
+            }
+        }
+        catch (const std::exception& e) {
+            std::cerr << "MQTT broker: " << e.what() << std::endl;
+        }
+
+        drop(*c);
+        if (session) {
+            std::lock_guard<std::mutex> lock(mtx);
+            // Вытесненное соединение сессию уже не трогает
+            if (session->connection == c) {
+                session->connection.reset();
+                if (session->clean) sessions.erase(session->client_id);
+            }
+        }
+        if (session && will && !graceful) route(*will);
+        close(fd);
+    }
+
+    void accept_loop() {
+        while (true) {
+            int fd = accept(listen_fd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED) continue;
+                if (errno == EBADF || errno == EINVAL) return;
+                std::cerr << "MQTT broker accept error: " << strerror(errno) << std::endl;
+                std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                continue;
+            }
+            std::thread(&MqttBroker::serve, this, fd).detach();
+        }
+    }
+
+public:
+    explicit MqttBroker(unsigned short port) : port(port) {}
+
+    MqttBroker(const MqttBroker&) = delete;
+    MqttBroker& operator=(const MqttBroker&) = delete;
+
+    // Потоки соединений не останавливаются: брокер живёт до конца процесса
+    ~MqttBroker() {
+        if (listen_fd >= 0) shutdown(listen_fd, SHUT_RDWR);
+        if (acceptor.joinable()) acceptor.join();
+        if (listen_fd >= 0) close(listen_fd);
+    }
+
+    // Обработчики регистрируются до start; вызываются в потоке соединения отправителя
+    void subscribe_local(const std::string& filter, LocalHandler handler) {
+        local.emplace_back(filter, std::move(handler));
+    }
+
+    // Публикация из самого процесса (тревоги data.cpp)
+    void publish(const std::string& topic, const std::string& payload, int qos, bool retain) {
+        route({topic, payload, std::min(qos, 1), retain});
+    }
+
+    void start() {
+        listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd < 0) throw std::runtime_error(std::string("MQTT broker socket: ") + strerror(errno));
+        int one = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listen_fd, 64) != 0) {
+            throw std::runtime_error("MQTT broker: cannot listen on port " + std::to_string(port) + ": " + strerror(errno));
+        }
+        acceptor = std::thread(&MqttBroker::accept_loop, this);
+    }
+};
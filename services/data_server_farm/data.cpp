@@ -4,20 +4,184 @@
 #include <nlohmann/json.hpp>
 #include <chrono>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <queue>
+#include <vector>
+#include <set>
+#include <cstring>
 #include <unistd.h>
+#include <syslog.h>
+#include "journal.h"
+#include "anomaly.h"
+#include "../common/trace_stats.h"
+#include "broker.h"
 
 using namespace std;
 using json = nlohmann::json;
 
 const string MQTT_BROKER = "tcp://localhost:1883";
-const string MQTT_TOPIC = "/farm001/data";
+const string MQTT_TOPIC = "/+/data";
+// Встроенный брокер (--broker): слушает вместо mosquitto, логи устройств пишет в syslog
+// сам, как logger.service
+const unsigned short MQTT_PORT = 1883;
+const string LOG_TOPIC = "/+/log";
 const string DB_FILE = "/home/tovarichkek/services/data_server_farm/data.db";
+const string JOURNAL_DIR = "/home/tovarichkek/services/data_server_farm/journal";
+const string DEFAULT_DEVICE = "farm001";
 
-class MQTTListener : public virtual mqtt::callback {
+// Догонка и пересборка БД из журнала идут крупными транзакциями
+const size_t REPLAY_BATCH_SIZE = 10000;
+
+// Буфер переупорядочивания: запись лежит в памяти, пока её время не станет
+// старше самого свежего показания на REORDER_WINDOW_SEC, но не дольше REORDER_MAX_HOLD_MS
+const int64_t REORDER_WINDOW_SEC = 5;
+const int64_t REORDER_MAX_HOLD_MS = 10000;
+const size_t REORDER_MAX_PENDING = 4096;
+const int64_t FLUSH_INTERVAL_MS = 500;
+
+// События аномалий публикуются в /<device>/alert и сохраняются в таблицу alerts,
+// откуда их забирает телефон (logs.cpp, /api/v1/alerts)
+const string ALERT_TOPIC_SUFFIX = "/alert";
+
+// Гистограммы задержек по участкам пути показания пишутся в latency_stats раз в минуту,
+// в лог службы - раз в 10 минут
+const int64_t LATENCY_SAVE_INTERVAL_MS = 60000;
+const int64_t LATENCY_LOG_INTERVAL_MS = 600000;
+
+// Время устройства принимается, только если часы синхронизированы по NTP
+// (не раньше MIN_DEVICE_TS) и не убежали вперёд больше чем на MAX_CLOCK_SKEW_SEC
+const int64_t MIN_DEVICE_TS = 1577836800; // 2020-01-01
+const int64_t MAX_CLOCK_SKEW_SEC = 300;
+
+const char* SENSOR_FIELDS[] = {
+    "temperature_DHT22", "temperature_DS18B20", "humidity",
+    "water_level", "soil_moisture", "light_intensity"
+};
+const size_t SENSOR_FIELDS_COUNT = 6;
+
+struct Reading {
+    uint64_t journal_seq;       // номер в журнале, 0 - не записано в журнал
+    string device;
+    int64_t timestamp_unix;     // время устройства, если оно валидно, иначе время сервера
+    bool has_device_ts;
+    bool has_seq;
+    int64_t seq;
+    int64_t received_unix;      // время прихода на сервер
+    int64_t received_ms;
+    int64_t arrival_ms;         // steady_clock, для ограничения времени удержания в буфере
+    uint64_t arrival_order;     // порядок прихода: из повторов одного показания побеждает последний
+    double fields[SENSOR_FIELDS_COUNT];
+    // Трассировка от устройства ("trace" в сообщении), -1 - нет:
+    //   read_ms, pub_ms - время опроса датчиков и публикации по часам устройства (NTP)
+    //   read_to_pub_ms - от опроса до публикации (millis устройства)
+    //   puback_ms - от публикации предыдущего показания до PUBACK брокера (очередь AsyncMqttClient)
+    int64_t trace_read_ms;
+    int64_t trace_pub_ms;
+    int64_t trace_read_to_pub_ms;
+    int64_t trace_puback_ms;
+};
+
+// Самая старая запись (по времени, затем по номеру) - на вершине кучи
+struct ReadingLater {
+    bool operator()(const Reading& a, const Reading& b) const {
+        if (a.timestamp_unix != b.timestamp_unix) return a.timestamp_unix > b.timestamp_unix;
+        if (a.seq != b.seq) return a.seq > b.seq;
+        return a.arrival_order > b.arrival_order;
+    }
+};
+
+int64_t steady_ms() {
+    return chrono::duration_cast<chrono::milliseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int64_t unix_ms() {
+    return chrono::duration_cast<chrono::milliseconds>(
+        chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Топик вида /<device>/data
+string device_from_topic(const string& topic) {
+    size_t begin = (!topic.empty() && topic[0] == '/') ? 1 : 0;
+    size_t end = topic.find('/', begin);
+    if (end == string::npos || end == begin) return DEFAULT_DEVICE;
+    return topic.substr(begin, end - begin);
+}
+
+// Разбор сообщения. received_ms - время прихода на сервер (для сообщений из журнала - исходное)
+Reading parse_reading(const string& topic, const string& payload, int64_t received_ms) {
+    auto j = json::parse(payload);
+
+    int64_t server_ts = received_ms / 1000;
+
+    Reading r{};
+    r.device = device_from_topic(topic);
+    r.received_unix = server_ts;
+    r.received_ms = received_ms;
+    r.arrival_ms = steady_ms();
+    r.timestamp_unix = server_ts;
+
+    if (j.contains("device_ts") && j["device_ts"].is_number_integer()) {
+        int64_t device_ts = j["device_ts"].get<int64_t>();
+        if (device_ts >= MIN_DEVICE_TS && device_ts <= server_ts + MAX_CLOCK_SKEW_SEC) {
+            r.timestamp_unix = device_ts;
+            r.has_device_ts = true;
+        }
+    }
+    if (j.contains("seq") && j["seq"].is_number_integer()) {
+        r.seq = j["seq"].get<int64_t>();
+        r.has_seq = true;
+    }
+
+    for (size_t i = 0; i < SENSOR_FIELDS_COUNT; i++) {
+        r.fields[i] = j[SENSOR_FIELDS[i]].get<double>();
+    }
+
+    r.trace_read_ms = r.trace_pub_ms = r.trace_read_to_pub_ms = r.trace_puback_ms = -1;
+    if (j.contains("trace") && j["trace"].is_object()) {
+        const auto& t = j["trace"];
+        auto get = [&t](const char* key) -> int64_t {
+            return t.contains(key) && t[key].is_number_integer() ? t[key].get<int64_t>() : -1;
+        };
+        r.trace_read_ms = get("read_ms");
+        r.trace_pub_ms = get("pub_ms");
+        r.trace_read_to_pub_ms = get("read_to_pub_ms");
+        r.trace_puback_ms = get("puback_ms");
+    }
+    return r;
+}
+
+// БД - материализованное представление журнала: вместе с каждой пачкой строк
+// в той же транзакции сохраняется номер журнала, до которого всё применено
+class SensorDatabase {
     sqlite3* db;
-    
+    sqlite3_stmt* upsert_stmt = nullptr;
+    sqlite3_stmt* state_stmt = nullptr;
+    sqlite3_stmt* alert_stmt = nullptr;
+    sqlite3_stmt* latency_stmt = nullptr;
+
+    void exec(const char* sql) {
+        if (sqlite3_exec(db, sql, nullptr, nullptr, nullptr) != SQLITE_OK) {
+            throw runtime_error(sqlite3_errmsg(db));
+        }
+    }
+
+    set<string> table_columns() {
+        set<string> columns;
+        sqlite3_stmt* stmt;
+        if (sqlite3_prepare_v2(db, "PRAGMA table_info(sensor_data);", -1, &stmt, nullptr) != SQLITE_OK) {
+            throw runtime_error(sqlite3_errmsg(db));
+        }
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            columns.insert(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)));
+        }
+        sqlite3_finalize(stmt);
+        return columns;
+    }
+
     void create_table() {
-        const char* sql = 
+        const char* sql =
             "CREATE TABLE IF NOT EXISTS sensor_data ("
             "id INTEGER PRIMARY KEY AUTOINCREMENT,"
             "timestamp_unix INTEGER,"
@@ -26,59 +190,500 @@ class MQTTListener : public virtual mqtt::callback {
             "humidity REAL,"
             "water_level REAL,"
             "soil_moisture REAL,"
-            "light_intensity REAL);";
-            
-        if (sqlite3_exec(db, sql, nullptr, nullptr, nullptr) != SQLITE_OK) {
+            "light_intensity REAL,"
+            "device TEXT NOT NULL DEFAULT 'farm001',"
+            "device_ts INTEGER,"
+            "seq INTEGER,"
+            "received_unix INTEGER);";
+        exec(sql);
+
+        // Миграция старых баз: колонки устройства и времени устройства
+        auto columns = table_columns();
+        if (!columns.count("device"))
+            exec("ALTER TABLE sensor_data ADD COLUMN device TEXT NOT NULL DEFAULT 'farm001';");
+        if (!columns.count("device_ts"))
+            exec("ALTER TABLE sensor_data ADD COLUMN device_ts INTEGER;");
+        if (!columns.count("seq"))
+            exec("ALTER TABLE sensor_data ADD COLUMN seq INTEGER;");
+        if (!columns.count("received_unix"))
+            exec("ALTER TABLE sensor_data ADD COLUMN received_unix INTEGER;");
+
+        // Повторная доставка (QoS1, переподключение) одного показания - одна строка.
+        // Строки без времени устройства (device_ts = NULL) не конфликтуют друг с другом
+        exec("CREATE UNIQUE INDEX IF NOT EXISTS ux_sensor_data_device_ts "
+             "ON sensor_data(device, device_ts);");
+        exec("CREATE INDEX IF NOT EXISTS ix_sensor_data_timestamp "
+             "ON sensor_data(timestamp_unix);");
+        // Последнее показание устройства (главный экран телефона) - один шаг по индексу,
+        // а не проход по времени назад до первой строки устройства
+        exec("CREATE INDEX IF NOT EXISTS ix_sensor_data_device_timestamp "
+             "ON sensor_data(device, timestamp_unix);");
+
+        exec("CREATE TABLE IF NOT EXISTS ingest_state ("
+             "name TEXT PRIMARY KEY,"
+             "value INTEGER NOT NULL);");
+
+        exec("CREATE TABLE IF NOT EXISTS alerts ("
+             "id INTEGER PRIMARY KEY AUTOINCREMENT,"
+             "timestamp_unix INTEGER NOT NULL,"
+             "device TEXT NOT NULL,"
+             "field TEXT NOT NULL,"
+             "kind TEXT NOT NULL,"
+             "state TEXT NOT NULL,"
+             "value REAL,"
+             "expected REAL);");
+
+        // Снимки гистограмм задержек служб (data, logs), см. trace_stats.h
+        exec("CREATE TABLE IF NOT EXISTS latency_stats ("
+             "service TEXT NOT NULL,"
+             "device TEXT NOT NULL,"
+             "hop TEXT NOT NULL,"
+             "started_unix INTEGER NOT NULL,"
+             "updated_unix INTEGER NOT NULL,"
+             "histogram TEXT NOT NULL,"
+             "PRIMARY KEY (service, device, hop));");
+    }
+
+    void prepare_statements() {
+        const char* sql = "INSERT INTO sensor_data (timestamp_unix, "
+            "temperature_DHT22, temperature_DS18B20, humidity, "
+            "water_level, soil_moisture, light_intensity, "
+            "device, device_ts, seq, received_unix) "
+            "VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?) "
+            "ON CONFLICT(device, device_ts) DO UPDATE SET "
+            "timestamp_unix = excluded.timestamp_unix, "
+            "temperature_DHT22 = excluded.temperature_DHT22, "
+            "temperature_DS18B20 = excluded.temperature_DS18B20, "
+            "humidity = excluded.humidity, "
+            "water_level = excluded.water_level, "
+            "soil_moisture = excluded.soil_moisture, "
+            "light_intensity = excluded.light_intensity, "
+            "seq = excluded.seq, "
+            "received_unix = excluded.received_unix;";
+
+        if (sqlite3_prepare_v2(db, sql, -1, &upsert_stmt, nullptr) != SQLITE_OK) {
+            throw runtime_error(sqlite3_errmsg(db));
+        }
+
+        const char* state_sql = "INSERT INTO ingest_state (name, value) VALUES (?, ?) "
+            "ON CONFLICT(name) DO UPDATE SET value = excluded.value;";
+        if (sqlite3_prepare_v2(db, state_sql, -1, &state_stmt, nullptr) != SQLITE_OK) {
+            throw runtime_error(sqlite3_errmsg(db));
+        }
+
+        const char* alert_sql = "INSERT INTO alerts (timestamp_unix, device, field, kind, state, value, expected) "
+            "VALUES (?, ?, ?, ?, ?, ?, ?);";
+        if (sqlite3_prepare_v2(db, alert_sql, -1, &alert_stmt, nullptr) != SQLITE_OK) {
+            throw runtime_error(sqlite3_errmsg(db));
+        }
+
+        const char* latency_sql = "INSERT INTO latency_stats (service, device, hop, started_unix, updated_unix, histogram) "
+            "VALUES ('data', ?, ?, ?, ?, ?) "
+            "ON CONFLICT(service, device, hop) DO UPDATE SET started_unix = excluded.started_unix, "
+            "updated_unix = excluded.updated_unix, histogram = excluded.histogram;";
+        if (sqlite3_prepare_v2(db, latency_sql, -1, &latency_stmt, nullptr) != SQLITE_OK) {
             throw runtime_error(sqlite3_errmsg(db));
         }
     }
 
+    bool insert_reading(const Reading& r) {
+        sqlite3_reset(upsert_stmt);
+        sqlite3_clear_bindings(upsert_stmt);
+
+        // Привязываем параметры
+        sqlite3_bind_int64(upsert_stmt, 1, r.timestamp_unix);
+        for (size_t i = 0; i < SENSOR_FIELDS_COUNT; i++) {
+            sqlite3_bind_double(upsert_stmt, 2 + i, r.fields[i]);
+        }
+        sqlite3_bind_text(upsert_stmt, 8, r.device.c_str(), -1, SQLITE_TRANSIENT);
+        if (r.has_device_ts) sqlite3_bind_int64(upsert_stmt, 9, r.timestamp_unix);
+        else sqlite3_bind_null(upsert_stmt, 9);
+        if (r.has_seq) sqlite3_bind_int64(upsert_stmt, 10, r.seq);
+        else sqlite3_bind_null(upsert_stmt, 10);
+        sqlite3_bind_int64(upsert_stmt, 11, r.received_unix);
+
+        if (sqlite3_step(upsert_stmt) != SQLITE_DONE) {
+            cerr << "Insert error: " << sqlite3_errmsg(db) << endl;
+            return false;
+        }
+        return true;
+    }
+
+    int64_t read_state(const char* name) {
+        int64_t value = 0;
+        sqlite3_stmt* stmt;
+        const char* sql = "SELECT value FROM ingest_state WHERE name = ?;";
+        if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
+            sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+            if (sqlite3_step(stmt) == SQLITE_ROW) {
+                value = sqlite3_column_int64(stmt, 0);
+            }
+            sqlite3_finalize(stmt);
+        }
+        return value;
+    }
+
+    bool write_state(const char* name, int64_t value) {
+        sqlite3_reset(state_stmt);
+        sqlite3_bind_text(state_stmt, 1, name, -1, SQLITE_STATIC);
+        sqlite3_bind_int64(state_stmt, 2, value);
+        return sqlite3_step(state_stmt) == SQLITE_DONE;
+    }
+
+    // Увеличение счётчика в самой БД: его же меняет bulk_import, копия в памяти устарела бы
+    bool increment_state(const char* name) {
+        sqlite3_stmt* stmt;
+        const char* sql = "INSERT INTO ingest_state (name, value) VALUES (?, 1) "
+                          "ON CONFLICT(name) DO UPDATE SET value = value + 1;";
+        if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return false;
+        sqlite3_bind_text(stmt, 1, name, -1, SQLITE_STATIC);
+        bool ok = sqlite3_step(stmt) == SQLITE_DONE;
+        sqlite3_finalize(stmt);
+        return ok;
+    }
+
 public:
-    MQTTListener() {
-        if (sqlite3_open(DB_FILE.c_str(), &db) != SQLITE_OK) {
+    // bulk - режим пересборки: без гарантий fsync, БД всегда можно собрать заново
+    explicit SensorDatabase(const string& path, bool bulk = false) {
+        if (sqlite3_open(path.c_str(), &db) != SQLITE_OK) {
             throw runtime_error(sqlite3_errmsg(db));
         }
+        // WAL: читатели logs.cpp не блокируют запись и наоборот
+        exec("PRAGMA journal_mode=WAL;");
+        exec(bulk ? "PRAGMA synchronous=OFF;" : "PRAGMA synchronous=NORMAL;");
+        sqlite3_busy_timeout(db, 5000);
         create_table();
+        prepare_statements();
     }
 
-    ~MQTTListener() {
+    ~SensorDatabase() {
+        sqlite3_finalize(upsert_stmt);
+        sqlite3_finalize(state_stmt);
+        sqlite3_finalize(alert_stmt);
+        sqlite3_finalize(latency_stmt);
         sqlite3_close(db);
     }
 
-    void message_arrived(mqtt::const_message_ptr msg) override {
+    SensorDatabase(const SensorDatabase&) = delete;
+    SensorDatabase& operator=(const SensorDatabase&) = delete;
+
+    uint64_t journal_seq() {
+        return static_cast<uint64_t>(read_state("journal_seq"));
+    }
+
+    // Запись пачки и отметок одной транзакцией. При ошибке пачка
+    // не теряется: она остаётся в журнале и будет применена при следующем запуске.
+    //
+    // ts_watermark - время, до которого (включительно) показания считаются окончательными:
+    // диапазоны ниже него кэшируются читателями (logs.cpp) как неизменяемые.
+    // Строка не новее уже опубликованной отметки (опоздавшее показание, повторная
+    // загрузка журнала) увеличивает late_epoch, и читатели сбрасывают свои кэши.
+    // Отметки читаются внутри транзакции: late_epoch увеличивает и bulk_import
+    bool write_batch(const vector<Reading>& batch, uint64_t applied_seq, int64_t new_ts_watermark) {
+        if (batch.empty() && applied_seq == 0) return true;
+
+        if (sqlite3_exec(db, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr) != SQLITE_OK) {
+            cerr << "Begin error: " << sqlite3_errmsg(db) << endl;
+            return false;
+        }
+        bool ok = true;
+        bool late = false;
+        int64_t ts_watermark = read_state("ts_watermark");
+        for (const auto& r : batch) {
+            ok &= insert_reading(r);
+            late |= r.timestamp_unix <= ts_watermark;
+        }
+        int64_t watermark = max(ts_watermark, new_ts_watermark);
+        if (ok && applied_seq > 0) ok = write_state("journal_seq", static_cast<int64_t>(applied_seq));
+        if (ok && watermark != ts_watermark) ok = write_state("ts_watermark", watermark);
+        if (ok && late) ok = increment_state("late_epoch");
+
+        if (!ok || sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr) != SQLITE_OK) {
+            cerr << "Commit error: " << sqlite3_errmsg(db) << endl;
+            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            return false;
+        }
+        return true;
+    }
+
+    bool write_alert(const AlertEvent& e) {
+        sqlite3_reset(alert_stmt);
+        sqlite3_bind_int64(alert_stmt, 1, e.timestamp_unix);
+        sqlite3_bind_text(alert_stmt, 2, e.device.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(alert_stmt, 3, e.field.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(alert_stmt, 4, e.kind.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(alert_stmt, 5, e.raised ? "raised" : "resolved", -1, SQLITE_STATIC);
+        sqlite3_bind_double(alert_stmt, 6, e.value);
+        sqlite3_bind_double(alert_stmt, 7, e.expected);
+        if (sqlite3_step(alert_stmt) != SQLITE_DONE) {
+            cerr << "Alert insert error: " << sqlite3_errmsg(db) << endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Снимок гистограмм одной транзакцией; started_unix - запуск службы, с которого они накоплены
+    bool write_latency(const vector<TraceStats::Entry>& entries, int64_t started_unix) {
+        if (entries.empty()) return true;
+        if (sqlite3_exec(db, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr) != SQLITE_OK) {
+            cerr << "Begin error: " << sqlite3_errmsg(db) << endl;
+            return false;
+        }
+        bool ok = true;
+        int64_t now = unix_ms() / 1000;
+        for (const auto& e : entries) {
+            sqlite3_reset(latency_stmt);
+            sqlite3_bind_text(latency_stmt, 1, e.device.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_text(latency_stmt, 2, e.hop.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int64(latency_stmt, 3, started_unix);
+            sqlite3_bind_int64(latency_stmt, 4, now);
+            sqlite3_bind_text(latency_stmt, 5, e.histogram.c_str(), -1, SQLITE_TRANSIENT);
+            ok &= sqlite3_step(latency_stmt) == SQLITE_DONE;
+        }
+        if (!ok || sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr) != SQLITE_OK) {
+            cerr << "Latency stats error: " << sqlite3_errmsg(db) << endl;
+            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+            return false;
+        }
+        return true;
+    }
+};
+
+// Применяет записи журнала начиная с from_seq крупными пачками. Возвращает число записей
+size_t apply_journal(SensorDatabase& database, uint64_t from_seq) {
+    vector<Reading> batch;
+    size_t applied = 0;
+    uint64_t last_seq = 0;
+    int64_t max_ts = 0;
+
+    auto flush = [&]() {
+        if (!database.write_batch(batch, last_seq, max_ts)) {
+            throw runtime_error("Cannot apply journal batch ending at seq " + to_string(last_seq));
+        }
+        applied += batch.size();
+        batch.clear();
+    };
+
+    Journal::replay(JOURNAL_DIR, from_seq, [&](const JournalRecord& rec) {
+        last_seq = rec.seq;
         try {
-            auto j = json::parse(msg->get_payload());
-            
-            // Получаем текущее время в Unix time
-            auto now = chrono::system_clock::now();
-            auto timestamp = chrono::duration_cast<chrono::seconds>(
-                now.time_since_epoch()).count();
-            
-            sqlite3_stmt* stmt;
-            const char* sql = "INSERT INTO sensor_data (timestamp_unix, "
-                "temperature_DHT22, temperature_DS18B20, humidity, "
-                "water_level, soil_moisture, light_intensity) "
-                "VALUES (?, ?, ?, ?, ?, ?, ?);";
-            
-            if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
-                cerr << "Prepare error: " << sqlite3_errmsg(db) << endl;
-                return;
+            Reading r = parse_reading(rec.topic, rec.payload, rec.received_ms);
+            r.journal_seq = rec.seq;
+            max_ts = max(max_ts, min(r.timestamp_unix, r.received_unix));   // как max_seen_ts
+            batch.push_back(move(r));
+        }
+        catch (const exception& e) {
+            cerr << "Skipping journal record " << rec.seq << ": " << e.what() << endl;
+        }
+        if (batch.size() >= REPLAY_BATCH_SIZE) flush();
+        return true;
+    });
+    if (last_seq > 0) flush();
+    return applied;
+}
+
+// Отправка сообщения в брокер: через клиента paho или во встроенный
+using Publisher = function<void(const string& topic, const string& payload)>;
+
+class MQTTListener : public virtual mqtt::callback {
+    SensorDatabase& database;
+    Journal& journal;
+    Publisher publish;
+    AnomalyDetector detector;   // только из потока flusher
+
+    priority_queue<Reading, vector<Reading>, ReadingLater> pending;
+    // Номера журнала, ещё не записанные в БД: минимальный из них задаёт отметку применения
+    set<uint64_t> pending_seqs;
+    int64_t max_seen_ts = 0;
+    uint64_t arrivals = 0;
+    uint64_t written_watermark = 0;
+    int64_t written_ts_watermark = 0;
+    mutex pending_mutex;
+    condition_variable pending_cv;
+    bool stopping = false;
+    thread flusher;
+
+    TraceStats latency;
+    int64_t started_unix = unix_ms() / 1000;
+    int64_t last_latency_save_ms = steady_ms();
+    int64_t last_latency_log_ms = steady_ms();
+
+    // Участки пути показания до записи в БД. Часы устройства и сервера сравниваются
+    // только на publish_to_server: это очередь AsyncMqttClient, сеть и брокер
+    // (отметки приёма брокером mosquitto не даёт)
+    void record_latency(const vector<Reading>& written, int64_t commit_ms) {
+        for (const auto& r : written) {
+            if (r.trace_read_to_pub_ms >= 0) latency.add(r.device, "read_to_publish", r.trace_read_to_pub_ms);
+            if (r.trace_puback_ms >= 0) latency.add(r.device, "publish_to_puback", r.trace_puback_ms);
+            if (r.trace_pub_ms >= 0) latency.add(r.device, "publish_to_server", r.received_ms - r.trace_pub_ms);
+            // Буфер переупорядочивания, ожидание пачки и фиксация транзакции
+            latency.add(r.device, "server_to_commit", commit_ms - r.received_ms);
+        }
+    }
+
+    void save_latency() {
+        int64_t now = steady_ms();
+        if (now - last_latency_save_ms >= LATENCY_SAVE_INTERVAL_MS) {
+            last_latency_save_ms = now;
+            database.write_latency(latency.snapshot(), started_unix);
+        }
+        if (now - last_latency_log_ms >= LATENCY_LOG_INTERVAL_MS) {
+            last_latency_log_ms = now;
+            cout << "Ingest latency: " << latency.to_json().dump() << endl;
+        }
+    }
+
+    // Забирает из буфера записи, которые уже не могут быть обогнаны опоздавшими
+    vector<Reading> take_ready(bool all) {
+        vector<Reading> ready;
+        int64_t now = steady_ms();
+        while (!pending.empty()) {
+            const Reading& top = pending.top();
+            bool below_watermark = top.timestamp_unix <= max_seen_ts - REORDER_WINDOW_SEC;
+            bool held_too_long = now - top.arrival_ms >= REORDER_MAX_HOLD_MS;
+            bool overflow = pending.size() > REORDER_MAX_PENDING;
+            if (!all && !below_watermark && !held_too_long && !overflow) break;
+            if (top.journal_seq) pending_seqs.erase(top.journal_seq);
+            ready.push_back(top);
+            pending.pop();
+        }
+        return ready;
+    }
+
+    // Всё, что не новее этого времени, либо уже в БД, либо в забранной пачке. Не ближе
+    // REORDER_WINDOW_SEC к самому свежему показанию (не новее времени сервера): max_seen_ts
+    // общий для всех устройств, и показание другой фермы с той же или прошлой секундой иначе
+    // считалось бы опоздавшим (late_epoch и сброс кэшей читателей почти на каждой пачке)
+    int64_t ts_watermark() {
+        int64_t settled = max_seen_ts - REORDER_WINDOW_SEC;
+        if (!pending.empty()) return min(settled, pending.top().timestamp_unix - 1);
+        return settled;
+    }
+
+    // Всё, что в журнале до этого номера, либо уже в БД, либо в забранной пачке
+    uint64_t applied_watermark() {
+        if (!pending_seqs.empty()) return *pending_seqs.begin() - 1;
+        return journal.last_seq();
+    }
+
+    // Пачка не записалась (БД заблокирована, диск полон) - возвращаем её в буфер до следующей попытки
+    void write_or_requeue(unique_lock<mutex>& lock, vector<Reading> ready) {
+        uint64_t watermark = applied_watermark();
+        int64_t ts_mark = ts_watermark();
+        if (ready.empty() && watermark == written_watermark && ts_mark == written_ts_watermark) return;
+
+        lock.unlock();
+        bool ok = database.write_batch(ready, watermark, ts_mark);
+        if (ok) record_latency(ready, unix_ms());
+        lock.lock();
+
+        if (ok) {
+            written_watermark = watermark;
+            written_ts_watermark = ts_mark;
+            return;
+        }
+        for (auto& r : ready) {
+            if (r.journal_seq) pending_seqs.insert(r.journal_seq);
+            pending.push(move(r));
+        }
+    }
+
+    // Показания приходят сюда по порядку времени. Повторно поставленная в очередь
+    // пачка детектор не сбивает: уже учтённые показания он пропускает
+    vector<AlertEvent> detect(const vector<Reading>& ready) {
+        vector<AlertEvent> alerts;
+        for (const auto& r : ready) {
+            auto events = detector.observe(r.device, r.timestamp_unix, r.received_unix, r.fields);
+            alerts.insert(alerts.end(), events.begin(), events.end());
+        }
+        auto stale = detector.check_stale(unix_ms() / 1000);
+        alerts.insert(alerts.end(), stale.begin(), stale.end());
+        return alerts;
+    }
+
+    void publish_alerts(const vector<AlertEvent>& alerts) {
+        for (const auto& e : alerts) {
+            json j = {
+                {"device", e.device},
+                {"field", e.field},
+                {"kind", e.kind},
+                {"state", e.raised ? "raised" : "resolved"},
+                {"value", e.value},
+                {"expected", e.expected},
+                {"timestamp_unix", e.timestamp_unix}
+            };
+            cout << "Alert: " << j.dump() << endl;
+            database.write_alert(e);
+            try {
+                publish("/" + e.device + ALERT_TOPIC_SUFFIX, j.dump());
             }
-            
-            // Привязываем параметры
-            sqlite3_bind_int64(stmt, 1, timestamp);
-            sqlite3_bind_double(stmt, 2, j["temperature_DHT22"].get<double>());
-            sqlite3_bind_double(stmt, 3, j["temperature_DS18B20"].get<double>());
-            sqlite3_bind_double(stmt, 4, j["humidity"].get<double>());
-            sqlite3_bind_double(stmt, 5, j["water_level"].get<double>());
-            sqlite3_bind_double(stmt, 6, j["soil_moisture"].get<double>());
-            sqlite3_bind_double(stmt, 7, j["light_intensity"].get<double>());
-            
-            if (sqlite3_step(stmt) != SQLITE_DONE) {
-                cerr << "Insert error: " << sqlite3_errmsg(db) << endl;
+            catch (const exception& ex) {
+                cerr << "Alert publish error: " << ex.what() << endl;
+            }
+        }
+    }
+
+    void flush_loop() {
+        unique_lock<mutex> lock(pending_mutex);
+        while (!stopping) {
+            pending_cv.wait_for(lock, chrono::milliseconds(FLUSH_INTERVAL_MS));
+            vector<Reading> ready = take_ready(false);
+            vector<AlertEvent> alerts = detect(ready);
+            write_or_requeue(lock, move(ready));
+            lock.unlock();
+            if (!alerts.empty()) publish_alerts(alerts);
+            save_latency();
+            lock.lock();
+        }
+        write_or_requeue(lock, take_ready(true));
+    }
+
+public:
+    MQTTListener(SensorDatabase& database, Journal& journal, Publisher publish)
+        : database(database), journal(journal), publish(move(publish)) {
+        flusher = thread(&MQTTListener::flush_loop, this);
+    }
+
+    ~MQTTListener() {
+        {
+            lock_guard<mutex> lock(pending_mutex);
+            stopping = true;
+        }
+        pending_cv.notify_one();
+        flusher.join();
+    }
+
+    void message_arrived(mqtt::const_message_ptr msg) override {
+        ingest(msg->get_topic(), msg->get_payload());
+    }
+
+    // Встроенный брокер вызывает напрямую, в потоке соединения устройства до PUBACK
+    void ingest(const string& topic, const string& payload) {
+        int64_t received_ms = unix_ms();
+
+        // Под общей блокировкой: отметка применения не должна обогнать
+        // запись, которая уже в журнале, но ещё не в буфере
+        lock_guard<mutex> lock(pending_mutex);
+        uint64_t journal_seq = 0;
+        try {
+            journal_seq = journal.append(topic, payload, received_ms);
+        }
+        catch (const exception& e) {
+            cerr << "Journal error: " << e.what() << endl;
+        }
+
+        try {
+            Reading r = parse_reading(topic, payload, received_ms);
+            r.journal_seq = journal_seq;
+            r.arrival_order = arrivals++;
+            // Не дальше времени сервера: ферма с убежавшими вперёд часами иначе увела бы
+            // отметку времени за настоящее, и показания остальных считались бы опоздавшими
+            max_seen_ts = max(max_seen_ts, min(r.timestamp_unix, r.received_unix));
+            if (journal_seq) pending_seqs.insert(journal_seq);
+            pending.push(move(r));
+            if (pending.size() > REORDER_MAX_PENDING) {
+                pending_cv.notify_one();
             }
-            
-            sqlite3_finalize(stmt);
         }
         catch (const exception& e) {
             cerr << "Error processing message: " << e.what() << endl;
@@ -86,15 +691,71 @@ public:
     }
 };
 
-int main() {
+void print_usage() {
+    cerr << "Usage: DATA                        - MQTT ingest service\n"
+         << "       DATA --broker                - the same with an embedded MQTT broker on port 1883\n"
+         << "       DATA --replay-from <seq>     - re-apply journal from <seq> to data.db\n"
+         << "       DATA --rebuild <db_path>     - build a new database from the whole journal" << endl;
+}
+
+int main(int argc, char* argv[]) {
     try {
+        // Офлайн-режимы: догонка с произвольного номера и полная пересборка
+        if (argc == 3 && strcmp(argv[1], "--replay-from") == 0) {
+            SensorDatabase database(DB_FILE);
+            size_t n = apply_journal(database, stoull(argv[2]));
+            cout << "Replayed " << n << " records into " << DB_FILE << endl;
+            return 0;
+        }
+        if (argc == 3 && strcmp(argv[1], "--rebuild") == 0) {
+            SensorDatabase database(argv[2], true);
+            size_t n = apply_journal(database, 1);
+            cout << "Rebuilt " << argv[2] << " from " << n << " records" << endl;
+            return 0;
+        }
+        bool embedded_broker = argc == 2 && strcmp(argv[1], "--broker") == 0;
+        if (argc != 1 && !embedded_broker) {
+            print_usage();
+            return 1;
+        }
+
+        SensorDatabase database(DB_FILE);
+        Journal journal(JOURNAL_DIR);
+
+        // Догоняем БД до журнала: то, что было принято, но не записано до падения
+        size_t caught_up = apply_journal(database, database.journal_seq() + 1);
+        if (caught_up > 0) {
+            cout << "Recovered " << caught_up << " records from journal" << endl;
+        }
+
+        if (embedded_broker) {
+            MqttBroker broker(MQTT_PORT);
+            MQTTListener listener(database, journal, [&broker](const string& topic, const string& payload) {
+                broker.publish(topic, payload, 1, false);
+            });
+            broker.subscribe_local(MQTT_TOPIC, [&listener](const string& topic, const string& payload) {
+                listener.ingest(topic, payload);
+            });
+            openlog("farm_logger", LOG_PID, LOG_DAEMON);
+            broker.subscribe_local(LOG_TOPIC, [](const string&, const string& payload) {
+                syslog(LOG_INFO, "%s", payload.c_str());
+            });
+            broker.start();
+            cout << "Service started with embedded MQTT broker on port " << MQTT_PORT << endl;
+            while (true) {
+                sleep(1);
+            }
+        }
+
         mqtt::async_client client(MQTT_BROKER, "mqtt2sql");
-        MQTTListener listener;
-        
+        MQTTListener listener(database, journal, [&client](const string& topic, const string& payload) {
+            client.publish(mqtt::make_message(topic, payload, 1, false));
+        });
+
         client.set_callback(listener);
         client.connect()->wait();
         client.subscribe(MQTT_TOPIC, 1);
-        
+
         cout << "Service started. Press Enter to exit..." << endl;
         while(true){
 		sleep(1);
@@ -1 +1 @@
-g++ -std=c++17 -o DATA data.cpp     -lsqlite3     -lpaho-mqttpp3     -lpaho-mqtt3a    -lpthread
+g++ -std=c++17 -o DATA data.cpp     -lsqlite3     -lz     -lpaho-mqttpp3     -lpaho-mqtt3a    -lpthread
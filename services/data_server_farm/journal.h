@@ -0,0 +1,273 @@
+#pragma once
+
+// Журнал входящих сообщений: сегментированный append-only файл.
+// Каждое сырое сообщение из MQTT сначала дописывается сюда и только потом
+// попадает в БД, поэтому data.db можно догнать или пересобрать из журнала.
+//
+// Формат записи (little-endian, как на хосте):
+//   magic u32 | body_len u32 | seq u64 | received_ms i64 | crc32 u32 | body
+//   body = topic_len u16 | topic | payload
+// crc32 считается по seq, received_ms и body. Оборванный хвост последнего
+// сегмента (после падения) отрезается при открытии.
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <stdexcept>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+struct JournalRecord {
+    uint64_t seq;
+    int64_t received_ms;
+    std::string topic;
+    std::string payload;
+};
+
+class Journal {
+public:
+    static constexpr uint32_t MAGIC = 0x4A504F49; // "IOPJ"
+    static constexpr size_t HEADER_SIZE = 28;
+    static constexpr uint64_t SEGMENT_MAX_BYTES = 64ull * 1024 * 1024;
+    static constexpr int SYNC_INTERVAL_MS = 100;
+    static constexpr size_t SYNC_MAX_UNSYNCED = 256;
+
+private:
+    std::string dir;
+    int fd = -1;
+    uint64_t segment_bytes = 0;
+    uint64_t next_seq = 1;
+    size_t unsynced = 0;
+
+    std::mutex mtx;
+    std::condition_variable sync_cv;
+    bool stopping = false;
+    std::thread syncer;
+
+    static std::string segment_name(uint64_t first_seq) {
+        char name[32];
+        snprintf(name, sizeof(name), "%020llu.seg", static_cast<unsigned long long>(first_seq));
+        return name;
+    }
+
+    static uint32_t checksum(uint64_t seq, int64_t received_ms, const char* body, size_t len) {
+        uLong crc = crc32(0L, Z_NULL, 0);
+        crc = crc32(crc, reinterpret_cast<const Bytef*>(&seq), sizeof(seq));
+        crc = crc32(crc, reinterpret_cast<const Bytef*>(&received_ms), sizeof(received_ms));
+        crc = crc32(crc, reinterpret_cast<const Bytef*>(body), len);
+        return static_cast<uint32_t>(crc);
+    }
+
+    // Первые номера сегментов по возрастанию
+    static std::vector<uint64_t> list_segments(const std::string& dir) {
+        std::vector<uint64_t> segments;
+        DIR* d = opendir(dir.c_str());
+        if (!d) return segments;
+        while (dirent* e = readdir(d)) {
+            std::string name = e->d_name;
+            if (name.size() == 24 && name.compare(20, 4, ".seg") == 0) {
+                segments.push_back(std::stoull(name.substr(0, 20)));
+            }
+        }
+        closedir(d);
+        std::sort(segments.begin(), segments.end());
+        return segments;
+    }
+
+    // Читает записи сегмента, пока они целые. Возвращает смещение конца последней целой записи
+    static uint64_t scan_segment(const std::string& path,
+                                 const std::function<bool(const JournalRecord&)>& on_record,
+                                 uint64_t& last_seq) {
+        FILE* f = fopen(path.c_str(), "rb");
+        if (!f) throw std::runtime_error("Cannot open journal segment " + path);
+
+        uint64_t offset = 0;
+        std::vector<char> body;
+        char header[HEADER_SIZE];
+        while (fread(header, 1, HEADER_SIZE, f) == HEADER_SIZE) {
+            uint32_t magic, body_len, crc;
+            JournalRecord rec;
+            memcpy(&magic, header, 4);
+            memcpy(&body_len, header + 4, 4);
+            memcpy(&rec.seq, header + 8, 8);
+            memcpy(&rec.received_ms, header + 16, 8);
+            memcpy(&crc, header + 24, 4);
+            if (magic != MAGIC || body_len < 2) break;
+
+            body.resize(body_len);
+            if (fread(body.data(), 1, body_len, f) != body_len) break;
+            if (checksum(rec.seq, rec.received_ms, body.data(), body_len) != crc) break;
+
+            uint16_t topic_len;
+            memcpy(&topic_len, body.data(), 2);
+            if (2u + topic_len > body_len) break;
+            rec.topic.assign(body.data() + 2, topic_len);
+            rec.payload.assign(body.data() + 2 + topic_len, body_len - 2 - topic_len);
+
+            offset += HEADER_SIZE + body_len;
+            last_seq = rec.seq;
+            if (!on_record(rec)) break;
+        }
+        fclose(f);
+        return offset;
+    }
+
+    void open_segment(uint64_t first_seq) {
+        std::string path = dir + "/" + segment_name(first_seq);
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) throw std::runtime_error("Cannot open journal segment " + path);
+        struct stat st;
+        fstat(fd, &st);
+        segment_bytes = st.st_size;
+    }
+
+    void rotate() {
+        fdatasync(fd);
+        ::close(fd);
+        open_segment(next_seq);
+        // Новый файл должен пережить падение вместе с записью о нём в каталоге
+        int dfd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dfd >= 0) {
+            fsync(dfd);
+            ::close(dfd);
+        }
+    }
+
+    // Пачечный fsync: не чаще раза в SYNC_INTERVAL_MS или по SYNC_MAX_UNSYNCED записям
+    void sync_loop() {
+        std::unique_lock<std::mutex> lock(mtx);
+        while (!stopping) {
+            sync_cv.wait_for(lock, std::chrono::milliseconds(SYNC_INTERVAL_MS));
+            if (unsynced == 0) continue;
+            unsynced = 0;
+            // Копия дескриптора: rotate может закрыть fd, а номер - достаться другому файлу,
+            // пока идёт fdatasync. Копия держит открытым тот же сегмент. Без копии (нет
+            // свободных дескрипторов) - fdatasync под блокировкой
+            int sync_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+            if (sync_fd < 0) {
+                fdatasync(fd);
+                continue;
+            }
+            lock.unlock();
+            fdatasync(sync_fd);
+            ::close(sync_fd);
+            lock.lock();
+        }
+    }
+
+public:
+    explicit Journal(const std::string& dir) : dir(dir) {
+        mkdir(dir.c_str(), 0755);
+
+        auto segments = list_segments(dir);
+        if (segments.empty()) {
+            open_segment(next_seq);
+        } else {
+            // Последний сегмент проверяем целиком и отрезаем оборванный хвост
+            std::string path = dir + "/" + segment_name(segments.back());
+            uint64_t last_seq = segments.back() - 1;
+            uint64_t valid = scan_segment(path, [](const JournalRecord&) { return true; }, last_seq);
+            if (truncate(path.c_str(), valid) != 0) {
+                throw std::runtime_error("Cannot truncate journal segment " + path);
+            }
+            next_seq = last_seq + 1;
+            open_segment(segments.back());
+        }
+        syncer = std::thread(&Journal::sync_loop, this);
+    }
+
+    ~Journal() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        sync_cv.notify_one();
+        syncer.join();
+        fdatasync(fd);
+        ::close(fd);
+    }
+
+    Journal(const Journal&) = delete;
+    Journal& operator=(const Journal&) = delete;
+
+    // Дописывает сообщение и возвращает его номер. Запись сразу уходит в page cache
+    // (переживает падение процесса), fsync выполняется пачками фоновым потоком
+    uint64_t append(const std::string& topic, const std::string& payload, int64_t received_ms) {
+        if (topic.size() > UINT16_MAX) throw std::runtime_error("Journal: topic too long");
+
+        std::lock_guard<std::mutex> lock(mtx);
+        if (segment_bytes >= SEGMENT_MAX_BYTES) rotate();
+
+        uint64_t seq = next_seq;
+        uint32_t body_len = static_cast<uint32_t>(2 + topic.size() + payload.size());
+        std::vector<char> rec(HEADER_SIZE + body_len);
+        char* body = rec.data() + HEADER_SIZE;
+        uint16_t topic_len = static_cast<uint16_t>(topic.size());
+        memcpy(body, &topic_len, 2);
+        memcpy(body + 2, topic.data(), topic.size());
+        memcpy(body + 2 + topic.size(), payload.data(), payload.size());
+
+        uint32_t crc = checksum(seq, received_ms, body, body_len);
+        memcpy(rec.data(), &MAGIC, 4);
+        memcpy(rec.data() + 4, &body_len, 4);
+        memcpy(rec.data() + 8, &seq, 8);
+        memcpy(rec.data() + 16, &received_ms, 8);
+        memcpy(rec.data() + 24, &crc, 4);
+
+        size_t written = 0;
+        while (written < rec.size()) {
+            ssize_t n = ::write(fd, rec.data() + written, rec.size() - written);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                // Недописанную запись отрежет проверка хвоста при следующем открытии
+                throw std::runtime_error(std::string("Journal write error: ") + strerror(errno));
+            }
+            written += n;
+        }
+
+        segment_bytes += rec.size();
+        next_seq++;
+        if (++unsynced >= SYNC_MAX_UNSYNCED) sync_cv.notify_one();
+        return seq;
+    }
+
+    uint64_t last_seq() {
+        std::lock_guard<std::mutex> lock(mtx);
+        return next_seq - 1;
+    }
+
+    // Проход по журналу начиная с from_seq. on_record возвращает false, чтобы остановиться
+    static void replay(const std::string& dir, uint64_t from_seq,
+                       const std::function<bool(const JournalRecord&)>& on_record) {
+        auto segments = list_segments(dir);
+        // Первый сегмент - последний из начинающихся не позже from_seq
+        size_t start = 0;
+        for (size_t i = 0; i < segments.size(); i++) {
+            if (segments[i] <= from_seq) start = i;
+        }
+        for (size_t i = start; i < segments.size(); i++) {
+            bool stopped = false;
+            uint64_t last_seq = 0;
+            scan_segment(dir + "/" + segment_name(segments[i]), [&](const JournalRecord& rec) {
+                if (rec.seq < from_seq) return true;
+                if (!on_record(rec)) {
+                    stopped = true;
+                    return false;
+                }
+                return true;
+            }, last_seq);
+            if (stopped) return;
+        }
+    }
+};
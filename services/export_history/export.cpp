@@ -0,0 +1,230 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <unistd.h>
+#include <sqlite3.h>
+#include <arrow/api.h>
+#include <arrow/io/file.h>
+#include <arrow/ipc/writer.h>
+#include <parquet/arrow/writer.h>
+#include <parquet/properties.h>
+
+// Выгрузка истории показаний в Arrow IPC (stream) или Parquet.
+// Строки читаются курсором SQLite и пишутся пачками по batch_rows,
+// поэтому память не зависит от длины диапазона
+
+const std::string DB_PATH = "/home/tovarichkek/services/data_server_farm/data.db";
+const int64_t DEFAULT_BATCH_ROWS = 65536;
+
+const std::vector<std::string> SENSOR_FIELDS = {
+    "temperature_DHT22", "temperature_DS18B20", "humidity",
+    "water_level", "soil_moisture", "light_intensity"
+};
+
+struct ExportOptions {
+    int64_t unix_from = 0;
+    int64_t unix_to = INT64_MAX;
+    std::string device;
+    std::vector<std::string> fields = SENSOR_FIELDS;
+    std::string format = "arrow";
+    std::string out = "-";
+    int64_t batch_rows = DEFAULT_BATCH_ROWS;
+};
+
+void print_usage() {
+    std::cerr << "Usage: EXPORT --from <unix> --to <unix> [--device <id>] [--fields f1,f2,...]\n"
+              << "              [--format arrow|parquet] [--batch-rows N] [--out <path>|-]\n"
+              << "Fields: temperature_DHT22, temperature_DS18B20, humidity, water_level,\n"
+              << "        soil_moisture, light_intensity" << std::endl;
+}
+
+std::vector<std::string> split_fields(const std::string& list) {
+    std::vector<std::string> fields;
+    size_t begin = 0;
+    while (begin <= list.size()) {
+        size_t end = list.find(',', begin);
+        if (end == std::string::npos) end = list.size();
+        std::string field = list.substr(begin, end - begin);
+        bool known = false;
+        for (const auto& f : SENSOR_FIELDS) known |= (f == field);
+        if (!known) throw std::runtime_error("Unknown field: " + field);
+        fields.push_back(field);
+        begin = end + 1;
+    }
+    return fields;
+}
+
+ExportOptions parse_args(int argc, char* argv[]) {
+    ExportOptions opts;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) throw std::runtime_error("Missing value for " + arg);
+        std::string value = argv[++i];
+        if (arg == "--from") opts.unix_from = std::stoll(value);
+        else if (arg == "--to") opts.unix_to = std::stoll(value);
+        else if (arg == "--device") opts.device = value;
+        else if (arg == "--fields") opts.fields = split_fields(value);
+        else if (arg == "--format") opts.format = value;
+        else if (arg == "--out") opts.out = value;
+        else if (arg == "--batch-rows") opts.batch_rows = std::stoll(value);
+        else throw std::runtime_error("Unknown option: " + arg);
+    }
+    if (opts.format != "arrow" && opts.format != "parquet")
+        throw std::runtime_error("Unknown format: " + opts.format);
+    if (opts.unix_from > opts.unix_to || opts.batch_rows <= 0)
+        throw std::runtime_error("Invalid range or batch size");
+    return opts;
+}
+
+// Приёмник пачек: общий интерфейс для IPC и Parquet
+class BatchSink {
+public:
+    virtual ~BatchSink() = default;
+    virtual arrow::Status write(const std::shared_ptr<arrow::RecordBatch>& batch) = 0;
+    virtual arrow::Status close() = 0;
+};
+
+class IpcSink : public BatchSink {
+    std::shared_ptr<arrow::ipc::RecordBatchWriter> writer;
+public:
+    explicit IpcSink(std::shared_ptr<arrow::ipc::RecordBatchWriter> writer) : writer(std::move(writer)) {}
+    arrow::Status write(const std::shared_ptr<arrow::RecordBatch>& batch) override {
+        return writer->WriteRecordBatch(*batch);
+    }
+    arrow::Status close() override { return writer->Close(); }
+};
+
+class ParquetSink : public BatchSink {
+    std::unique_ptr<parquet::arrow::FileWriter> writer;
+public:
+    explicit ParquetSink(std::unique_ptr<parquet::arrow::FileWriter> writer) : writer(std::move(writer)) {}
+    arrow::Status write(const std::shared_ptr<arrow::RecordBatch>& batch) override {
+        return writer->WriteRecordBatch(*batch);
+    }
+    arrow::Status close() override { return writer->Close(); }
+};
+
+arrow::Result<std::unique_ptr<BatchSink>> open_sink(const ExportOptions& opts,
+                                                   const std::shared_ptr<arrow::Schema>& schema) {
+    std::shared_ptr<arrow::io::FileOutputStream> out;
+    if (opts.out == "-") {
+        ARROW_ASSIGN_OR_RAISE(out, arrow::io::FileOutputStream::Open(STDOUT_FILENO));
+    } else {
+        ARROW_ASSIGN_OR_RAISE(out, arrow::io::FileOutputStream::Open(opts.out));
+    }
+
+    if (opts.format == "arrow") {
+        ARROW_ASSIGN_OR_RAISE(auto writer, arrow::ipc::MakeStreamWriter(out, schema));
+        return std::unique_ptr<BatchSink>(new IpcSink(std::move(writer)));
+    }
+
+    // Группа строк Parquet = одна пачка, чтобы писатель не копил данные в памяти
+    auto props = parquet::WriterProperties::Builder()
+        .compression(parquet::Compression::ZSTD)
+        ->max_row_group_length(opts.batch_rows)
+        ->build();
+    auto arrow_props = parquet::ArrowWriterProperties::Builder().store_schema()->build();
+    ARROW_ASSIGN_OR_RAISE(auto writer, parquet::arrow::FileWriter::Open(
+        *schema, arrow::default_memory_pool(), out, props, arrow_props));
+    return std::unique_ptr<BatchSink>(new ParquetSink(std::move(writer)));
+}
+
+arrow::Result<int64_t> export_range(sqlite3* db, const ExportOptions& opts) {
+    std::string sql = "SELECT device, timestamp_unix";
+    for (const auto& field : opts.fields) sql += ", " + field;
+    sql += " FROM sensor_data WHERE timestamp_unix BETWEEN ? AND ?";
+    if (!opts.device.empty()) sql += " AND device = ?";
+    sql += " ORDER BY timestamp_unix;";
+
+    sqlite3_stmt* stmt;
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        return arrow::Status::IOError(sqlite3_errmsg(db));
+    }
+    std::unique_ptr<sqlite3_stmt, decltype(&sqlite3_finalize)> guard(stmt, &sqlite3_finalize);
+    sqlite3_bind_int64(stmt, 1, opts.unix_from);
+    sqlite3_bind_int64(stmt, 2, opts.unix_to);
+    if (!opts.device.empty()) sqlite3_bind_text(stmt, 3, opts.device.c_str(), -1, SQLITE_TRANSIENT);
+
+    arrow::FieldVector schema_fields = {
+        arrow::field("device", arrow::utf8(), false),
+        arrow::field("timestamp", arrow::timestamp(arrow::TimeUnit::SECOND, "UTC"), false)
+    };
+    for (const auto& field : opts.fields) schema_fields.push_back(arrow::field(field, arrow::float64()));
+    auto schema = arrow::schema(schema_fields);
+
+    ARROW_ASSIGN_OR_RAISE(auto sink, open_sink(opts, schema));
+
+    arrow::StringBuilder device_builder;
+    arrow::TimestampBuilder ts_builder(schema->field(1)->type(), arrow::default_memory_pool());
+    std::vector<arrow::DoubleBuilder> value_builders(opts.fields.size());
+
+    auto reserve = [&]() -> arrow::Status {
+        ARROW_RETURN_NOT_OK(device_builder.Reserve(opts.batch_rows));
+        ARROW_RETURN_NOT_OK(ts_builder.Reserve(opts.batch_rows));
+        for (auto& b : value_builders) ARROW_RETURN_NOT_OK(b.Reserve(opts.batch_rows));
+        return arrow::Status::OK();
+    };
+
+    int64_t rows_in_batch = 0, total = 0;
+    auto flush = [&]() -> arrow::Status {
+        if (rows_in_batch == 0) return arrow::Status::OK();
+        arrow::ArrayVector columns(2 + value_builders.size());
+        ARROW_RETURN_NOT_OK(device_builder.Finish(&columns[0]));
+        ARROW_RETURN_NOT_OK(ts_builder.Finish(&columns[1]));
+        for (size_t i = 0; i < value_builders.size(); i++) {
+            ARROW_RETURN_NOT_OK(value_builders[i].Finish(&columns[2 + i]));
+        }
+        ARROW_RETURN_NOT_OK(sink->write(arrow::RecordBatch::Make(schema, rows_in_batch, columns)));
+        total += rows_in_batch;
+        rows_in_batch = 0;
+        return reserve();
+    };
+
+    ARROW_RETURN_NOT_OK(reserve());
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        auto device = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+        ARROW_RETURN_NOT_OK(device_builder.Append(device ? device : ""));
+        ts_builder.UnsafeAppend(sqlite3_column_int64(stmt, 1));
+        for (size_t i = 0; i < value_builders.size(); i++) {
+            if (sqlite3_column_type(stmt, 2 + i) == SQLITE_NULL) value_builders[i].UnsafeAppendNull();
+            else value_builders[i].UnsafeAppend(sqlite3_column_double(stmt, 2 + i));
+        }
+        if (++rows_in_batch == opts.batch_rows) ARROW_RETURN_NOT_OK(flush());
+    }
+    if (rc != SQLITE_DONE) return arrow::Status::IOError(sqlite3_errmsg(db));
+
+    ARROW_RETURN_NOT_OK(flush());
+    ARROW_RETURN_NOT_OK(sink->close());
+    return total;
+}
+
+int main(int argc, char* argv[]) {
+    ExportOptions opts;
+    try {
+        opts = parse_args(argc, argv);
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << std::endl;
+        print_usage();
+        return 1;
+    }
+
+    sqlite3* db;
+    if (sqlite3_open_v2(DB_PATH.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+        std::cerr << "Fatal error: " << sqlite3_errmsg(db) << std::endl;
+        return 1;
+    }
+
+    auto result = export_range(db, opts);
+    sqlite3_close(db);
+    if (!result.ok()) {
+        std::cerr << "Export error: " << result.status().ToString() << std::endl;
+        return 1;
+    }
+    std::cerr << "Exported " << *result << " records" << std::endl;
+    return 0;
+}
@@ -0,0 +1 @@
+g++ -std=c++17 -o EXPORT export.cpp     -lsqlite3     -larrow     -lparquet
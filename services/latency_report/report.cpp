@@ -0,0 +1,169 @@
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <ctime>
+#include <cstdint>
+#include <sqlite3.h>
+#include <nlohmann/json.hpp>
+
+// Отчёт о задержках пути показания "датчик -> телефон" по устройствам из таблицы
+// latency_stats, которую раз в минуту пополняют DATA (участки до записи в БД) и LOGS
+// (выдача телефону). Для каждого устройства - перцентили по участкам и разбор медианного
+// возраста показания при выдаче: какая доля приходится на устройство, брокер, запись
+// в БД, а остаток - ожидание следующего опроса телефоном
+
+using json = nlohmann::json;
+
+const std::string DB_PATH = "/home/tovarichkek/services/data_server_farm/data.db";
+
+// Участки по порядку пути показания
+struct Hop {
+    const char* service;
+    const char* name;
+    const char* label;
+};
+
+const std::vector<Hop> HOPS = {
+    {"data", "read_to_publish", "device: sensor read -> publish"},
+    {"data", "publish_to_puback", "device: publish -> broker PUBACK"},
+    {"data", "publish_to_server", "MQTT client queue + broker -> DATA"},
+    {"data", "server_to_commit", "DATA: reorder buffer + commit"},
+    {"logs", "query", "LOGS: query execution"},
+    {"logs", "delivery_age", "reading age at delivery"}
+};
+
+// Участки, из которых складывается delivery_age (publish_to_puback идёт параллельно доставке)
+const std::vector<std::string> DELIVERY_PARTS = {"read_to_publish", "publish_to_server", "server_to_commit"};
+
+struct HopStats {
+    json histogram;
+    int64_t started_unix = 0;
+    int64_t updated_unix = 0;
+};
+
+void print_usage() {
+    std::cerr << "Usage: LATENCY [--db <path>] [--device <id>] [--json]" << std::endl;
+}
+
+std::string format_ms(int64_t ms) {
+    std::ostringstream out;
+    if (ms < 1000) out << ms << " ms";
+    else if (ms < 120000) out << std::fixed << std::setprecision(1) << ms / 1000.0 << " s";
+    else if (ms < 7200000) out << std::fixed << std::setprecision(1) << ms / 60000.0 << " min";
+    else if (ms < 172800000) out << std::fixed << std::setprecision(1) << ms / 3600000.0 << " h";
+    else out << std::fixed << std::setprecision(1) << ms / 86400000.0 << " d";
+    return out.str();
+}
+
+std::string format_time(int64_t unix_time) {
+    std::time_t t = static_cast<std::time_t>(unix_time);
+    std::tm tm_time;
+    localtime_r(&t, &tm_time);
+    char buf[20];
+    std::strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M", &tm_time);
+    return buf;
+}
+
+int main(int argc, char* argv[]) {
+    std::string db_path = DB_PATH;
+    std::string only_device;
+    bool as_json = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--json") as_json = true;
+        else if (arg == "--db" && i + 1 < argc) db_path = argv[++i];
+        else if (arg == "--device" && i + 1 < argc) only_device = argv[++i];
+        else {
+            print_usage();
+            return 1;
+        }
+    }
+
+    sqlite3* db;
+    if (sqlite3_open_v2(db_path.c_str(), &db, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+        std::cerr << "Fatal error: " << sqlite3_errmsg(db) << std::endl;
+        return 1;
+    }
+    sqlite3_stmt* stmt;
+    const char* sql = "SELECT service, device, hop, started_unix, updated_unix, histogram "
+                      "FROM latency_stats ORDER BY device;";
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) {
+        std::cerr << "No latency stats: " << sqlite3_errmsg(db) << std::endl;
+        sqlite3_close(db);
+        return 1;
+    }
+
+    // устройство -> "служба/участок" -> гистограмма
+    std::map<std::string, std::map<std::string, HopStats>> devices;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        std::string service = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+        std::string device = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+        std::string hop = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+        if (!only_device.empty() && device != only_device) continue;
+        HopStats stats;
+        stats.started_unix = sqlite3_column_int64(stmt, 3);
+        stats.updated_unix = sqlite3_column_int64(stmt, 4);
+        stats.histogram = json::parse(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 5)), nullptr, false);
+        if (stats.histogram.is_discarded()) continue;
+        devices[device][service + "/" + hop] = stats;
+    }
+    sqlite3_finalize(stmt);
+    sqlite3_close(db);
+
+    if (as_json) {
+        json out = json::object();
+        for (const auto& [device, hops] : devices) {
+            for (const auto& [hop, stats] : hops) out[device][hop] = stats.histogram;
+        }
+        std::cout << out.dump(2) << std::endl;
+        return 0;
+    }
+    if (devices.empty()) {
+        std::cout << "No latency stats yet (DATA and LOGS save them once a minute)" << std::endl;
+        return 0;
+    }
+
+    for (const auto& [device, hops] : devices) {
+        std::cout << "Device " << (device == "_all" ? "(requests without device)" : device) << "\n";
+        std::cout << "  " << std::left << std::setw(40) << "hop" << std::right << std::setw(9) << "count"
+                  << std::setw(11) << "p50" << std::setw(11) << "p90" << std::setw(11) << "p99"
+                  << std::setw(11) << "max" << "  since\n";
+        for (const auto& hop : HOPS) {
+            auto it = hops.find(std::string(hop.service) + "/" + hop.name);
+            if (it == hops.end()) continue;
+            const json& h = it->second.histogram;
+            std::cout << "  " << std::left << std::setw(40) << hop.label << std::right
+                      << std::setw(9) << h.value("count", int64_t{0})
+                      << std::setw(11) << format_ms(h.value("p50_ms", int64_t{0}))
+                      << std::setw(11) << format_ms(h.value("p90_ms", int64_t{0}))
+                      << std::setw(11) << format_ms(h.value("p99_ms", int64_t{0}))
+                      << std::setw(11) << format_ms(h.value("max_ms", int64_t{0}))
+                      << "  " << format_time(it->second.started_unix);
+            if (h.value("negative", int64_t{0}) > 0) std::cout << " (" << h.value("negative", int64_t{0}) << " negative: clock skew)";
+            std::cout << "\n";
+        }
+
+        // Медианы не складываются строго, но для разбора "куда уходит время" этого достаточно
+        auto age = hops.find("logs/delivery_age");
+        if (age != hops.end() && age->second.histogram.value("count", int64_t{0}) > 0) {
+            int64_t total = std::max<int64_t>(1, age->second.histogram.value("p50_ms", int64_t{0}));
+            int64_t accounted = 0;
+            std::cout << "  Median delivery age " << format_ms(total) << ":";
+            for (const auto& part : DELIVERY_PARTS) {
+                auto it = hops.find("data/" + part);
+                if (it == hops.end()) continue;
+                int64_t ms = it->second.histogram.value("p50_ms", int64_t{0});
+                accounted += ms;
+                std::cout << " " << part << " " << format_ms(ms) << " (" << ms * 100 / total << "%),";
+            }
+            int64_t waiting = std::max<int64_t>(0, total - accounted);
+            std::cout << " waiting for phone poll " << format_ms(waiting) << " (" << waiting * 100 / total << "%)\n";
+        }
+        std::cout << std::endl;
+    }
+    return 0;
+}
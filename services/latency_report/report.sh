@@ -0,0 +1 @@
+g++ -std=c++17 -o LATENCY report.cpp     -lsqlite3
@@ -0,0 +1,289 @@
+#pragma once
+
+// Допуск запросов к истории (порт 1488 и HTTP API).
+// RateLimiter - вёдра токенов на IP и общее на процесс. Запрос стоит по оценке числа
+// строк: токен - сутки показаний одного устройства, плюс немного за сам запрос, так что
+// опрос последнего показания почти бесплатен, а выгрузка за год - дорогая.
+// Запрос дороже ёмкости ведра пропускается только при полном ведре и уводит его в минус:
+// клиент ждёт, пока долг не погасится.
+// QueryGate - ограниченная очередь перед выполнением: не больше slots запросов к БД
+// одновременно, ожидающие получают место по возрастанию стоимости (дешёвые раньше), очередь
+// ограничена по длине и времени ожидания. Кому не хватило места - сразу ответ "занято"
+// с советом, когда повторить, вместо ещё одного потока, ждущего БД.
+// Точечные запросы (не больше POINT_MAX_ROWS строк) идут своей полосой: у них есть отведённое
+// место, а длинные выборки на границах кусков уступают им процессор и БД
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+#include <cstdint>
+#include "database.h"
+
+// Решение о допуске: retry_after_ms - через сколько стоит повторить отклонённый запрос
+struct Admission {
+    bool admitted = true;
+    int64_t retry_after_ms = 0;
+};
+
+class TokenBucket {
+    double rate;
+    double burst;
+    double tokens;
+    std::chrono::steady_clock::time_point updated;
+
+    void refill(std::chrono::steady_clock::time_point now) {
+        double elapsed = std::chrono::duration<double>(now - updated).count();
+        tokens = std::min(burst, tokens + elapsed * rate);
+        updated = now;
+    }
+
+public:
+    TokenBucket(double rate, double burst)
+        : rate(rate), burst(burst), tokens(burst), updated(std::chrono::steady_clock::now()) {}
+
+    // Сколько ждать, пока хватит токенов на cost (дороже ёмкости - пока ведро не наполнится), 0 - можно сейчас
+    int64_t wait_ms(double cost, std::chrono::steady_clock::time_point now) {
+        refill(now);
+        double need = std::min(cost, burst);
+        if(tokens >= need) return 0;
+        return static_cast<int64_t>(std::ceil((need - tokens) / rate * 1000));
+    }
+
+    void take(double cost) {
+        tokens -= cost;
+    }
+
+    bool full(std::chrono::steady_clock::time_point now) {
+        refill(now);
+        return tokens >= burst;
+    }
+};
+
+class RateLimiter {
+public:
+    static constexpr double ROWS_PER_TOKEN = 8640;      // сутки показаний одного устройства (раз в 10 с)
+    static constexpr double REQUEST_TOKENS = 0.1;       // накладные расходы любого запроса
+    static constexpr int64_t SAMPLE_INTERVAL_SEC = 10;  // период показаний (DEFAULT_READ_INTERVAL контроллера)
+    static constexpr int64_t ESTIMATE_REFRESH_SEC = 600;
+    static constexpr size_t MAX_TRACKED_IPS = 4096;
+
+private:
+    // Для оценки: первое показание и число строк устройства, обновляются раз в ESTIMATE_REFRESH_SEC
+    struct DeviceStats {
+        int64_t first_ts = -1;
+        int64_t rows = 0;
+        int64_t devices = 1;
+        std::chrono::steady_clock::time_point updated;
+    };
+
+    double ip_rate;
+    double ip_burst;
+    TokenBucket global;
+    std::map<std::string, TokenBucket> clients;
+    std::map<std::string, DeviceStats> stats;
+    std::mutex mtx;
+
+    DeviceStats device_stats(Database& db, const std::string& device) {
+        auto now = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto it = stats.find(device);
+            if(it != stats.end() && now - it->second.updated < std::chrono::seconds(ESTIMATE_REFRESH_SEC)) {
+                return it->second;
+            }
+        }
+        DeviceStats fresh;
+        fresh.first_ts = db.get_first_timestamp(device);
+        fresh.rows = db.get_row_count(device);
+        if(device.empty()) fresh.devices = std::max<int64_t>(1, db.get_device_count());
+        fresh.updated = now;
+        std::lock_guard<std::mutex> lock(mtx);
+        stats[device] = fresh;
+        return fresh;
+    }
+
+public:
+    RateLimiter(double ip_rate, double ip_burst, double global_rate, double global_burst)
+        : ip_rate(ip_rate), ip_burst(ip_burst), global(global_rate, global_burst) {}
+
+    // Строк в [unix_from, unix_to]: пролёт от первого показания до текущего момента на частоту
+    // показаний и число устройств, но не больше, чем строк у устройства всего
+    int64_t estimate_rows(Database& db, const std::string& device, int64_t unix_from, int64_t unix_to) {
+        DeviceStats s = device_stats(db, device);
+        if(s.first_ts < 0) return 0;
+        int64_t from = std::max(unix_from, s.first_ts);
+        int64_t to = std::min<int64_t>(unix_to, std::time(nullptr));
+        if(to < from) return 0;
+        int64_t span_rows = ((to - from) / SAMPLE_INTERVAL_SEC + 1) * s.devices;
+        return std::min(span_rows, s.rows);
+    }
+
+    static double cost(int64_t rows) {
+        return REQUEST_TOKENS + static_cast<double>(rows) / ROWS_PER_TOKEN;
+    }
+
+    // Токены списываются, только если хватает и у IP, и в общем ведре
+    Admission admit(const std::string& ip, int64_t rows) {
+        double c = cost(rows);
+        auto now = std::chrono::steady_clock::now();
+        std::lock_guard<std::mutex> lock(mtx);
+        if(clients.size() >= MAX_TRACKED_IPS) {
+            // Полное ведро ничем не отличается от нового
+            for(auto it = clients.begin(); it != clients.end();) {
+                if(it->second.full(now)) it = clients.erase(it);
+                else ++it;
+            }
+        }
+        auto client = clients.try_emplace(ip, ip_rate, ip_burst).first;
+        int64_t wait = std::max(client->second.wait_ms(c, now), global.wait_ms(c, now));
+        if(wait > 0) return {false, wait};
+        client->second.take(c);
+        global.take(c);
+        return {};
+    }
+};
+
+class QueryGate {
+public:
+    static constexpr int64_t RETRY_AFTER_MS = 1000;     // совет клиенту, не получившему места
+    static constexpr int64_t POINT_MAX_ROWS = 1000;     // дешевле - точечный запрос (последнее показание, страница синхронизации)
+    static constexpr std::chrono::milliseconds SCAN_PAUSE_MAX{20};
+
+private:
+    struct Waiter {
+        int64_t cost;
+        uint64_t seq;
+        bool point;
+        bool granted = false;
+        bool reserved = false;      // получил место, отведённое точечным запросам
+        bool rejected = false;
+        std::condition_variable cv;
+    };
+
+    size_t slots;
+    size_t point_slots;
+    size_t free_slots;
+    size_t free_point_slots;
+    size_t max_waiting;
+    std::chrono::milliseconds max_wait;
+    std::vector<Waiter*> waiting;
+    uint64_t next_seq = 0;
+    size_t running_points = 0;
+    std::condition_variable points_done;
+    std::mutex mtx;
+
+    static bool cheaper(const Waiter* a, const Waiter* b) {
+        return a->cost != b->cost ? a->cost < b->cost : a->seq < b->seq;
+    }
+
+    void grant(std::vector<Waiter*>::iterator it, bool reserved) {
+        Waiter* w = *it;
+        waiting.erase(it);
+        w->granted = true;
+        w->reserved = reserved;
+        if(w->point) running_points++;
+        w->cv.notify_one();
+    }
+
+    // Место освободившегося запроса сразу переходит самому дешёвому ожидающему;
+    // отведённое точечным - только точечному
+    void release(bool point, bool reserved) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if(point && --running_points == 0) points_done.notify_all();
+        if(reserved) {
+            auto next = waiting.end();
+            for(auto it = waiting.begin(); it != waiting.end(); ++it) {
+                if((*it)->point && (next == waiting.end() || cheaper(*it, *next))) next = it;
+            }
+            if(next == waiting.end()) free_point_slots++;
+            else grant(next, true);
+            return;
+        }
+        if(waiting.empty()) free_slots++;
+        else grant(std::min_element(waiting.begin(), waiting.end(), cheaper), false);
+    }
+
+public:
+    // Место в QueryGate: освобождается деструктором. Пустой билет - места не дали
+    class Ticket {
+        QueryGate* gate = nullptr;
+        bool point = false;
+        bool reserved = false;
+
+    public:
+        Ticket() = default;
+        Ticket(QueryGate* gate, bool point, bool reserved) : gate(gate), point(point), reserved(reserved) {}
+        Ticket(Ticket&& other) noexcept : gate(other.gate), point(other.point), reserved(other.reserved) {
+            other.gate = nullptr;
+        }
+        Ticket& operator=(Ticket&& other) noexcept {
+            std::swap(gate, other.gate);
+            std::swap(point, other.point);
+            std::swap(reserved, other.reserved);
+            return *this;
+        }
+        Ticket(const Ticket&) = delete;
+        Ticket& operator=(const Ticket&) = delete;
+        ~Ticket() {
+            if(gate) gate->release(point, reserved);
+        }
+        explicit operator bool() const { return gate != nullptr; }
+        bool scan() const { return gate && !point; }
+    };
+
+    // slots - общие места, point_slots - только для точечных запросов: последнее показание
+    // не ждёт, даже когда все общие места заняты выгрузками
+    QueryGate(size_t slots, size_t point_slots, size_t max_waiting, std::chrono::milliseconds max_wait)
+        : slots(slots), point_slots(point_slots), free_slots(slots), free_point_slots(point_slots),
+          max_waiting(max_waiting), max_wait(max_wait) {}
+
+    // Сколько запросов одновременно выполняется или ждёт - столько рабочих потоков имеет смысл держать
+    size_t capacity() const {
+        return slots + point_slots + max_waiting;
+    }
+
+    // Ждёт места не дольше max_wait. При полной очереди новый запрос вытесняет самый дорогой
+    // из ожидающих, если сам дешевле, иначе получает отказ сразу
+    Ticket enter(int64_t cost) {
+        bool point = cost <= POINT_MAX_ROWS;
+        std::unique_lock<std::mutex> lock(mtx);
+        if(point && free_point_slots > 0) {
+            free_point_slots--;
+            running_points++;
+            return Ticket(this, true, true);
+        }
+        // Свободное общее место бывает только при пустой очереди: release отдаёт его сразу
+        if(free_slots > 0) {
+            free_slots--;
+            if(point) running_points++;
+            return Ticket(this, point, false);
+        }
+        if(waiting.size() >= max_waiting) {
+            if(waiting.empty()) return Ticket();
+            auto worst = std::max_element(waiting.begin(), waiting.end(), cheaper);
+            if((*worst)->cost <= cost) return Ticket();
+            (*worst)->rejected = true;
+            (*worst)->cv.notify_one();
+            waiting.erase(worst);
+        }
+        Waiter self{cost, next_seq++, point};
+        waiting.push_back(&self);
+        self.cv.wait_for(lock, max_wait, [&self] { return self.granted || self.rejected; });
+        if(self.granted) return Ticket(this, point, self.reserved);
+        if(!self.rejected) waiting.erase(std::find(waiting.begin(), waiting.end(), &self));
+        return Ticket();
+    }
+
+    // Граница куска длинной выборки (срез, запечатывание дня): пока выполняются точечные
+    // запросы, выборка ждёт, но не дольше SCAN_PAUSE_MAX - иначе поток опросов её бы остановил
+    void yield_to_points() {
+        std::unique_lock<std::mutex> lock(mtx);
+        points_done.wait_for(lock, SCAN_PAUSE_MAX, [this] { return running_points == 0; });
+    }
+};
@@ -0,0 +1,421 @@
+#pragma once
+
+// Доступ к data.db (её пишет data.service) и формат записи показания для телефона
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+#include <sqlite3.h>
+#include <arpa/inet.h>
+
+#pragma pack(push, 1)
+struct SensorData {
+    int64_t timestamp_unix;
+    double temperature_DHT22;
+    double temperature_DS18B20;
+    double humidity;
+    double water_level;
+    double soil_moisture;
+    double light_intensity;
+};
+#pragma pack(pop)
+
+// Выбор полей запроса ("fields"): бит i - i-е поле SensorData после времени
+typedef uint8_t FieldMask;
+const FieldMask ALL_FIELDS = 0x3F;
+const char* const FIELD_NAMES[6] = {
+    "temperature_DHT22", "temperature_DS18B20", "humidity",
+    "water_level", "soil_moisture", "light_intensity"
+};
+
+// 0 - нет такого поля
+inline FieldMask field_bit(const std::string& name) {
+    for(int f = 0; f < 6; f++) {
+        if(name == FIELD_NAMES[f]) return static_cast<FieldMask>(1u << f);
+    }
+    return 0;
+}
+
+inline uint64_t htonll(uint64_t value) {
+    static const int num = 42;
+    if (*reinterpret_cast<const char*>(&num) == num) {
+        return (static_cast<uint64_t>(htonl(value & 0xFFFFFFFF)) << 32) | htonl(value >> 32);
+    } else {
+        return value;
+    }
+}
+
+inline uint64_t ntohll(uint64_t value) {
+    return htonll(value);
+}
+
+const std::string DB_PATH = "/home/tovarichkek/services/data_server_farm/data.db";
+
+// Отметки приёма, которые ведёт data.cpp в таблице ingest_state
+struct IngestState {
+    int64_t ts_watermark = 0;
+    int64_t late_epoch = 0;
+    int64_t journal_seq = 0;    // растёт с каждой записью в БД
+    int64_t import_seq = 0;     // растёт с каждой транзакцией bulk_import
+};
+
+// Итоги показаний за диапазон: поля в порядке SensorData
+struct SensorAggregate {
+    int64_t count = 0;
+    int64_t first_unix = 0;
+    int64_t last_unix = 0;
+    double min[6] = {};
+    double max[6] = {};
+    double avg[6] = {};
+};
+
+// Событие аномалии из таблицы alerts (её пишет data.cpp)
+struct AlertRecord {
+    int64_t id;
+    int64_t timestamp_unix;
+    std::string device;
+    std::string field;
+    std::string kind;
+    std::string state;
+    double value;
+    double expected;
+};
+
+class Database {
+    sqlite3* db;
+
+public:
+    Database() {
+        if(sqlite3_open(DB_PATH.c_str(), &db) != SQLITE_OK) {
+            throw std::runtime_error(sqlite3_errmsg(db));
+        }
+    }
+    
+    ~Database() {
+        sqlite3_close(db);
+    }
+
+    // Пустой device - показания всех устройств
+    std::vector<SensorData> get_data(int64_t unix_from, int64_t unix_to, const std::string& device = "") {
+        std::vector<SensorData> results;
+        sqlite3_stmt* stmt;
+        const char* sql = "SELECT timestamp_unix, temperature_DHT22, "
+                          "temperature_DS18B20, humidity, water_level, "
+                          "soil_moisture, light_intensity "
+                          "FROM sensor_data "
+                          "WHERE timestamp_unix BETWEEN ? AND ? "
+                          "AND (?3 = '' OR device = ?3) "
+                          "ORDER BY timestamp_unix;";
+
+        if(sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, unix_from);
+            sqlite3_bind_int64(stmt, 2, unix_to);
+            sqlite3_bind_text(stmt, 3, device.c_str(), -1, SQLITE_TRANSIENT);
+
+            while(sqlite3_step(stmt) == SQLITE_ROW) {
+                results.push_back({
+                    sqlite3_column_int64(stmt, 0),
+                    sqlite3_column_double(stmt, 1),
+                    sqlite3_column_double(stmt, 2),
+                    sqlite3_column_double(stmt, 3),
+                    sqlite3_column_double(stmt, 4),
+                    sqlite3_column_double(stmt, 5),
+                    sqlite3_column_double(stmt, 6)
+                });
+            }
+            sqlite3_finalize(stmt);
+        }
+        return results;
+    }
+
+    // Как get_data, но только время и поля fields, остальные поля - 0: SQLite не разбирает
+    // и не копирует лишние колонки
+    std::vector<SensorData> get_fields(int64_t unix_from, int64_t unix_to, const std::string& device,
+                                       FieldMask fields) {
+        std::vector<SensorData> results;
+        std::vector<int> selected;
+        std::string sql = "SELECT timestamp_unix";
+        for(int f = 0; f < 6; f++) {
+            if(!(fields & (1u << f))) continue;
+            sql += std::string(", ") + FIELD_NAMES[f];
+            selected.push_back(f);
+        }
+        sql += " FROM sensor_data "
+               "WHERE timestamp_unix BETWEEN ? AND ? "
+               "AND (?3 = '' OR device = ?3) "
+               "ORDER BY timestamp_unix;";
+
+        sqlite3_stmt* stmt;
+        if(sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, unix_from);
+            sqlite3_bind_int64(stmt, 2, unix_to);
+            sqlite3_bind_text(stmt, 3, device.c_str(), -1, SQLITE_TRANSIENT);
+
+            while(sqlite3_step(stmt) == SQLITE_ROW) {
+                SensorData row{};
+                row.timestamp_unix = sqlite3_column_int64(stmt, 0);
+                char* values = reinterpret_cast<char*>(&row) + sizeof(int64_t);
+                for(size_t i = 0; i < selected.size(); i++) {
+                    double value = sqlite3_column_double(stmt, static_cast<int>(i + 1));
+                    memcpy(values + sizeof(double) * selected[i], &value, sizeof(value));
+                }
+                results.push_back(row);
+            }
+            sqlite3_finalize(stmt);
+        }
+        return results;
+    }
+
+    // Строки в порядке записи в БД (id), новее after_id и since_unix. В ids - их id
+    std::vector<SensorData> get_rows_after(int64_t after_id, int64_t since_unix, const std::string& device,
+                                           int limit, std::vector<int64_t>& ids) {
+        std::vector<SensorData> results;
+        sqlite3_stmt* stmt;
+        const char* sql = "SELECT id, timestamp_unix, temperature_DHT22, "
+                          "temperature_DS18B20, humidity, water_level, "
+                          "soil_moisture, light_intensity "
+                          "FROM sensor_data "
+                          "WHERE id > ?1 AND timestamp_unix > ?2 "
+                          "AND (?3 = '' OR device = ?3) "
+                          "ORDER BY id LIMIT ?4;";
+
+        if(sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, after_id);
+            sqlite3_bind_int64(stmt, 2, since_unix);
+            sqlite3_bind_text(stmt, 3, device.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int(stmt, 4, limit);
+
+            while(sqlite3_step(stmt) == SQLITE_ROW) {
+                ids.push_back(sqlite3_column_int64(stmt, 0));
+                results.push_back({
+                    sqlite3_column_int64(stmt, 1),
+                    sqlite3_column_double(stmt, 2),
+                    sqlite3_column_double(stmt, 3),
+                    sqlite3_column_double(stmt, 4),
+                    sqlite3_column_double(stmt, 5),
+                    sqlite3_column_double(stmt, 6),
+                    sqlite3_column_double(stmt, 7)
+                });
+            }
+            sqlite3_finalize(stmt);
+        }
+        return results;
+    }
+
+    // Курсор для первой синхронизации от времени since_unix: id перед первой строкой
+    // новее since_unix (по индексу времени), а если таких нет - последний id таблицы
+    int64_t sync_start_id(int64_t since_unix) {
+        int64_t id = 0;
+        sqlite3_stmt* stmt;
+        const char* sql = "SELECT coalesce("
+                          "(SELECT min(id) FROM sensor_data WHERE timestamp_unix > ?) - 1, "
+                          "(SELECT max(id) FROM sensor_data), 0);";
+
+        if(sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, since_unix);
+            if(sqlite3_step(stmt) == SQLITE_ROW) {
+                id = sqlite3_column_int64(stmt, 0);
+            }
+            sqlite3_finalize(stmt);
+        }
+        return id;
+    }
+
+    IngestState get_ingest_state() {
+        IngestState state;
+        sqlite3_stmt* stmt;
+        const char* sql = "SELECT name, value FROM ingest_state "
+                          "WHERE name IN ('ts_watermark', 'late_epoch', 'journal_seq', 'import_seq');";
+
+        if(sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
+            while(sqlite3_step(stmt) == SQLITE_ROW) {
+                std::string name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+                if(name == "ts_watermark") state.ts_watermark = sqlite3_column_int64(stmt, 1);
+                else if(name == "late_epoch") state.late_epoch = sqlite3_column_int64(stmt, 1);
+                else if(name == "journal_seq") state.journal_seq = sqlite3_column_int64(stmt, 1);
+                else state.import_seq = sqlite3_column_int64(stmt, 1);
+            }
+            sqlite3_finalize(stmt);
+        }
+        return state;
+    }
+
+    // События новее after_id по порядку. Пока data.service не создал таблицу - пусто
+    std::vector<AlertRecord> get_alerts(int64_t after_id, const std::string& device, int limit) {
+        std::vector<AlertRecord> results;
+        sqlite3_stmt* stmt;
+        const char* sql = "SELECT id, timestamp_unix, device, field, kind, state, value, expected "
+                          "FROM alerts "
+                          "WHERE id > ?1 AND (?2 = '' OR device = ?2) "
+                          "ORDER BY id LIMIT ?3;";
+
+        if(sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, after_id);
+            sqlite3_bind_text(stmt, 2, device.c_str(), -1, SQLITE_TRANSIENT);
+            sqlite3_bind_int(stmt, 3, limit);
+
+            while(sqlite3_step(stmt) == SQLITE_ROW) {
+                results.push_back({
+                    sqlite3_column_int64(stmt, 0),
+                    sqlite3_column_int64(stmt, 1),
+                    reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2)),
+                    reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3)),
+                    reinterpret_cast<const char*>(sqlite3_column_text(stmt, 4)),
+                    reinterpret_cast<const char*>(sqlite3_column_text(stmt, 5)),
+                    sqlite3_column_double(stmt, 6),
+                    sqlite3_column_double(stmt, 7)
+                });
+            }
+            sqlite3_finalize(stmt);
+        }
+        return results;
+    }
+
+    // Для устройства - отдельный запрос: с условием "?1 = '' OR" SQLite не берёт индекс
+    // (device, timestamp_unix) и идёт по времени назад через строки всех устройств
+    SensorData get_latest_data(const std::string& device = "") {
+        SensorData data{};
+        sqlite3_stmt* stmt;
+        const char* sql = device.empty()
+            ? "SELECT timestamp_unix, temperature_DHT22, "
+              "temperature_DS18B20, humidity, water_level, "
+              "soil_moisture, light_intensity "
+              "FROM sensor_data "
+              "WHERE ?1 = '' "
+              "ORDER BY timestamp_unix DESC LIMIT 1;"
+            : "SELECT timestamp_unix, temperature_DHT22, "
+              "temperature_DS18B20, humidity, water_level, "
+              "soil_moisture, light_intensity "
+              "FROM sensor_data "
+              "WHERE device = ?1 "
+              "ORDER BY timestamp_unix DESC LIMIT 1;";
+
+        if(sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
+            sqlite3_bind_text(stmt, 1, device.c_str(), -1, SQLITE_TRANSIENT);
+            if(sqlite3_step(stmt) == SQLITE_ROW) {
+                data.timestamp_unix = sqlite3_column_int64(stmt, 0);
+                data.temperature_DHT22 = sqlite3_column_double(stmt, 1);
+                data.temperature_DS18B20 = sqlite3_column_double(stmt, 2);
+                data.humidity = sqlite3_column_double(stmt, 3);
+                data.water_level = sqlite3_column_double(stmt, 4);
+                data.soil_moisture = sqlite3_column_double(stmt, 5);
+                data.light_intensity = sqlite3_column_double(stmt, 6);
+            }
+            sqlite3_finalize(stmt);
+        }
+        return data;
+    }
+
+    // Время самого раннего показания, -1 - показаний нет
+    int64_t get_first_timestamp(const std::string& device = "") {
+        int64_t first = -1;
+        sqlite3_stmt* stmt;
+        const char* sql = device.empty()
+            ? "SELECT timestamp_unix FROM sensor_data WHERE ?1 = '' ORDER BY timestamp_unix LIMIT 1;"
+            : "SELECT timestamp_unix FROM sensor_data WHERE device = ?1 ORDER BY timestamp_unix LIMIT 1;";
+
+        if(sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
+            sqlite3_bind_text(stmt, 1, device.c_str(), -1, SQLITE_TRANSIENT);
+            if(sqlite3_step(stmt) == SQLITE_ROW) first = sqlite3_column_int64(stmt, 0);
+            sqlite3_finalize(stmt);
+        }
+        return first;
+    }
+
+    // Число показаний устройства (все устройства - пустая строка)
+    int64_t get_row_count(const std::string& device = "") {
+        int64_t count = 0;
+        sqlite3_stmt* stmt;
+        const char* sql = device.empty() ? "SELECT COUNT(*) FROM sensor_data WHERE ?1 = '';"
+                                         : "SELECT COUNT(*) FROM sensor_data WHERE device = ?1;";
+
+        if(sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
+            sqlite3_bind_text(stmt, 1, device.c_str(), -1, SQLITE_TRANSIENT);
+            if(sqlite3_step(stmt) == SQLITE_ROW) count = sqlite3_column_int64(stmt, 0);
+            sqlite3_finalize(stmt);
+        }
+        return count;
+    }
+
+    // Число, время первого и последнего показания, минимум, максимум и среднее каждого поля за
+    // [unix_from, unix_to]. Для устройства - по индексу (device, timestamp_unix)
+    SensorAggregate get_aggregate(int64_t unix_from, int64_t unix_to, const std::string& device = "") {
+        SensorAggregate aggregate;
+        sqlite3_stmt* stmt;
+        std::string sql = "SELECT COUNT(*), MIN(timestamp_unix), MAX(timestamp_unix)";
+        for(const char* field : {"temperature_DHT22", "temperature_DS18B20", "humidity",
+                                 "water_level", "soil_moisture", "light_intensity"}) {
+            sql += std::string(", MIN(") + field + "), MAX(" + field + "), AVG(" + field + ")";
+        }
+        sql += device.empty() ? " FROM sensor_data WHERE timestamp_unix BETWEEN ?1 AND ?2 AND ?3 = '';"
+                              : " FROM sensor_data WHERE device = ?3 AND timestamp_unix BETWEEN ?1 AND ?2;";
+
+        if(sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+            sqlite3_bind_int64(stmt, 1, unix_from);
+            sqlite3_bind_int64(stmt, 2, unix_to);
+            sqlite3_bind_text(stmt, 3, device.c_str(), -1, SQLITE_TRANSIENT);
+            if(sqlite3_step(stmt) == SQLITE_ROW) {
+                aggregate.count = sqlite3_column_int64(stmt, 0);
+                aggregate.first_unix = sqlite3_column_int64(stmt, 1);
+                aggregate.last_unix = sqlite3_column_int64(stmt, 2);
+                for(int f = 0; f < 6; f++) {
+                    aggregate.min[f] = sqlite3_column_double(stmt, 3 + 3 * f);
+                    aggregate.max[f] = sqlite3_column_double(stmt, 4 + 3 * f);
+                    aggregate.avg[f] = sqlite3_column_double(stmt, 5 + 3 * f);
+                }
+            }
+            sqlite3_finalize(stmt);
+        }
+        return aggregate;
+    }
+
+    // Чтения между begin_snapshot и end_snapshot видят одно состояние БД (транзакция чтения
+    // в WAL). Только для соединения, которым не пользуются другие потоки
+    bool begin_snapshot() {
+        return sqlite3_exec(db, "BEGIN", nullptr, nullptr, nullptr) == SQLITE_OK;
+    }
+
+    void end_snapshot() {
+        sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr);
+    }
+
+    // Число устройств с показаниями: прыжки по индексу (device, device_ts), а не проход таблицы
+    int64_t get_device_count() {
+        int64_t count = 0;
+        sqlite3_stmt* stmt;
+        const char* sql = "WITH RECURSIVE d(name) AS ("
+                          "SELECT MIN(device) FROM sensor_data "
+                          "UNION ALL "
+                          "SELECT (SELECT MIN(device) FROM sensor_data WHERE device > d.name) FROM d "
+                          "WHERE d.name IS NOT NULL) "
+                          "SELECT COUNT(name) FROM d;";
+
+        if(sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
+            if(sqlite3_step(stmt) == SQLITE_ROW) count = sqlite3_column_int64(stmt, 0);
+            sqlite3_finalize(stmt);
+        }
+        return count;
+    }
+
+    // Снимок гистограмм задержек (trace_stats.h) в latency_stats. Таблицу создаёт data.cpp
+    bool save_latency(const std::string& service, const std::string& device, const std::string& hop,
+                      int64_t started_unix, int64_t updated_unix, const std::string& histogram) {
+        sqlite3_stmt* stmt;
+        const char* sql = "INSERT INTO latency_stats (service, device, hop, started_unix, updated_unix, histogram) "
+                          "VALUES (?, ?, ?, ?, ?, ?) "
+                          "ON CONFLICT(service, device, hop) DO UPDATE SET started_unix = excluded.started_unix, "
+                          "updated_unix = excluded.updated_unix, histogram = excluded.histogram;";
+        if(sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK) return false;
+        sqlite3_bind_text(stmt, 1, service.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 2, device.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(stmt, 3, hop.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 4, started_unix);
+        sqlite3_bind_int64(stmt, 5, updated_unix);
+        sqlite3_bind_text(stmt, 6, histogram.c_str(), -1, SQLITE_TRANSIENT);
+        bool ok = sqlite3_step(stmt) == SQLITE_DONE;
+        sqlite3_finalize(stmt);
+        return ok;
+    }
+};
@@ -0,0 +1,283 @@
+#pragma once
+
+// Запечатанные дни истории. Сутки (UTC), целиком не новее отметки приёма, больше
+// не меняются - их записи один раз кодируются в формат порта 1488 и кладутся в файл
+// <каталог>/<устройство>/<день>.bin, рядом <день>.gz - те же байты, сжатые raw deflate
+// и закрытые Z_SYNC_FLUSH (такой кусок вклеивается в любой gzip-поток, см. BodyWriter).
+// Ответ на диапазон отдаёт целые закрытые дни из файлов через sendfile/splice, без
+// чтения в память и кодирования; края диапазона и открытый день идут через RangeCache.
+// Файл запечатывается при первом запросе дня. Заголовок файла хранит late_epoch:
+// после записи опоздавшего показания день запечатывается заново
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <zlib.h>
+#include "database.h"
+#include "encoding.h"
+#include "range_cache.h"
+
+// Тело одного файла дня (после заголовка)
+struct SealedFile {
+    int fd = -1;
+    uint64_t offset = 0;
+    uint64_t length = 0;
+
+    ~SealedFile() {
+        if(fd >= 0) close(fd);
+    }
+};
+
+struct SealedDay {
+    uint32_t count = 0;
+    uint32_t raw_crc = 0;           // crc32 несжатых записей - для трейлера gzip
+    uint64_t raw_length = 0;
+    SealedFile binary;
+    SealedFile deflated;
+};
+
+using SealedDayRef = std::shared_ptr<const SealedDay>;
+
+// Записи, отображённые в память (RecordStore): owner держит отображение, пока часть ответа жива
+struct MappedSlice {
+    std::shared_ptr<const void> owner;
+    const char* data = nullptr;
+    size_t length = 0;
+};
+
+// Часть ответа: байты в памяти (кусок или отображение) или запечатанный день
+struct Segment {
+    Chunk bytes;
+    SealedDayRef day;
+    MappedSlice mapped;
+
+    size_t size() const { return bytes ? bytes->size() : day ? day->binary.length : mapped.length; }
+    bool in_memory() const { return !day; }
+    const char* data() const { return bytes ? bytes->data() : mapped.data; }
+};
+
+inline std::vector<Segment> to_segments(const std::vector<Chunk>& chunks) {
+    std::vector<Segment> segments;
+    for(const auto& c : chunks) segments.push_back({c, nullptr});
+    return segments;
+}
+
+// Имя устройства становится каталогом: всё, кроме [A-Za-z0-9_-], хранится только в БД
+inline bool safe_device_name(const std::string& device) {
+    if(device.empty() || device.size() > 64) return false;
+    for(char c : device) {
+        if(!isalnum(static_cast<unsigned char>(c)) && c != '_' && c != '-') return false;
+    }
+    return true;
+}
+
+// Блокирующая отправка тела файла в сокет без копирования в пользовательскую память
+inline void sendfile_all(int socket_fd, const SealedFile& file) {
+    off_t offset = static_cast<off_t>(file.offset);
+    uint64_t left = file.length;
+    while(left > 0) {
+        ssize_t sent = sendfile(socket_fd, file.fd, &offset, left);
+        if(sent < 0 && errno == EINTR) continue;
+        if(sent <= 0) throw std::runtime_error(std::string("sendfile: ") + strerror(errno));
+        left -= static_cast<uint64_t>(sent);
+    }
+}
+
+// Чтение тела файла в память - для коротких ответов с Content-Length
+inline void read_sealed(const SealedFile& file, std::vector<char>& out) {
+    size_t start = out.size();
+    out.resize(start + file.length);
+    size_t done = 0;
+    while(done < file.length) {
+        ssize_t r = pread(file.fd, out.data() + start + done, file.length - done,
+                          static_cast<off_t>(file.offset + done));
+        if(r < 0 && errno == EINTR) continue;
+        if(r <= 0) throw std::runtime_error("Cannot read sealed day");
+        done += static_cast<size_t>(r);
+    }
+}
+
+class DayStore {
+public:
+    static constexpr int64_t DAY_SEC = 86400;
+    static constexpr size_t MAX_OPEN_DAYS = 128;    // открытых дней в памяти (по 2 дескриптора)
+
+private:
+    static constexpr char MAGIC[8] = {'I', 'O', 'P', 'D', 'A', 'Y', '0', '1'};
+
+    // Заголовок файла: magic | записей | crc32 | длина несжатых | late_epoch (порядок байт хоста)
+    struct FileHeader {
+        char magic[8];
+        uint32_t count;
+        uint32_t raw_crc;
+        uint64_t raw_length;
+        int64_t late_epoch;
+    };
+
+    std::string dir;
+    std::map<std::pair<std::string, int64_t>, SealedDayRef> open_days;
+    std::map<std::string, int64_t> first_day;   // первый день с данными по устройству
+    int64_t epoch = 0;
+    std::mutex mtx;
+
+    std::string day_path(const std::string& device, int64_t day, const char* ext) const {
+        return dir + "/" + (device.empty() ? "_all" : device) + "/" + std::to_string(day) + ext;
+    }
+
+    static bool write_file(const std::string& path, const FileHeader& header, const std::vector<char>& body) {
+        std::string tmp = path + ".tmp" + std::to_string(getpid()) + "." +
+                          std::to_string(reinterpret_cast<uintptr_t>(&body));
+        int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if(fd < 0) return false;
+        bool ok = ::write(fd, &header, sizeof(header)) == static_cast<ssize_t>(sizeof(header));
+        size_t done = 0;
+        while(ok && done < body.size()) {
+            ssize_t w = ::write(fd, body.data() + done, body.size() - done);
+            if(w <= 0) ok = false;
+            else done += static_cast<size_t>(w);
+        }
+        ok = close(fd) == 0 && ok;
+        // rename атомарен: параллельный читатель видит старый файл или новый целиком
+        if(!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+            unlink(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    static bool open_file(const std::string& path, int64_t late_epoch, FileHeader& header, SealedFile& file) {
+        file.fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(file.fd < 0) return false;
+        struct stat st;
+        if(pread(file.fd, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header)) ||
+           memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0 || header.late_epoch != late_epoch ||
+           fstat(file.fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < sizeof(header)) {
+            return false;
+        }
+        file.offset = sizeof(header);
+        file.length = static_cast<uint64_t>(st.st_size) - sizeof(header);
+        return true;
+    }
+
+    // Сжатие дня одним куском raw deflate без финального блока
+    static std::vector<char> deflate_day(const std::vector<char>& raw) {
+        z_stream zs{};
+        if(deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw std::runtime_error("deflateInit2 failed");
+        }
+        std::vector<char> out(deflateBound(&zs, raw.size()) + 16);
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(raw.data()));
+        zs.avail_in = static_cast<uInt>(raw.size());
+        zs.next_out = reinterpret_cast<Bytef*>(out.data());
+        zs.avail_out = static_cast<uInt>(out.size());
+        deflate(&zs, Z_SYNC_FLUSH);
+        out.resize(out.size() - zs.avail_out);
+        deflateEnd(&zs);
+        return out;
+    }
+
+    SealedDayRef seal(Database& db, const std::string& device, int64_t day, int64_t late_epoch) {
+        auto rows = db.get_data(day * DAY_SEC, day * DAY_SEC + DAY_SEC - 1, device);
+        std::vector<char> raw = encode_records(rows);
+
+        FileHeader header{};
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.count = static_cast<uint32_t>(rows.size());
+        header.raw_crc = static_cast<uint32_t>(crc32(0L, reinterpret_cast<const Bytef*>(raw.data()),
+                                                     static_cast<uInt>(raw.size())));
+        header.raw_length = raw.size();
+        header.late_epoch = late_epoch;
+
+        mkdir(dir.c_str(), 0755);
+        mkdir((dir + "/" + (device.empty() ? "_all" : device)).c_str(), 0755);
+        // Сначала .gz: .bin - признак того, что день запечатан целиком
+        if(!write_file(day_path(device, day, ".gz"), header, deflate_day(raw)) ||
+           !write_file(day_path(device, day, ".bin"), header, raw)) {
+            return nullptr;
+        }
+        return load(device, day, late_epoch);
+    }
+
+    SealedDayRef load(const std::string& device, int64_t day, int64_t late_epoch) {
+        auto sealed = std::make_shared<SealedDay>();
+        FileHeader bin_header, gz_header;
+        if(!open_file(day_path(device, day, ".bin"), late_epoch, bin_header, sealed->binary) ||
+           !open_file(day_path(device, day, ".gz"), late_epoch, gz_header, sealed->deflated) ||
+           bin_header.raw_crc != gz_header.raw_crc || bin_header.raw_length != sealed->binary.length) {
+            return nullptr;
+        }
+        sealed->count = bin_header.count;
+        sealed->raw_crc = bin_header.raw_crc;
+        sealed->raw_length = bin_header.raw_length;
+        return sealed;
+    }
+
+public:
+    explicit DayStore(std::string dir) : dir(std::move(dir)) {}
+
+    // Запечатанный день или nullptr (имя устройства не годится для пути, ошибка записи, запрос
+    // прочитал отметки до увеличения late_epoch другим запросом) - тогда день отдаётся обычным
+    // путём. Вызывающий проверяет, что день закрыт
+    SealedDayRef get(Database& db, const std::string& device, int64_t day, int64_t late_epoch) {
+        if(!device.empty() && !safe_device_name(device)) return nullptr;
+        auto key = std::make_pair(device, day);
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            // Эпоха только растёт: устаревший запрос не откатывает её и не перезапечатывает дни
+            if(late_epoch < epoch) return nullptr;
+            if(late_epoch > epoch) {
+                open_days.clear();
+                first_day.clear();
+                epoch = late_epoch;
+            }
+            auto it = open_days.find(key);
+            if(it != open_days.end()) return it->second;
+        }
+
+        // Запечатывание идёт без блокировки: два потока могут запечатать один день, rename это допускает
+        SealedDayRef sealed = load(device, day, late_epoch);
+        if(!sealed) sealed = seal(db, device, day, late_epoch);
+        if(!sealed) return nullptr;
+
+        std::lock_guard<std::mutex> lock(mtx);
+        if(late_epoch != epoch) return sealed;
+        if(open_days.size() >= MAX_OPEN_DAYS) open_days.clear();
+        open_days.emplace(key, sealed);
+        return sealed;
+    }
+
+    // Уже открытый день без обращения к диску, иначе nullptr
+    SealedDayRef peek(const std::string& device, int64_t day, int64_t late_epoch) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if(late_epoch != epoch) return nullptr;
+        auto it = open_days.find(std::make_pair(device, day));
+        return it == open_days.end() ? nullptr : it->second;
+    }
+
+    // Первый день с данными: дни до него не запечатываются (запрос "с начала времён")
+    int64_t first_data_day(Database& db, const std::string& device, int64_t late_epoch) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto it = first_day.find(device);
+            if(late_epoch == epoch && it != first_day.end()) return it->second;
+        }
+        int64_t first_ts = db.get_first_timestamp(device);
+        if(first_ts < 0) return INT64_MAX;      // данных ещё нет - не запоминаем
+        int64_t day = first_ts / DAY_SEC;
+        std::lock_guard<std::mutex> lock(mtx);
+        if(late_epoch == epoch) first_day[device] = day;
+        return day;
+    }
+};
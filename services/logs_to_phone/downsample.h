@@ -0,0 +1,214 @@
+#pragma once
+
+// Прореживание истории для графиков (max_points). Телефон рисует график шириной в несколько
+// сотен точек, поэтому диапазон любой длины сводится к размеру экрана: каждое поле
+// прореживается отдельно методом LTTB (Largest-Triangle-Three-Buckets - из каждой корзины
+// берётся точка, дающая наибольший треугольник с выбранной слева и средним корзины справа,
+// так сохраняются пики и перепады), в ответ идут настоящие записи, выбранные хотя бы для
+// одного поля, по времени. Записей в ответе не больше 6 * max_points.
+// Данные - колонками: площади треугольников для кандидатов корзины и средние корзины
+// считаются векторами по 2 double (векторные расширения GCC, см. max_triangle).
+// С выбором полей (fields) разбираются и прореживаются только выбранные колонки
+
+#include <array>
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include "database.h"
+#include "day_store.h"
+
+const size_t DOWNSAMPLE_FIELDS = 6;
+const int MAX_POINTS_LIMIT = 10000;
+
+struct SeriesColumns {
+    std::vector<int64_t> timestamps;
+    std::vector<double> x;                                      // время от первой записи, с
+    std::array<std::vector<double>, DOWNSAMPLE_FIELDS> fields;
+
+    size_t size() const { return timestamps.size(); }
+
+    void reserve(size_t n, FieldMask selected = ALL_FIELDS) {
+        timestamps.reserve(n);
+        x.reserve(n);
+        for(size_t f = 0; f < DOWNSAMPLE_FIELDS; f++) {
+            if(selected & (1u << f)) fields[f].reserve(n);
+        }
+    }
+
+    // Записи формата порта 1488 (56 байт в сетевом порядке); невыбранные колонки остаются пустыми
+    void append_encoded(const char* data, size_t length, FieldMask selected = ALL_FIELDS) {
+        const size_t record_size = sizeof(SensorData);
+        const size_t start = size();
+        const size_t count = length / record_size;
+        if(count == 0) return;
+        if(start == 0) origin = static_cast<int64_t>(ntohll(load_u64(data)));
+        timestamps.resize(start + count);
+        x.resize(start + count);
+        for(size_t f = 0; f < DOWNSAMPLE_FIELDS; f++) {
+            if(selected & (1u << f)) fields[f].resize(start + count);
+        }
+        for(size_t k = 0; k < count; k++) {
+            const char* record = data + k * record_size;
+            int64_t ts = static_cast<int64_t>(ntohll(load_u64(record)));
+            timestamps[start + k] = ts;
+            x[start + k] = static_cast<double>(ts - origin);
+            for(size_t f = 0; f < DOWNSAMPLE_FIELDS; f++) {
+                if(!(selected & (1u << f))) continue;
+                uint64_t bits = ntohll(load_u64(record + sizeof(uint64_t) * (1 + f)));
+                memcpy(&fields[f][start + k], &bits, sizeof(double));
+            }
+        }
+    }
+
+    SensorData row(size_t i) const {
+        return {timestamps[i], value(0, i), value(1, i), value(2, i), value(3, i), value(4, i), value(5, i)};
+    }
+
+    double value(size_t field, size_t i) const {
+        return fields[field].empty() ? 0 : fields[field][i];
+    }
+
+private:
+    int64_t origin = 0;
+
+    static uint64_t load_u64(const char* p) {
+        uint64_t v;
+        memcpy(&v, p, sizeof(v));
+        return v;
+    }
+};
+
+inline SeriesColumns decode_segments(const std::vector<Segment>& segments, size_t count,
+                                     FieldMask fields = ALL_FIELDS) {
+    SeriesColumns columns;
+    columns.reserve(count, fields);
+    std::vector<char> day;
+    for(const auto& segment : segments) {
+        if(segment.in_memory()) {
+            columns.append_encoded(segment.data(), segment.size(), fields);
+            continue;
+        }
+        day.clear();
+        read_sealed(segment.day->binary, day);
+        columns.append_encoded(day.data(), day.size(), fields);
+    }
+    return columns;
+}
+
+// Два double - регистр SSE2 на x86-64 и NEON на ARM64, без -march
+typedef double Double2 __attribute__((vector_size(16)));
+typedef int64_t Int2 __attribute__((vector_size(16)));
+
+inline Double2 load2(const double* p) {
+    Double2 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline void sum_xy(const double* x, const double* y, size_t from, size_t to, double& sum_x, double& sum_y) {
+    Double2 vx = {0, 0}, vy = {0, 0};
+    size_t j = from;
+    for(; j + 2 <= to; j += 2) {
+        vx += load2(x + j);
+        vy += load2(y + j);
+    }
+    sum_x = vx[0] + vx[1];
+    sum_y = vy[0] + vy[1];
+    for(; j < to; j++) {
+        sum_x += x[j];
+        sum_y += y[j];
+    }
+}
+
+// Кандидат из [from, to) с наибольшей площадью треугольника (a, b, c). Удвоенная площадь
+// линейна по (xb, yb): |(yc - ya) * xb + (xa - xc) * yb + (xc * ya - xa * yc)|.
+// Два кандидата за шаг, максимум и его индекс - в каждой половине вектора без ветвлений
+inline size_t max_triangle(const double* x, const double* y, size_t from, size_t to,
+                           double xa, double ya, double xc, double yc) {
+    const double p = yc - ya;
+    const double q = xa - xc;
+    const double r = xc * ya - xa * yc;
+    const Double2 vp = {p, p}, vq = {q, q}, vr = {r, r};
+    const Int2 abs_mask = {INT64_MAX, INT64_MAX};
+    const Int2 step = {2, 2};
+    Double2 best_area = {-1, -1};
+    Int2 best = {0, 0};
+    Int2 index = {static_cast<int64_t>(from), static_cast<int64_t>(from) + 1};
+    size_t j = from;
+    for(; j + 2 <= to; j += 2) {
+        Double2 area = vp * load2(x + j) + vq * load2(y + j) + vr;
+        area = (Double2)((Int2)area & abs_mask);
+        Int2 better = area > best_area;
+        best_area = better ? area : best_area;
+        best = better ? index : best;
+        index += step;
+    }
+    // Равные площади - берётся более ранний кандидат, как в скалярном LTTB
+    double area = best_area[0];
+    size_t result = static_cast<size_t>(best[0]);
+    if(best_area[1] > area || (best_area[1] == area && static_cast<size_t>(best[1]) < result)) {
+        area = best_area[1];
+        result = static_cast<size_t>(best[1]);
+    }
+    for(; j < to; j++) {
+        double a = std::fabs(p * x[j] + q * y[j] + r);
+        if(a > area) {
+            area = a;
+            result = j;
+        }
+    }
+    return result;
+}
+
+// LTTB сразу по всем выбранным полям: корзины идут по очереди, внутри корзины - поля, так колонка
+// времени и корзина каждого поля читаются из памяти один раз. Отмечает в selected
+// threshold точек каждого поля, первая и последняя - всегда
+inline void lttb_select(const SeriesColumns& columns, size_t threshold, std::vector<char>& selected,
+                        FieldMask fields = ALL_FIELDS) {
+    const size_t n = columns.size();
+    const double* x = columns.x.data();
+    const double every = static_cast<double>(n - 2) / static_cast<double>(threshold - 2);
+    std::array<size_t, DOWNSAMPLE_FIELDS> a{};
+    selected[0] = 1;
+    for(size_t i = 0; i < threshold - 2; i++) {
+        size_t from = static_cast<size_t>(std::floor(i * every)) + 1;
+        size_t to = static_cast<size_t>(std::floor((i + 1) * every)) + 1;
+        size_t next_from = to;
+        size_t next_to = std::min(static_cast<size_t>(std::floor((i + 2) * every)) + 1, n);
+        double next_len = static_cast<double>(next_to - next_from);
+
+        for(size_t f = 0; f < DOWNSAMPLE_FIELDS; f++) {
+            if(!(fields & (1u << f))) continue;
+            const double* y = columns.fields[f].data();
+            double avg_x, avg_y;
+            sum_xy(x, y, next_from, next_to, avg_x, avg_y);
+            a[f] = max_triangle(x, y, from, to, x[a[f]], y[a[f]], avg_x / next_len, avg_y / next_len);
+            selected[a[f]] = 1;
+        }
+    }
+    selected[n - 1] = 1;
+}
+
+// Записи, выбранные LTTB хотя бы для одного поля, по времени
+inline std::vector<SensorData> downsample(const SeriesColumns& columns, size_t max_points,
+                                          FieldMask fields = ALL_FIELDS) {
+    const size_t n = columns.size();
+    std::vector<SensorData> rows;
+    if(n <= max_points || max_points < 3) {
+        for(size_t i = 0; i < n; i++) rows.push_back(columns.row(i));
+        return rows;
+    }
+    std::vector<char> selected(n, 0);
+    lttb_select(columns, max_points, selected, fields);
+    for(size_t i = 0; i < n; i++) {
+        if(selected[i]) rows.push_back(columns.row(i));
+    }
+    return rows;
+}
+
+inline std::vector<SensorData> downsample_segments(const std::vector<Segment>& segments, size_t count,
+                                                   size_t max_points, FieldMask fields = ALL_FIELDS) {
+    return downsample(decode_segments(segments, count, fields), max_points, fields);
+}
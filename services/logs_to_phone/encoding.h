@@ -0,0 +1,161 @@
+#pragma once
+
+// Кодирование записей для ответа: "binary" - формат TCP-протокола телефона
+// (записи по 56 байт в сетевом порядке), "json" - объекты через запятую.
+// Каждая JSON-запись начинается с запятой, поэтому закодированные куски можно
+// склеивать как есть, а у первого куска ответа пропускается один байт
+
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+#include "database.h"
+
+inline void serialize_sensor_data(std::vector<char>& buffer, const SensorData& data) {
+    uint64_t net_timestamp = htonll(static_cast<uint64_t>(data.timestamp_unix));
+    uint64_t net_fields[6];
+    
+    memcpy(&net_fields[0], &data.temperature_DHT22, sizeof(double));
+    memcpy(&net_fields[1], &data.temperature_DS18B20, sizeof(double));
+    memcpy(&net_fields[2], &data.humidity, sizeof(double));
+    memcpy(&net_fields[3], &data.water_level, sizeof(double));
+    memcpy(&net_fields[4], &data.soil_moisture, sizeof(double));
+    memcpy(&net_fields[5], &data.light_intensity, sizeof(double));
+
+    for(auto& field : net_fields) field = htonll(field);
+
+    buffer.insert(buffer.end(), reinterpret_cast<char*>(&net_timestamp), 
+                 reinterpret_cast<char*>(&net_timestamp) + sizeof(net_timestamp));
+    for(auto& field : net_fields) {
+        buffer.insert(buffer.end(), reinterpret_cast<char*>(&field), 
+                     reinterpret_cast<char*>(&field) + sizeof(field));
+    }
+}
+
+inline std::vector<char> encode_records(const std::vector<SensorData>& data) {
+    std::vector<char> buffer;
+    buffer.reserve(data.size() * sizeof(SensorData));
+    for(const auto& item : data) {
+        serialize_sensor_data(buffer, item);
+    }
+    return buffer;
+}
+
+// Выборка полей из записей формата порта 1488: время и поля fields по 8 байт, как были -
+// сетевой порядок сохраняется, байты не переставляются
+inline size_t projected_record_size(FieldMask fields) {
+    return sizeof(int64_t) + sizeof(double) * static_cast<size_t>(__builtin_popcount(fields));
+}
+
+inline void project_encoded(const char* data, size_t length, FieldMask fields, std::vector<char>& out) {
+    size_t offsets[7];
+    size_t columns = 0;
+    offsets[columns++] = 0;
+    for(size_t f = 0; f < 6; f++) {
+        if(fields & (1u << f)) offsets[columns++] = sizeof(int64_t) * (1 + f);
+    }
+    const size_t count = length / sizeof(SensorData);
+    const size_t start = out.size();
+    out.resize(start + count * columns * sizeof(uint64_t));
+    char* dst = out.data() + start;
+    for(size_t i = 0; i < count; i++) {
+        const char* record = data + i * sizeof(SensorData);
+        for(size_t c = 0; c < columns; c++) {
+            memcpy(dst, record + offsets[c], sizeof(uint64_t));
+            dst += sizeof(uint64_t);
+        }
+    }
+}
+
+inline std::vector<char> encode_projected(const std::vector<SensorData>& data, FieldMask fields) {
+    std::vector<char> full = encode_records(data);
+    std::vector<char> buffer;
+    project_encoded(full.data(), full.size(), fields, buffer);
+    return buffer;
+}
+
+// f64 в сетевом порядке (поле записи порта 1488)
+inline double load_net_double(const char* p) {
+    uint64_t bits;
+    memcpy(&bits, p, sizeof(bits));
+    bits = ntohll(bits);
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// Промежуток подряд идущих показаний, удовлетворяющих условию (intervals.h)
+struct TimeInterval {
+    int64_t first_unix;
+    int64_t last_unix;
+    uint32_t readings;
+};
+
+// Промежутки: u32 количество | по промежутку i64 первое время | i64 последнее время |
+// u32 число показаний - в сетевом порядке, 20 байт на промежуток
+inline std::vector<char> encode_intervals(const std::vector<TimeInterval>& intervals) {
+    std::vector<char> buffer(sizeof(uint32_t) + intervals.size() * (2 * sizeof(uint64_t) + sizeof(uint32_t)));
+    char* p = buffer.data();
+    auto put = [&p](const void* value, size_t size) {
+        memcpy(p, value, size);
+        p += size;
+    };
+    uint32_t count = htonl(static_cast<uint32_t>(intervals.size()));
+    put(&count, sizeof(count));
+    for(const auto& interval : intervals) {
+        uint64_t first = htonll(static_cast<uint64_t>(interval.first_unix));
+        uint64_t last = htonll(static_cast<uint64_t>(interval.last_unix));
+        uint32_t readings = htonl(interval.readings);
+        put(&first, sizeof(first));
+        put(&last, sizeof(last));
+        put(&readings, sizeof(readings));
+    }
+    return buffer;
+}
+
+// Итоги за диапазон: u32 число показаний | i64 первое время | i64 последнее время |
+// по каждому полю f64 минимум, максимум, среднее - всё в сетевом порядке, 164 байта
+inline std::vector<char> encode_aggregate(const SensorAggregate& aggregate) {
+    std::vector<char> buffer;
+    auto put = [&buffer](uint64_t value) {
+        value = htonll(value);
+        buffer.insert(buffer.end(), reinterpret_cast<char*>(&value), reinterpret_cast<char*>(&value) + sizeof(value));
+    };
+    auto put_double = [&put](double value) {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        put(bits);
+    };
+    uint32_t count = htonl(static_cast<uint32_t>(aggregate.count));
+    buffer.insert(buffer.end(), reinterpret_cast<char*>(&count), reinterpret_cast<char*>(&count) + sizeof(count));
+    put(static_cast<uint64_t>(aggregate.first_unix));
+    put(static_cast<uint64_t>(aggregate.last_unix));
+    for(int f = 0; f < 6; f++) {
+        put_double(aggregate.min[f]);
+        put_double(aggregate.max[f]);
+        put_double(aggregate.avg[f]);
+    }
+    return buffer;
+}
+
+inline std::vector<char> encode_records_json(const std::vector<SensorData>& data) {
+    std::vector<char> buffer;
+    for(const auto& item : data) {
+        nlohmann::json record = {
+            {"timestamp_unix", item.timestamp_unix},
+            {"temperature_DHT22", item.temperature_DHT22},
+            {"temperature_DS18B20", item.temperature_DS18B20},
+            {"humidity", item.humidity},
+            {"water_level", item.water_level},
+            {"soil_moisture", item.soil_moisture},
+            {"light_intensity", item.light_intensity}
+        };
+        std::string text = record.dump();
+        buffer.push_back(',');
+        buffer.insert(buffer.end(), text.begin(), text.end());
+    }
+    return buffer;
+}
+
+inline std::vector<char> encode_records(const std::vector<SensorData>& data, const std::string& format) {
+    return format == "json" ? encode_records_json(data) : encode_records(data);
+}
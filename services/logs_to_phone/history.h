@@ -0,0 +1,249 @@
+#pragma once
+
+// Выборка диапазона через кэш: устоявшаяся часть (не новее отметки приёма) берётся
+// из кэша и дочитывается из БД только новым хвостом, свежая часть читается каждый раз.
+// Для бинарного формата целые закрытые дни берутся из запечатанных файлов (DayStore).
+// Длинные выборки из БД и запечатывание дней идут параллельно в SlicePool, если он передан.
+// С RecordStore (--record-store) бинарный диапазон берётся из отображённых сегментов.
+// Диапазон с выбором полей (fields) - те же источники с выборкой полей в памяти и свежий хвост
+// из БД только нужными колонками
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "database.h"
+#include "day_store.h"
+#include "encoding.h"
+#include "range_cache.h"
+#include "record_store.h"
+#include "slice_pool.h"
+
+struct RangeResult {
+    IngestState state;
+    std::vector<Chunk> chunks;      // закодированные записи: куски кэша + свежий хвост
+    uint32_t count = 0;
+    bool closed = false;            // весь диапазон не новее отметки приёма
+};
+
+// Короче этого диапазон читается одним запросом: накладные расходы пула больше выигрыша
+const int64_t SLICE_MIN_SPAN_SEC = 2 * 86400;
+const size_t SLICES_PER_THREAD = 4;
+
+struct EncodedSlice {
+    std::vector<char> bytes;
+    uint32_t count = 0;
+    int64_t unix_to = 0;
+};
+
+// [unix_from, unix_to] срезами по времени в пуле. Границы сначала сжимаются до первого
+// и последнего показания, чтобы запрос "с начала времён" не делился на пустые срезы.
+// Срезов в несколько раз больше потоков: плотные куски истории разбирают свободные потоки
+inline std::vector<EncodedSlice> read_slices(Database& db, SlicePool* pool, const std::string& device,
+                                             int64_t unix_from, int64_t unix_to, const std::string& format) {
+    std::vector<std::pair<int64_t, int64_t>> bounds{{unix_from, unix_to}};
+    if(pool && pool->size() > 1 && unix_to - unix_from >= SLICE_MIN_SPAN_SEC) {
+        int64_t first = std::max(unix_from, db.get_first_timestamp(device));
+        int64_t last = std::min(unix_to, db.get_latest_data(device).timestamp_unix);
+        if(last - first >= SLICE_MIN_SPAN_SEC) {
+            int64_t parts = static_cast<int64_t>(pool->size() * SLICES_PER_THREAD);
+            int64_t step = (last - first) / parts + 1;
+            bounds.clear();
+            for(int64_t start = first; start <= last; start += step) {
+                bounds.push_back({start, std::min(last, start + step - 1)});
+            }
+            bounds.front().first = unix_from;
+            bounds.back().second = unix_to;
+        }
+    }
+
+    std::vector<EncodedSlice> slices(bounds.size());
+    std::vector<SlicePool::Task> tasks;
+    for(size_t i = 0; i < bounds.size(); i++) {
+        tasks.push_back([&slices, &bounds, &device, &format, i](Database& conn) {
+            auto rows = conn.get_data(bounds[i].first, bounds[i].second, device);
+            slices[i] = {encode_records(rows, format), static_cast<uint32_t>(rows.size()), bounds[i].second};
+        });
+    }
+    if(pool) {
+        pool->run_all(std::move(tasks), db);
+    } else {
+        for(auto& task : tasks) task(db);
+    }
+    return slices;
+}
+
+inline RangeResult collect_range(Database& db, RangeCache& cache, const std::string& device,
+                                 int64_t unix_from, int64_t unix_to, const std::string& format,
+                                 SlicePool* pool = nullptr) {
+    RangeResult result;
+    result.state = db.get_ingest_state();
+    RangeKey key{device, unix_from, unix_to, format};
+
+    CachedRange range;
+    if(!cache.lookup(key, result.state.late_epoch, range)) {
+        range.covered_to = unix_from - 1;
+    }
+
+    int64_t stable_to = std::min(unix_to, result.state.ts_watermark);
+    if(range.covered_to < stable_to) {
+        for(auto& slice : read_slices(db, pool, device, range.covered_to + 1, stable_to, format)) {
+            range.append(std::move(slice.bytes), slice.count, slice.unix_to);
+        }
+        cache.store(key, result.state.late_epoch, range);
+    }
+
+    result.chunks = range.chunks;
+    result.count = range.count;
+    result.closed = range.covered_to >= unix_to;
+
+    int64_t live_from = std::max(unix_from, range.covered_to + 1);
+    if(live_from <= unix_to) {
+        auto live = db.get_data(live_from, unix_to, device);
+        if(!live.empty()) {
+            result.count += static_cast<uint32_t>(live.size());
+            result.chunks.push_back(std::make_shared<const std::vector<char>>(encode_records(live, format)));
+        }
+    }
+    return result;
+}
+
+struct SegmentedRange {
+    IngestState state;
+    std::vector<Segment> segments;
+    uint32_t count = 0;
+    bool closed = false;
+};
+
+inline int64_t floor_div(int64_t a, int64_t b) {
+    return a / b - ((a % b != 0 && (a < 0) != (b < 0)) ? 1 : 0);
+}
+
+// Бинарный диапазон: края и открытый день - через collect_range, целые дни между ними,
+// закрытые отметкой приёма, - запечатанными файлами
+inline SegmentedRange collect_sealed_range(Database& db, RangeCache& cache, DayStore& days,
+                                           const std::string& device, int64_t unix_from, int64_t unix_to,
+                                           SlicePool* pool = nullptr) {
+    const int64_t day_sec = DayStore::DAY_SEC;
+    SegmentedRange result;
+    result.state = db.get_ingest_state();
+    result.closed = unix_to <= result.state.ts_watermark;
+
+    auto add_live = [&](int64_t from, int64_t to) {
+        if(from > to) return;
+        RangeResult part = collect_range(db, cache, device, from, to, "binary", pool);
+        for(const auto& c : part.chunks) result.segments.push_back({c, nullptr});
+        result.count += part.count;
+    };
+
+    int64_t first_day = floor_div(unix_from + day_sec - 1, day_sec);
+    int64_t last_day = floor_div(std::min(unix_to, result.state.ts_watermark) + 1, day_sec) - 1;
+    if(first_day <= last_day) {
+        first_day = std::max(first_day, days.first_data_day(db, device, result.state.late_epoch));
+    }
+    if(first_day > last_day) {
+        add_live(unix_from, unix_to);
+        return result;
+    }
+
+    // Дни, которых ещё нет среди открытых, загружаются или запечатываются параллельно
+    std::vector<SealedDayRef> sealed_days(static_cast<size_t>(last_day - first_day + 1));
+    std::vector<SlicePool::Task> tasks;
+    for(int64_t day = first_day; day <= last_day; day++) {
+        SealedDayRef& slot = sealed_days[static_cast<size_t>(day - first_day)];
+        slot = days.peek(device, day, result.state.late_epoch);
+        if(slot) continue;
+        tasks.push_back([&slot, &days, &device, day, epoch = result.state.late_epoch](Database& conn) {
+            slot = days.get(conn, device, day, epoch);
+        });
+    }
+    if(pool) {
+        pool->run_all(std::move(tasks), db);
+    } else {
+        for(auto& task : tasks) task(db);
+    }
+
+    add_live(unix_from, first_day * day_sec - 1);
+    for(int64_t day = first_day; day <= last_day; day++) {
+        const SealedDayRef& sealed = sealed_days[static_cast<size_t>(day - first_day)];
+        if(!sealed) {
+            add_live(day * day_sec, day * day_sec + day_sec - 1);
+        } else if(sealed->count > 0) {
+            result.segments.push_back({nullptr, sealed});
+            result.count += sealed->count;
+        }
+    }
+    add_live((last_day + 1) * day_sec, unix_to);
+    return result;
+}
+
+// Бинарный диапазон из RecordStore: всё, что не новее покрытого хранилищем, - отображёнными
+// записями, остальное (хвост новее отметки приёма, пока хранилище дописывается) - из БД
+inline SegmentedRange collect_mapped_range(Database& db, RecordStore& records, const std::string& device,
+                                           int64_t unix_from, int64_t unix_to) {
+    SegmentedRange result;
+    result.state = db.get_ingest_state();
+    result.closed = unix_to <= result.state.ts_watermark;
+    RecordStore::View view = records.view(db, device, result.state);
+    result.segments = view.slices(unix_from, unix_to, result.count);
+
+    int64_t live_from = view.covered_to == RecordStore::NOT_COVERED ? unix_from
+                                                                    : std::max(unix_from, view.covered_to + 1);
+    if(live_from <= unix_to) {
+        auto live = db.get_data(live_from, unix_to, device);
+        if(!live.empty()) {
+            result.count += static_cast<uint32_t>(live.size());
+            result.segments.push_back({std::make_shared<const std::vector<char>>(encode_records(live)), nullptr});
+        }
+    }
+    return result;
+}
+
+// Бинарный диапазон: из RecordStore, если он включён, иначе запечатанные дни и кэш
+inline SegmentedRange collect_binary_range(Database& db, RangeCache& cache, DayStore& days, RecordStore* records,
+                                           const std::string& device, int64_t unix_from, int64_t unix_to,
+                                           SlicePool* pool = nullptr) {
+    if(records) return collect_mapped_range(db, *records, device, unix_from, unix_to);
+    return collect_sealed_range(db, cache, days, device, unix_from, unix_to, pool);
+}
+
+// Записи сегментов (кэш, отображённые, запечатанные дни) - одним куском только с полями fields
+inline Chunk project_segments(const std::vector<Segment>& segments, uint32_t count, FieldMask fields) {
+    std::vector<char> bytes;
+    bytes.reserve(count * projected_record_size(fields));
+    std::vector<char> day;
+    for(const auto& segment : segments) {
+        if(segment.in_memory()) {
+            project_encoded(segment.data(), segment.size(), fields, bytes);
+            continue;
+        }
+        day.clear();
+        read_sealed(segment.day->binary, day);
+        project_encoded(day.data(), day.size(), fields, bytes);
+    }
+    return std::make_shared<const std::vector<char>>(std::move(bytes));
+}
+
+// Диапазон только с полями fields (encode_projected). Не новее отметки приёма - из хранилищ
+// бинарного диапазона с выборкой полей, свежий хвост - из БД выборкой нужных колонок
+inline SegmentedRange collect_projected_range(Database& db, RangeCache& cache, DayStore& days, RecordStore* records,
+                                              const std::string& device, int64_t unix_from, int64_t unix_to,
+                                              FieldMask fields, SlicePool* pool = nullptr) {
+    SegmentedRange result;
+    result.state = db.get_ingest_state();
+    result.closed = unix_to <= result.state.ts_watermark;
+    int64_t stable_to = std::min(unix_to, result.state.ts_watermark);
+    if(unix_from <= stable_to) {
+        SegmentedRange stable = collect_binary_range(db, cache, days, records, device, unix_from, stable_to, pool);
+        result.segments.push_back({project_segments(stable.segments, stable.count, fields), nullptr});
+        result.count = stable.count;
+    }
+    int64_t live_from = std::max(unix_from, stable_to + 1);
+    if(live_from <= unix_to) {
+        auto live = db.get_fields(live_from, unix_to, device, fields);
+        if(!live.empty()) {
+            result.count += static_cast<uint32_t>(live.size());
+            result.segments.push_back({std::make_shared<const std::vector<char>>(encode_projected(live, fields)), nullptr});
+        }
+    }
+    return result;
+}
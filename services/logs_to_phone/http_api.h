@@ -0,0 +1,578 @@
+#pragma once
+
+// HTTP/1.1 API истории показаний рядом с бинарным протоколом порта 1488.
+//
+//   GET /api/v1/history?from=<unix>&to=<unix>[&device=<id>][&format=json|binary][&max_points=<n>]
+//   GET /api/v1/latest[?device=<id>][&format=json|binary]
+//   GET /api/v1/alerts?after=<id>[&device=<id>][&wait=<sec>]
+//
+// Формат берётся из параметра format, иначе из Accept (application/octet-stream -
+// тот же бинарный ответ, что на порту 1488), по умолчанию JSON.
+// Поддерживаются Accept-Encoding: gzip, сильные ETag от отметок приёма и
+// If-None-Match -> 304 без обращения к данным. Большие ответы уходят chunked.
+// Целые закрытые дни бинарного ответа отправляются из запечатанных файлов (DayStore):
+// без сжатия - sendfile, с gzip - готовым сжатым куском, вклеенным в поток.
+// С RecordStore бинарный ответ берётся из отображённых сегментов (record_store.h).
+// alerts - канал уведомлений телефона (long polling): ответ приходит, как только
+// появится событие новее after, или пустым массивом через wait секунд.
+// latest и history проходят тот же допуск, что порт 1488 (admission.h): не допущенный
+// запрос получает 503 с Retry-After. 304 по ETag отдаётся без допуска - он не трогает БД
+
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <stdexcept>
+#include <boost/asio.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <zlib.h>
+#include "admission.h"
+#include "database.h"
+#include "day_store.h"
+#include "downsample.h"
+#include "encoding.h"
+#include "history.h"
+#include "slice_pool.h"
+
+namespace http_api {
+
+namespace asio = boost::asio;
+namespace beast = boost::beast;
+namespace http = boost::beast::http;
+using boost::asio::ip::tcp;
+
+// Ответы больше порога отправляются chunked по мере сжатия, меньше - с Content-Length
+const size_t CHUNKED_THRESHOLD = 256 * 1024;
+const size_t GZIP_OUT_CHUNK = 64 * 1024;
+// Устоявшиеся диапазоны меняются только при записи опоздавших показаний
+constexpr const char* CLOSED_CACHE_CONTROL = "public, max-age=86400";
+constexpr const char* OPEN_CACHE_CONTROL = "no-cache";
+const int ALERTS_MAX_WAIT_SEC = 30;
+const int ALERTS_POLL_MS = 250;
+const int ALERTS_PAGE_SIZE = 100;
+
+// Некорректный %xx - исключение invalid_argument (ответ 400)
+inline std::string url_decode(const std::string& s) {
+    std::string out;
+    for(size_t i = 0; i < s.size(); i++) {
+        if(s[i] == '%') {
+            if(i + 2 >= s.size() || !isxdigit(static_cast<unsigned char>(s[i + 1])) ||
+               !isxdigit(static_cast<unsigned char>(s[i + 2]))) {
+                throw std::invalid_argument("malformed percent-encoding");
+            }
+            out += static_cast<char>(std::stoi(s.substr(i + 1, 2), nullptr, 16));
+            i += 2;
+        } else if(s[i] == '+') {
+            out += ' ';
+        } else {
+            out += s[i];
+        }
+    }
+    return out;
+}
+
+inline std::map<std::string, std::string> parse_query(const std::string& target) {
+    std::map<std::string, std::string> params;
+    size_t q = target.find('?');
+    if(q == std::string::npos) return params;
+    size_t begin = q + 1;
+    while(begin < target.size()) {
+        size_t end = target.find('&', begin);
+        if(end == std::string::npos) end = target.size();
+        std::string pair = target.substr(begin, end - begin);
+        size_t eq = pair.find('=');
+        if(eq != std::string::npos) params[url_decode(pair.substr(0, eq))] = url_decode(pair.substr(eq + 1));
+        begin = end + 1;
+    }
+    return params;
+}
+
+// gzip в Accept-Encoding с q больше 0 (gzip;q=0 - отказ от gzip)
+inline bool accepts_gzip(const std::string& accept_encoding) {
+    size_t begin = 0;
+    while(begin <= accept_encoding.size()) {
+        size_t end = accept_encoding.find(',', begin);
+        if(end == std::string::npos) end = accept_encoding.size();
+        std::string item = accept_encoding.substr(begin, end - begin);
+        begin = end + 1;
+
+        item.erase(std::remove_if(item.begin(), item.end(), [](unsigned char c) { return isspace(c); }), item.end());
+        size_t semicolon = item.find(';');
+        std::string coding = item.substr(0, semicolon);
+        std::transform(coding.begin(), coding.end(), coding.begin(), [](unsigned char c) { return tolower(c); });
+        if(coding != "gzip") continue;
+
+        double q = 1;
+        if(semicolon != std::string::npos) {
+            std::string params = item.substr(semicolon + 1);
+            size_t pos = params.find("q=");
+            if(pos == std::string::npos) pos = params.find("Q=");
+            if(pos != std::string::npos) q = std::strtod(params.c_str() + pos + 2, nullptr);
+        }
+        return q > 0;
+    }
+    return false;
+}
+
+// FNV-1a: ETag должен быть стабильным между перезапусками службы
+inline std::string make_etag(const std::string& identity) {
+    uint64_t hash = 1469598103934665603ull;
+    for(unsigned char c : identity) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    char buf[24];
+    snprintf(buf, sizeof(buf), "\"%016llx\"", static_cast<unsigned long long>(hash));
+    return buf;
+}
+
+inline bool etag_matches(const std::string& if_none_match, const std::string& etag) {
+    if(if_none_match.empty()) return false;
+    if(if_none_match.find('*') != std::string::npos) return true;
+    return if_none_match.find(etag) != std::string::npos;
+}
+
+// Тело ответа: куски пишутся как есть или через gzip, целиком или chunked.
+// gzip собирается вручную (заголовок, raw deflate, трейлер), чтобы между сжатыми
+// частями можно было вставлять сжатые заранее дни: перед вставкой поток выравнивается
+// Z_SYNC_FLUSH и сбрасывается, crc32 дня присоединяется через crc32_combine
+class BodyWriter {
+    tcp::socket& socket;
+    bool gzip;
+    bool chunked;
+    std::vector<char> collected;    // для ответов с Content-Length
+    z_stream zs{};
+    uLong crc = 0;                  // crc32 и длина (по модулю 2^32) несжатого тела - для трейлера gzip
+    uint32_t raw_size = 0;
+
+    void emit(const char* data, size_t size) {
+        if(size == 0) return;
+        if(chunked) asio::write(socket, http::make_chunk(asio::buffer(data, size)));
+        else collected.insert(collected.end(), data, data + size);
+    }
+
+    // Тело файла: в chunked - отдельным куском через sendfile, иначе - в collected
+    void emit_file(const SealedFile& file) {
+        if(file.length == 0) return;
+        if(!chunked) {
+            read_sealed(file, collected);
+            return;
+        }
+        char size_line[24];
+        int n = snprintf(size_line, sizeof(size_line), "%llx\r\n", static_cast<unsigned long long>(file.length));
+        asio::write(socket, asio::buffer(size_line, n));
+        sendfile_all(socket.native_handle(), file);
+        asio::write(socket, asio::buffer("\r\n", 2));
+    }
+
+    void deflate_piece(const char* data, size_t size, int flush) {
+        std::vector<char> out(GZIP_OUT_CHUNK);
+        zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        zs.avail_in = static_cast<uInt>(size);
+        do {
+            zs.next_out = reinterpret_cast<Bytef*>(out.data());
+            zs.avail_out = static_cast<uInt>(out.size());
+            deflate(&zs, flush);
+            emit(out.data(), out.size() - zs.avail_out);
+        } while(zs.avail_out == 0);
+    }
+
+public:
+    BodyWriter(tcp::socket& socket, bool gzip, bool chunked)
+        : socket(socket), gzip(gzip), chunked(chunked) {
+        if(!gzip) return;
+        // -15: окно 32 КБ без обёртки, заголовок и трейлер gzip пишутся здесь
+        if(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw std::runtime_error("deflateInit2 failed");
+        }
+        static const char header[10] = {0x1f, static_cast<char>(0x8b), 8, 0, 0, 0, 0, 0, 0, 3};
+        emit(header, sizeof(header));
+    }
+
+    ~BodyWriter() {
+        if(gzip) deflateEnd(&zs);
+    }
+
+    void write(const char* data, size_t size) {
+        if(!gzip) {
+            emit(data, size);
+            return;
+        }
+        crc = crc32(crc, reinterpret_cast<const Bytef*>(data), static_cast<uInt>(size));
+        raw_size += static_cast<uint32_t>(size);
+        deflate_piece(data, size, Z_NO_FLUSH);
+    }
+
+    // Запечатанный день: как есть или сжатым заранее куском
+    void write_day(const SealedDay& day) {
+        if(!gzip) {
+            emit_file(day.binary);
+            return;
+        }
+        deflate_piece(nullptr, 0, Z_SYNC_FLUSH);
+        // Следующие данные не должны ссылаться на окно из того, что было до вставки
+        deflateReset(&zs);
+        emit_file(day.deflated);
+        crc = crc32_combine(crc, day.raw_crc, static_cast<z_off_t>(day.raw_length));
+        raw_size += static_cast<uint32_t>(day.raw_length);
+    }
+
+    void finish() {
+        if(gzip) {
+            deflate_piece(nullptr, 0, Z_FINISH);
+            char trailer[8];
+            for(int i = 0; i < 4; i++) {
+                trailer[i] = static_cast<char>((crc >> (8 * i)) & 0xFF);
+                trailer[4 + i] = static_cast<char>((raw_size >> (8 * i)) & 0xFF);
+            }
+            emit(trailer, sizeof(trailer));
+        }
+        if(chunked) asio::write(socket, http::make_chunk_last());
+    }
+
+    std::vector<char>& body() { return collected; }
+};
+
+class HttpApi {
+    Database& db;
+    RangeCache& cache;
+    DayStore& days;
+    SlicePool* pool;
+    RateLimiter* limiter;
+    QueryGate* gate;
+    Database* point_db;         // соединение точечных запросов, см. PhoneContext в logs.cpp
+    RecordStore* records;
+
+    template<class Body>
+    void set_common(http::response<Body>& res, const std::string& etag, bool closed) {
+        res.set(http::field::server, "IoP-Server");
+        res.set(http::field::etag, etag);
+        res.set(http::field::cache_control, closed ? CLOSED_CACHE_CONTROL : OPEN_CACHE_CONTROL);
+        res.set(http::field::vary, "Accept, Accept-Encoding");
+    }
+
+    void send_error(tcp::socket& socket, const http::request<http::string_body>& req,
+                    http::status status, const std::string& message) {
+        http::response<http::string_body> res{status, req.version()};
+        res.set(http::field::server, "IoP-Server");
+        res.set(http::field::content_type, "application/json");
+        res.keep_alive(req.keep_alive());
+        res.body() = nlohmann::json{{"error", message}}.dump();
+        res.prepare_payload();
+        http::write(socket, res);
+    }
+
+    void send_busy(tcp::socket& socket, const http::request<http::string_body>& req, int64_t retry_after_ms) {
+        http::response<http::string_body> res{http::status::service_unavailable, req.version()};
+        res.set(http::field::server, "IoP-Server");
+        res.set(http::field::content_type, "application/json");
+        res.set(http::field::retry_after, std::to_string((retry_after_ms + 999) / 1000));
+        res.keep_alive(req.keep_alive());
+        res.body() = nlohmann::json{{"error", "Server is busy"}, {"retry_after_ms", retry_after_ms}}.dump();
+        res.prepare_payload();
+        http::write(socket, res);
+    }
+
+    // Допуск запроса стоимостью rows строк. Пустой билет при допуске - очереди нет (gate не задан)
+    bool admit(tcp::socket& socket, const http::request<http::string_body>& req, int64_t rows,
+               QueryGate::Ticket& ticket) {
+        if(limiter) {
+            std::string ip = "unknown";
+            try {
+                ip = socket.remote_endpoint().address().to_string();
+            } catch(...) {}
+            Admission admission = limiter->admit(ip, rows);
+            if(!admission.admitted) {
+                send_busy(socket, req, admission.retry_after_ms);
+                return false;
+            }
+        }
+        if(gate) {
+            ticket = gate->enter(rows);
+            if(!ticket) {
+                send_busy(socket, req, QueryGate::RETRY_AFTER_MS);
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void send_not_modified(tcp::socket& socket, const http::request<http::string_body>& req,
+                           const std::string& etag, bool closed) {
+        http::response<http::empty_body> res{http::status::not_modified, req.version()};
+        set_common(res, etag, closed);
+        res.keep_alive(req.keep_alive());
+        http::write(socket, res);
+    }
+
+    // Отправка закодированных кусков: binary - счётчик + записи, json - массив
+    // (запечатанные дни бывают только в binary)
+    void send_records(tcp::socket& socket, const http::request<http::string_body>& req,
+                      const std::vector<Segment>& segments, uint32_t count, const std::string& format,
+                      bool gzip, const std::string& etag, bool closed) {
+        size_t raw_size = 0;
+        for(const auto& s : segments) raw_size += s.size();
+        bool chunked = raw_size > CHUNKED_THRESHOLD && req.version() >= 11;
+
+        auto fill_head = [&](auto& res) {
+            set_common(res, etag, closed);
+            res.set(http::field::content_type, format == "json" ? "application/json" : "application/octet-stream");
+            if(gzip) res.set(http::field::content_encoding, "gzip");
+            res.keep_alive(req.keep_alive());
+        };
+
+        if(chunked) {
+            http::response<http::empty_body> head{http::status::ok, req.version()};
+            fill_head(head);
+            head.chunked(true);
+            http::response_serializer<http::empty_body> sr{head};
+            http::write_header(socket, sr);
+        }
+
+        BodyWriter writer(socket, gzip, chunked);
+        if(format == "json") {
+            writer.write("[", 1);
+            bool first = true;
+            for(const auto& s : segments) {
+                if(!s.bytes || s.bytes->empty()) continue;
+                size_t skip = first ? 1 : 0;
+                writer.write(s.bytes->data() + skip, s.bytes->size() - skip);
+                first = false;
+            }
+            writer.write("]", 1);
+        } else {
+            uint32_t net_count = htonl(count);
+            writer.write(reinterpret_cast<const char*>(&net_count), sizeof(net_count));
+            for(const auto& s : segments) {
+                if(s.in_memory()) writer.write(s.data(), s.size());
+                else writer.write_day(*s.day);
+            }
+        }
+        writer.finish();
+
+        if(!chunked) {
+            http::response<http::vector_body<char>> res{http::status::ok, req.version()};
+            fill_head(res);
+            res.body() = std::move(writer.body());
+            res.prepare_payload();
+            http::write(socket, res);
+        }
+    }
+
+    void send_alerts(tcp::socket& socket, const http::request<http::string_body>& req,
+                     std::map<std::string, std::string>& params) {
+        int64_t after_id;
+        int wait_sec;
+        try {
+            after_id = params.count("after") ? std::stoll(params["after"]) : 0;
+            wait_sec = params.count("wait") ? std::stoi(params["wait"]) : 0;
+        } catch(...) {
+            send_error(socket, req, http::status::bad_request, "after and wait must be integers");
+            return;
+        }
+        wait_sec = std::max(0, std::min(wait_sec, ALERTS_MAX_WAIT_SEC));
+        std::string device = params.count("device") ? params["device"] : "";
+
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(wait_sec);
+        std::vector<AlertRecord> alerts = db.get_alerts(after_id, device, ALERTS_PAGE_SIZE);
+        while(alerts.empty() && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(ALERTS_POLL_MS));
+            alerts = db.get_alerts(after_id, device, ALERTS_PAGE_SIZE);
+        }
+
+        nlohmann::json body = nlohmann::json::array();
+        for(const auto& a : alerts) {
+            body.push_back({
+                {"id", a.id},
+                {"timestamp_unix", a.timestamp_unix},
+                {"device", a.device},
+                {"field", a.field},
+                {"kind", a.kind},
+                {"state", a.state},
+                {"value", a.value},
+                {"expected", a.expected}
+            });
+        }
+
+        http::response<http::string_body> res{http::status::ok, req.version()};
+        res.set(http::field::server, "IoP-Server");
+        res.set(http::field::content_type, "application/json");
+        res.set(http::field::cache_control, "no-store");
+        res.keep_alive(req.keep_alive());
+        res.body() = body.dump();
+        res.prepare_payload();
+        http::write(socket, res);
+    }
+
+    void handle_request(tcp::socket& socket, const http::request<http::string_body>& req) {
+        if(req.method() != http::verb::get) {
+            send_error(socket, req, http::status::method_not_allowed, "Only GET is supported");
+            return;
+        }
+
+        std::string target(req.target());
+        std::string path = target.substr(0, target.find('?'));
+        std::map<std::string, std::string> params;
+        try {
+            params = parse_query(target);
+        } catch(const std::invalid_argument&) {
+            send_error(socket, req, http::status::bad_request, "malformed query string");
+            return;
+        }
+
+        if(path == "/api/v1/alerts") {
+            send_alerts(socket, req, params);
+            return;
+        }
+
+        std::string format = params.count("format") ? params["format"] : "";
+        if(format.empty()) {
+            std::string accept(req[http::field::accept]);
+            format = accept.find("application/octet-stream") != std::string::npos ? "binary" : "json";
+        }
+        if(format != "json" && format != "binary") {
+            send_error(socket, req, http::status::bad_request, "format must be json or binary");
+            return;
+        }
+        bool gzip = accepts_gzip(std::string(req[http::field::accept_encoding]));
+        std::string device = params.count("device") ? params["device"] : "";
+        std::string if_none_match(req[http::field::if_none_match]);
+
+        IngestState state = db.get_ingest_state();
+        std::string variant = device + "|" + format + "|" + (gzip ? "gzip" : "identity");
+
+        if(path == "/api/v1/latest") {
+            std::string etag = make_etag("latest|" + variant + "|" + std::to_string(state.journal_seq) + "|" +
+                                         std::to_string(state.import_seq));
+            if(etag_matches(if_none_match, etag)) {
+                send_not_modified(socket, req, etag, false);
+                return;
+            }
+            QueryGate::Ticket ticket;
+            if(!admit(socket, req, 1, ticket)) return;
+            std::vector<SensorData> data{(point_db ? *point_db : db).get_latest_data(device)};
+            ticket = QueryGate::Ticket();
+            std::vector<Chunk> chunks{std::make_shared<const std::vector<char>>(encode_records(data, format))};
+            send_records(socket, req, to_segments(chunks), 1, format, gzip, etag, false);
+            return;
+        }
+
+        if(path != "/api/v1/history") {
+            send_error(socket, req, http::status::not_found, "Unknown path");
+            return;
+        }
+
+        int64_t unix_from, unix_to;
+        try {
+            unix_from = std::stoll(params.at("from"));
+            unix_to = std::stoll(params.at("to"));
+        } catch(...) {
+            send_error(socket, req, http::status::bad_request, "from and to are required unix times");
+            return;
+        }
+        if(unix_from > unix_to) {
+            send_error(socket, req, http::status::bad_request, "from must not exceed to");
+            return;
+        }
+        int max_points = 0;
+        if(params.count("max_points")) {
+            try {
+                max_points = std::stoi(params["max_points"]);
+            } catch(...) {
+                send_error(socket, req, http::status::bad_request, "max_points must be an integer");
+                return;
+            }
+            if(max_points > 0) max_points = std::max(3, std::min(max_points, MAX_POINTS_LIMIT));
+            else max_points = 0;
+        }
+
+        // Устоявшийся диапазон меняется только вместе с late_epoch, открытый - с каждой записью
+        bool closed = unix_to <= state.ts_watermark;
+        std::string identity = "history|" + variant + "|" + std::to_string(unix_from) + "|" +
+                               std::to_string(unix_to) + "|" + std::to_string(state.late_epoch);
+        if(max_points > 0) identity += "|points=" + std::to_string(max_points);
+        if(!closed) {
+            identity += "|" + std::to_string(state.journal_seq) + "|" + std::to_string(state.import_seq) + "|" +
+                        std::to_string(state.ts_watermark);
+        }
+        std::string etag = make_etag(identity);
+
+        if(etag_matches(if_none_match, etag)) {
+            send_not_modified(socket, req, etag, closed);
+            return;
+        }
+
+        QueryGate::Ticket ticket;
+        int64_t rows = limiter ? limiter->estimate_rows(db, device, unix_from, unix_to) : 0;
+        if(!admit(socket, req, rows, ticket)) return;
+        SlicePool::ScanScope scan(ticket.scan());
+        Database& conn = ticket.scan() || !point_db ? db : *point_db;
+        if(max_points > 0) {
+            // Прореживание работает по записям формата порта 1488, ответ - в запрошенном формате
+            SegmentedRange range = collect_binary_range(conn, cache, days, records, device, unix_from, unix_to, pool);
+            std::vector<SensorData> rows = downsample_segments(range.segments, range.count,
+                                                               static_cast<size_t>(max_points));
+            ticket = QueryGate::Ticket();
+            std::vector<Chunk> chunks{std::make_shared<const std::vector<char>>(encode_records(rows, format))};
+            send_records(socket, req, to_segments(chunks), static_cast<uint32_t>(rows.size()), format, gzip,
+                         etag, closed);
+            return;
+        }
+        if(format == "binary") {
+            SegmentedRange range = collect_binary_range(conn, cache, days, records, device, unix_from, unix_to, pool);
+            ticket = QueryGate::Ticket();     // место в очереди - только на выборку, не на отправку
+            send_records(socket, req, range.segments, range.count, format, gzip, etag, closed);
+            return;
+        }
+        RangeResult range = collect_range(conn, cache, device, unix_from, unix_to, format, pool);
+        ticket = QueryGate::Ticket();
+        send_records(socket, req, to_segments(range.chunks), range.count, format, gzip, etag, closed);
+    }
+
+public:
+    HttpApi(Database& db, RangeCache& cache, DayStore& days, SlicePool* pool = nullptr,
+            RateLimiter* limiter = nullptr, QueryGate* gate = nullptr, Database* point_db = nullptr,
+            RecordStore* records = nullptr)
+        : db(db), cache(cache), days(days), pool(pool), limiter(limiter), gate(gate), point_db(point_db),
+          records(records) {}
+
+    // Соединение с keep-alive: запросы обрабатываются по очереди до закрытия
+    void handle_connection(tcp::socket socket) {
+        beast::flat_buffer buffer;
+        try {
+            while(true) {
+                http::request<http::string_body> req;
+                http::read(socket, buffer, req);
+                handle_request(socket, req);
+                if(!req.keep_alive()) break;
+            }
+            socket.shutdown(tcp::socket::shutdown_send);
+        }
+        catch(const std::exception&) {
+            // Клиент закрыл соединение или прислал некорректный запрос
+        }
+    }
+
+    void run(unsigned short port) {
+        asio::io_context io_context;
+        tcp::acceptor acceptor(io_context, tcp::endpoint(tcp::v4(), port));
+        std::cout << "HTTP history API started on port " << port << std::endl;
+
+        while(true) {
+            tcp::socket socket(io_context);
+            acceptor.accept(socket);
+            std::thread([this, s = std::move(socket)]() mutable {
+                handle_connection(std::move(s));
+            }).detach();
+        }
+    }
+};
+
+}
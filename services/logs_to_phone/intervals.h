@@ -0,0 +1,173 @@
+#pragma once
+
+// Промежутки по условию на значение поля ("когда water_level был ниже 10"): подряд идущие
+// показания диапазона, удовлетворяющие условию, сливаются в промежуток (первое и последнее
+// время, число показаний), показание вне условия промежуток закрывает. В хранилище записей
+// (--record-store) зона, где по её минимуму и максимуму условию не удовлетворяет ни одно
+// показание или удовлетворяют все, не читается; остальные проверяются фильтром match_mask:
+// значения зоны разбираются в колонку и сравниваются по 2 double за шаг (векторы GCC, как в
+// downsample.h), результат - битовая маска, промежутки ищутся по ней через ctz. Без хранилища
+// и для хвоста новее отметки приёма - тот же фильтр по выборке одного поля
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include "database.h"
+#include "day_store.h"
+#include "downsample.h"
+#include "encoding.h"
+#include "history.h"
+#include "record_store.h"
+
+enum CompareOp : uint8_t { COMPARE_NONE = 0, COMPARE_LESS, COMPARE_LESS_EQUAL, COMPARE_GREATER, COMPARE_GREATER_EQUAL };
+
+inline CompareOp compare_op(const std::string& name) {
+    if(name == "<") return COMPARE_LESS;
+    if(name == "<=") return COMPARE_LESS_EQUAL;
+    if(name == ">") return COMPARE_GREATER;
+    if(name == ">=") return COMPARE_GREATER_EQUAL;
+    return COMPARE_NONE;
+}
+
+// Условие "поле op value"
+struct ValuePredicate {
+    size_t field = 0;
+    CompareOp op = COMPARE_NONE;
+    double value = 0;
+
+    bool matches(double x) const {
+        switch(op) {
+            case COMPARE_LESS: return x < value;
+            case COMPARE_LESS_EQUAL: return x <= value;
+            case COMPARE_GREATER: return x > value;
+            case COMPARE_GREATER_EQUAL: return x >= value;
+            default: return false;
+        }
+    }
+
+    // По минимуму и максимуму зоны: ни одно значение не подходит / подходят все
+    bool none(const RecordStore::FieldZone& zone) const {
+        return !matches(op == COMPARE_LESS || op == COMPARE_LESS_EQUAL ? zone.min[field] : zone.max[field]);
+    }
+    bool all(const RecordStore::FieldZone& zone) const {
+        return matches(op == COMPARE_LESS || op == COMPARE_LESS_EQUAL ? zone.max[field] : zone.min[field]);
+    }
+};
+
+// Сравнение колонки по 2 значения за шаг: бит i результата - values[i] подходит
+template<class Compare>
+void match_words(const double* values, size_t n, uint64_t* words, Compare compare) {
+    size_t i = 0;
+    for(; i + 2 <= n; i += 2) {
+        Int2 m = compare(load2(values + i));
+        words[i / 64] |= static_cast<uint64_t>((m[0] & 1) | (m[1] & 2)) << (i % 64);
+    }
+    for(; i < n; i++) {
+        Double2 v = {values[i], values[i]};
+        words[i / 64] |= static_cast<uint64_t>(compare(v)[0] & 1) << (i % 64);
+    }
+}
+
+inline void match_mask(const double* values, size_t n, const ValuePredicate& predicate, uint64_t* words) {
+    std::fill(words, words + (n + 63) / 64, 0);
+    const Double2 t = {predicate.value, predicate.value};
+    switch(predicate.op) {
+        case COMPARE_LESS: match_words(values, n, words, [t](Double2 v) { return v < t; }); break;
+        case COMPARE_LESS_EQUAL: match_words(values, n, words, [t](Double2 v) { return v <= t; }); break;
+        case COMPARE_GREATER: match_words(values, n, words, [t](Double2 v) { return v > t; }); break;
+        case COMPARE_GREATER_EQUAL: match_words(values, n, words, [t](Double2 v) { return v >= t; }); break;
+        default: break;
+    }
+}
+
+// Первая позиция не меньше i, где бит маски равен bit (или n)
+inline size_t next_bit(const uint64_t* words, size_t i, size_t n, bool bit) {
+    while(i < n) {
+        uint64_t word = bit ? words[i / 64] : ~words[i / 64];
+        word &= ~0ull << (i % 64);
+        if(word) return std::min(n, i / 64 * 64 + static_cast<size_t>(__builtin_ctzll(word)));
+        i = (i / 64 + 1) * 64;
+    }
+    return n;
+}
+
+class IntervalBuilder {
+    bool open = false;
+
+public:
+    std::vector<TimeInterval> intervals;
+
+    // Подходящие показания от first_unix до last_unix продолжают открытый промежуток
+    void extend(int64_t first_unix, int64_t last_unix, size_t readings) {
+        if(!open) intervals.push_back({first_unix, last_unix, 0});
+        open = true;
+        intervals.back().last_unix = last_unix;
+        intervals.back().readings += static_cast<uint32_t>(readings);
+    }
+
+    void close() { open = false; }
+
+    // Записи по record_size байт: i64 время и f64 проверяемое поле на смещении value_offset
+    void scan(const char* records, size_t n, size_t record_size, size_t value_offset, const ValuePredicate& predicate) {
+        const size_t block = RecordStore::ZONE_RECORDS;
+        double values[block];
+        uint64_t words[block / 64];
+        auto ts = [&](const char* base, size_t i) {
+            uint64_t net;
+            memcpy(&net, base + i * record_size, sizeof(net));
+            return static_cast<int64_t>(ntohll(net));
+        };
+        for(size_t start = 0; start < n; start += block) {
+            const size_t m = std::min(block, n - start);
+            const char* base = records + start * record_size;
+            for(size_t k = 0; k < m; k++) values[k] = load_net_double(base + k * record_size + value_offset);
+            match_mask(values, m, predicate, words);
+            for(size_t i = 0; i < m;) {
+                bool matched = (words[i / 64] >> (i % 64)) & 1;
+                size_t j = next_bit(words, i, m, !matched);
+                if(matched) extend(ts(base, i), ts(base, j - 1), j - i);
+                else close();
+                i = j;
+            }
+        }
+    }
+};
+
+// Промежутки диапазона по условию. С хранилищем записей - по его зонам и хвост из БД одним
+// полем; без него - выборка одного поля из запечатанных дней, кэша и БД (collect_projected_range)
+inline std::vector<TimeInterval> collect_intervals(Database& db, RangeCache& cache, DayStore& days, RecordStore* records,
+                                                   const std::string& device, int64_t unix_from, int64_t unix_to,
+                                                   const ValuePredicate& predicate, SlicePool* pool = nullptr) {
+    const FieldMask field = static_cast<FieldMask>(1u << predicate.field);
+    const size_t projected_size = projected_record_size(field);
+    IntervalBuilder builder;
+    int64_t live_from = unix_from;
+    if(records) {
+        RecordStore::View view = records->view(db, device, db.get_ingest_state());
+        const size_t value_offset = sizeof(uint64_t) * (1 + predicate.field);
+        view.zones(unix_from, unix_to, [&](const char* data, size_t n, const RecordStore::FieldZone* zone) {
+            if(zone && predicate.none(*zone)) {
+                builder.close();
+            } else if(zone && predicate.all(*zone)) {
+                uint64_t first, last;
+                memcpy(&first, data, sizeof(first));
+                memcpy(&last, data + (n - 1) * RecordStore::RECORD_SIZE, sizeof(last));
+                builder.extend(static_cast<int64_t>(ntohll(first)), static_cast<int64_t>(ntohll(last)), n);
+            } else {
+                builder.scan(data, n, RecordStore::RECORD_SIZE, value_offset, predicate);
+            }
+        });
+        if(view.covered_to != RecordStore::NOT_COVERED) live_from = std::max(unix_from, view.covered_to + 1);
+        if(live_from <= unix_to) {
+            std::vector<char> live = encode_projected(db.get_fields(live_from, unix_to, device, field), field);
+            builder.scan(live.data(), live.size() / projected_size, projected_size, sizeof(int64_t), predicate);
+        }
+        return builder.intervals;
+    }
+    SegmentedRange range = collect_projected_range(db, cache, days, nullptr, device, unix_from, unix_to, field, pool);
+    for(const auto& segment : range.segments) {
+        builder.scan(segment.data(), segment.size() / projected_size, projected_size, sizeof(int64_t), predicate);
+    }
+    return builder.intervals;
+}
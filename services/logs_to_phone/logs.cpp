@@ -5,112 +5,58 @@
 #include <ctime>
 #include <thread>
 #include <vector>
+#include <memory>
+#include <future>
+#include <atomic>
+#include <pthread.h>
+#include <sched.h>
 #include <boost/asio.hpp>
-#include <sqlite3.h>
 #include <nlohmann/json.hpp>
-#include <arpa/inet.h>
+#include "admission.h"
+#include "database.h"
+#include "day_store.h"
+#include "downsample.h"
+#include "encoding.h"
+#include "history.h"
+#include "http_api.h"
+#include "intervals.h"
+#include "record_store.h"
+#include "slice_pool.h"
+#include "sync.h"
+#include "uring_server.h"
+#include "../common/trace_stats.h"
 
 namespace asio = boost::asio;
 using boost::asio::ip::tcp;
 using json = nlohmann::json;
 
-#pragma pack(push, 1)
-struct SensorData {
-    int64_t timestamp_unix;
-    double temperature_DHT22;
-    double temperature_DS18B20;
-    double humidity;
-    double water_level;
-    double soil_moisture;
-    double light_intensity;
-};
-#pragma pack(pop)
-
-uint64_t htonll(uint64_t value) {
-    static const int num = 42;
-    if (*reinterpret_cast<const char*>(&num) == num) {
-        return (static_cast<uint64_t>(htonl(value & 0xFFFFFFFF)) << 32) | htonl(value >> 32);
-    } else {
-        return value;
-    }
-}
-
-uint64_t ntohll(uint64_t value) {
-    return htonll(value);
-}
-
-const std::string DB_PATH = "/home/tovarichkek/services/data_server_farm/data.db";
 const int TCP_PORT = 1488;
+const unsigned short HTTP_PORT = 8088;
 const std::string LOG_FILE = "/var/log/data_to_phone.log";
-
-class Database {
-    sqlite3* db;
-
-public:
-    Database() {
-        if(sqlite3_open(DB_PATH.c_str(), &db) != SQLITE_OK) {
-            throw std::runtime_error(sqlite3_errmsg(db));
-        }
-    }
-    
-    ~Database() {
-        sqlite3_close(db);
-    }
-
-    std::vector<SensorData> get_data(int64_t unix_from, int64_t unix_to) {
-        std::vector<SensorData> results;
-        sqlite3_stmt* stmt;
-        const char* sql = "SELECT timestamp_unix, temperature_DHT22, "
-                          "temperature_DS18B20, humidity, water_level, "
-                          "soil_moisture, light_intensity "
-                          "FROM sensor_data "
-                          "WHERE timestamp_unix BETWEEN ? AND ? "
-                          "ORDER BY timestamp_unix;";
-
-        if(sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
-            sqlite3_bind_int64(stmt, 1, unix_from);
-            sqlite3_bind_int64(stmt, 2, unix_to);
-
-            while(sqlite3_step(stmt) == SQLITE_ROW) {
-                results.push_back({
-                    sqlite3_column_int64(stmt, 0),
-                    sqlite3_column_double(stmt, 1),
-                    sqlite3_column_double(stmt, 2),
-                    sqlite3_column_double(stmt, 3),
-                    sqlite3_column_double(stmt, 4),
-                    sqlite3_column_double(stmt, 5),
-                    sqlite3_column_double(stmt, 6)
-                });
-            }
-            sqlite3_finalize(stmt);
-        }
-        return results;
-    }
-
-    SensorData get_latest_data() {
-        SensorData data{};
-        sqlite3_stmt* stmt;
-        const char* sql = "SELECT timestamp_unix, temperature_DHT22, "
-                          "temperature_DS18B20, humidity, water_level, "
-                          "soil_moisture, light_intensity "
-                          "FROM sensor_data "
-                          "ORDER BY timestamp_unix DESC LIMIT 1;";
-
-        if(sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK) {
-            if(sqlite3_step(stmt) == SQLITE_ROW) {
-                data.timestamp_unix = sqlite3_column_int64(stmt, 0);
-                data.temperature_DHT22 = sqlite3_column_double(stmt, 1);
-                data.temperature_DS18B20 = sqlite3_column_double(stmt, 2);
-                data.humidity = sqlite3_column_double(stmt, 3);
-                data.water_level = sqlite3_column_double(stmt, 4);
-                data.soil_moisture = sqlite3_column_double(stmt, 5);
-                data.light_intensity = sqlite3_column_double(stmt, 6);
-            }
-            sqlite3_finalize(stmt);
-        }
-        return data;
-    }
-};
+const size_t RANGE_CACHE_MAX_BYTES = 64 * 1024 * 1024;
+const std::string DAY_STORE_DIR = "/home/tovarichkek/services/logs_to_phone/days";
+const std::string RECORD_STORE_DIR = "/home/tovarichkek/services/logs_to_phone/records";
+// Диапазон, кончающийся не раньше чем за минуту до запроса, - запрос свежих данных:
+// по нему считается возраст показания при выдаче
+const int64_t FRESH_RANGE_SLACK_SEC = 60;
+const int64_t LATENCY_SAVE_INTERVAL_SEC = 60;
+// Допуск запросов (admission.h). Токен - сутки показаний одного устройства: с одного IP
+// в среднем 2 суточные выгрузки в секунду, разом - до четырёх месяцев; на процесс - в 10 раз больше
+const double CLIENT_TOKENS_PER_SEC = 2;
+const double CLIENT_BURST_TOKENS = 120;
+const double GLOBAL_TOKENS_PER_SEC = 20;
+const double GLOBAL_BURST_TOKENS = 1200;
+// Очередь перед выполнением: места только для точечных запросов, запросов, ждущих места,
+// и сколько им ждать
+const size_t GATE_POINT_SLOTS = 1;
+const size_t GATE_MAX_WAITING = 32;
+const std::chrono::milliseconds GATE_MAX_WAIT{2000};
+// Поток на соединение: больше одновременных - сразу "занято", не читая запрос
+const int MAX_CONNECTION_THREADS = 256;
+const uint32_t BUSY_MARKER = 0xFFFFFFFF;
+// Пакетный запрос: не больше BATCH_MAX_QUERIES подзапросов, ответ начинается с BATCH_MARKER
+const size_t BATCH_MAX_QUERIES = 16;
+const uint32_t BATCH_MARKER = 0xFFFFFFFE;
 
 class Logger {
     std::ofstream log_file;
@@ -123,56 +69,494 @@ public:
         }
     }
 
-    void log(const std::string& ip, int64_t from, int64_t to, size_t count) {
+    static std::string format_line(const std::string& ip, int64_t from, int64_t to, size_t count) {
         auto now = std::chrono::system_clock::now();
         std::time_t now_time = std::chrono::system_clock::to_time_t(now);
+        std::tm timeinfo;
+        localtime_r(&now_time, &timeinfo);
         char time_str[20];
-        std::strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", std::localtime(&now_time));
+        std::strftime(time_str, sizeof(time_str), "%Y-%m-%d %H:%M:%S", &timeinfo);
         
-        log_file << time_str 
-                << " | IP: " << ip
-                << " | From: " << from
-                << " | To: " << to
-                << " | Records sent: " << count
-                << std::endl;
+        return std::string(time_str)
+                + " | IP: " + ip
+                + " | From: " + std::to_string(from)
+                + " | To: " + std::to_string(to)
+                + " | Records sent: " + std::to_string(count)
+                + "\n";
     }
-};
-
-void serialize_sensor_data(std::vector<char>& buffer, const SensorData& data) {
-    uint64_t net_timestamp = htonll(static_cast<uint64_t>(data.timestamp_unix));
-    uint64_t net_fields[6];
-    
-    memcpy(&net_fields[0], &data.temperature_DHT22, sizeof(double));
-    memcpy(&net_fields[1], &data.temperature_DS18B20, sizeof(double));
-    memcpy(&net_fields[2], &data.humidity, sizeof(double));
-    memcpy(&net_fields[3], &data.water_level, sizeof(double));
-    memcpy(&net_fields[4], &data.soil_moisture, sizeof(double));
-    memcpy(&net_fields[5], &data.light_intensity, sizeof(double));
-
-    for(auto& field : net_fields) field = htonll(field);
 
-    buffer.insert(buffer.end(), reinterpret_cast<char*>(&net_timestamp), 
-                 reinterpret_cast<char*>(&net_timestamp) + sizeof(net_timestamp));
-    for(auto& field : net_fields) {
-        buffer.insert(buffer.end(), reinterpret_cast<char*>(&field), 
-                     reinterpret_cast<char*>(&field) + sizeof(field));
+    void log(const std::string& ip, int64_t from, int64_t to, size_t count) {
+        log_file << format_line(ip, from, to, count) << std::flush;
     }
-}
+};
 
 void send_binary_data(tcp::socket& socket, const std::vector<SensorData>& data) {
     uint32_t count = htonl(static_cast<uint32_t>(data.size()));
     asio::write(socket, asio::buffer(&count, sizeof(count)));
 
-    std::vector<char> buffer;
-    for(const auto& item : data) {
-        serialize_sensor_data(buffer, item);
-    }
+    std::vector<char> buffer = encode_records(data);
     if(!buffer.empty()) {
         asio::write(socket, asio::buffer(buffer));
     }
 }
 
-void handle_client(tcp::socket socket, Database& db, Logger& logger) {
+// Источники данных запроса. pool - параллельное чтение длинных диапазонов, у шардов его нет.
+// latency и limiter - общие на процесс, в том числе для всех шардов.
+// point_db - отдельное соединение точечных запросов: они не ждут блокировку соединения,
+// пока длинная выборка читает через db. records - хранилище записей (--record-store), общее
+// для шардов; без него бинарные диапазоны идут через кэш и запечатанные дни
+struct PhoneContext {
+    Database& db;
+    Database& point_db;
+    RangeCache& cache;
+    DayStore& days;
+    RecordStore* records;
+    SlicePool* pool;
+    TraceStats& latency;
+    RateLimiter& limiter;
+    QueryGate* gate;
+};
+
+// Ответ на запрос порта 1488 - куски в памяти для gather-записи и запечатанные дни для
+// sendfile. Общий для всех бэкендов
+struct PhoneResponse {
+    std::vector<Segment> segments;
+    size_t records = 0;
+    int64_t unix_from = 0;
+    int64_t unix_to = 0;
+    std::string device;
+    int64_t newest_unix = 0;    // время самого нового показания в ответе, 0 - неизвестно
+    bool fresh = false;         // телефон спрашивал "до текущего момента"
+    bool busy = false;          // запрос не допущен, отправлен ответ "занято"
+};
+
+Chunk make_chunk(std::vector<char> bytes) {
+    return std::make_shared<const std::vector<char>>(std::move(bytes));
+}
+
+Chunk count_chunk(uint32_t count) {
+    uint32_t net_count = htonl(count);
+    const char* p = reinterpret_cast<const char*>(&net_count);
+    return make_chunk(std::vector<char>(p, p + sizeof(net_count)));
+}
+
+// Счётчик записей. С выбором полей за ним u8 маска полей (бит i - i-е поле после времени),
+// а записи - i64 время и только выбранные f64 поля в порядке SensorData
+Chunk records_header(uint32_t count, FieldMask fields) {
+    if(fields == ALL_FIELDS) return count_chunk(count);
+    std::vector<char> bytes(*count_chunk(count));
+    bytes.push_back(static_cast<char>(fields));
+    return make_chunk(std::move(bytes));
+}
+
+// Счётчик + записи
+PhoneResponse records_response(const std::vector<SensorData>& data, FieldMask fields = ALL_FIELDS) {
+    PhoneResponse response;
+    response.segments.push_back({records_header(static_cast<uint32_t>(data.size()), fields), nullptr});
+    response.segments.push_back({make_chunk(fields == ALL_FIELDS ? encode_records(data)
+                                                                 : encode_projected(data, fields)), nullptr});
+    response.records = data.size();
+    for(const auto& item : data) response.newest_unix = std::max(response.newest_unix, item.timestamp_unix);
+    return response;
+}
+
+// Время последней записи ответа порта 1488: начало последней записи последнего непустого сегмента
+int64_t last_record_time(const std::vector<Segment>& segments, size_t record_size = sizeof(SensorData)) {
+    for(auto it = segments.rbegin(); it != segments.rend(); ++it) {
+        if(it->size() < record_size) continue;
+        uint64_t net_timestamp = 0;
+        if(it->in_memory()) {
+            memcpy(&net_timestamp, it->data() + it->size() - record_size, sizeof(net_timestamp));
+        } else {
+            const SealedFile& file = it->day->binary;
+            off_t offset = static_cast<off_t>(file.offset + file.length - record_size);
+            if(pread(file.fd, &net_timestamp, sizeof(net_timestamp), offset) != sizeof(net_timestamp)) return 0;
+        }
+        return static_cast<int64_t>(ntohll(net_timestamp));
+    }
+    return 0;
+}
+
+// Диапазон: счётчик + куски из кэша (без копирования) и запечатанные дни или отображённые записи.
+// С max_points больше нуля записи прореживаются для графика (downsample.h). С выбором полей -
+// только они: выборка из тех же хранилищ и из БД только нужными колонками (collect_projected_range),
+// для графика прореживаются только выбранные поля
+PhoneResponse range_response(PhoneContext& ctx, Database& db, const std::string& device,
+                             int64_t unix_from, int64_t unix_to, int max_points = 0, FieldMask fields = ALL_FIELDS) {
+    bool projected = fields != ALL_FIELDS;
+    SegmentedRange range = projected && max_points == 0
+        ? collect_projected_range(db, ctx.cache, ctx.days, ctx.records, device, unix_from, unix_to, fields, ctx.pool)
+        : collect_binary_range(db, ctx.cache, ctx.days, ctx.records, device, unix_from, unix_to, ctx.pool);
+    bool fresh = unix_to >= std::time(nullptr) - FRESH_RANGE_SLACK_SEC;
+    PhoneResponse response;
+    if(max_points > 0 && range.count > static_cast<uint32_t>(max_points)) {
+        response = records_response(downsample_segments(range.segments, range.count, static_cast<size_t>(max_points),
+                                                        fields), fields);
+    } else {
+        if(projected && max_points > 0) range.segments = {{project_segments(range.segments, range.count, fields), nullptr}};
+        response.segments.push_back({records_header(range.count, fields), nullptr});
+        response.segments.insert(response.segments.end(), range.segments.begin(), range.segments.end());
+        response.records = range.count;
+        if(fresh) response.newest_unix = last_record_time(range.segments, projected_record_size(fields));
+    }
+    response.unix_from = unix_from;
+    response.unix_to = unix_to;
+    response.fresh = fresh;
+    return response;
+}
+
+// Итоги за диапазон (encode_aggregate) вместо записей
+PhoneResponse aggregate_response(const SensorAggregate& aggregate) {
+    PhoneResponse response;
+    response.segments.push_back({make_chunk(encode_aggregate(aggregate)), nullptr});
+    response.newest_unix = aggregate.last_unix;
+    return response;
+}
+
+PhoneResponse intervals_response(const std::vector<TimeInterval>& intervals) {
+    PhoneResponse response;
+    response.segments.push_back({make_chunk(encode_intervals(intervals)), nullptr});
+    if(!intervals.empty()) response.newest_unix = intervals.back().last_unix;
+    return response;
+}
+
+// Страница синхронизации: счётчик + записи, затем u8 has_more | u16 длина токена | токен.
+// Пустой токен - токен не принят, клиенту нужно начать заново с sync_since
+PhoneResponse sync_page_response(const SyncPage& page) {
+    PhoneResponse response = records_response(page.records);
+
+    std::vector<char> trailer;
+    trailer.push_back(page.has_more ? 1 : 0);
+    uint16_t token_len = htons(static_cast<uint16_t>(page.next_token.size()));
+    const char* p = reinterpret_cast<const char*>(&token_len);
+    trailer.insert(trailer.end(), p, p + sizeof(token_len));
+    trailer.insert(trailer.end(), page.next_token.begin(), page.next_token.end());
+    response.segments.push_back({make_chunk(std::move(trailer)), nullptr});
+    return response;
+}
+
+// Запрос порта 1488. Некорректный JSON - запрос последнего показания.
+// batch - пакет подзапросов queries; rejected - запрос с некорректным fields или where и
+// подзапрос, который в пакете не выполняется (синхронизация, вложенный пакет, сверх BATCH_MAX_QUERIES)
+struct PhoneRequest {
+    bool valid_range = false;
+    int64_t unix_from = 0;
+    int64_t unix_to = 0;
+    std::string device;
+    bool sync = false;
+    std::string sync_token;
+    int64_t sync_since = 0;
+    int page_size = SYNC_DEFAULT_PAGE_SIZE;
+    int max_points = 0;         // 0 - все записи диапазона
+    bool aggregate = false;     // итоги за диапазон вместо записей
+    bool intervals = false;     // промежутки по условию where вместо записей
+    ValuePredicate where;
+    FieldMask fields = ALL_FIELDS;
+    bool batch = false;
+    bool rejected = false;
+    std::vector<PhoneRequest> queries;
+};
+
+// Условие where: false - неизвестное поле или операция, нечисловое значение, нет корректного диапазона
+bool parse_where(const json& where, PhoneRequest& parsed) {
+    try {
+        FieldMask bit = field_bit(where.at("field").get<std::string>());
+        CompareOp op = compare_op(where.at("op").get<std::string>());
+        if(!bit || op == COMPARE_NONE || !where.at("value").is_number() || !parsed.valid_range) return false;
+        parsed.where = {static_cast<size_t>(__builtin_ctz(bit)), op, where.at("value").get<double>()};
+    } catch(...) {
+        return false;
+    }
+    parsed.intervals = true;
+    return true;
+}
+
+// Список fields: false - неизвестное имя или не строка
+bool parse_field_list(const json& names, PhoneRequest& parsed) {
+    FieldMask fields = 0;
+    for(const auto& name : names) {
+        if(!name.is_string()) return false;
+        FieldMask bit = field_bit(name.get<std::string>());
+        if(!bit) return false;
+        fields |= bit;
+    }
+    if(fields) parsed.fields = fields;
+    return true;
+}
+
+// Поля одного запроса; поле не того типа - исключение, разобранное до него остаётся
+// (ответ - последнее показание). Некорректные where и fields не бросают, а отклоняют запрос:
+// он не выполняется как диапазон всех записей
+void parse_fields(const json& request, PhoneRequest& parsed) {
+    if(request.contains("device") && request["device"].is_string()) {
+        parsed.device = request["device"].get<std::string>();
+    }
+    if(request.contains("unix_time_from") && request.contains("unix_time_to")) {
+        parsed.unix_from = request["unix_time_from"].get<int64_t>();
+        parsed.unix_to = request["unix_time_to"].get<int64_t>();
+        parsed.valid_range = parsed.unix_from <= parsed.unix_to;
+    }
+    if(request.contains("sync_token") && request["sync_token"].is_string()) {
+        parsed.sync_token = request["sync_token"].get<std::string>();
+        parsed.sync = true;
+    } else if(request.contains("sync_since")) {
+        parsed.sync_since = request["sync_since"].get<int64_t>();
+        parsed.sync = true;
+    }
+    if(request.contains("page_size")) {
+        parsed.page_size = request["page_size"].get<int>();
+    }
+    if(request.contains("max_points")) {
+        int max_points = request["max_points"].get<int>();
+        if(max_points > 0) parsed.max_points = std::max(3, std::min(max_points, MAX_POINTS_LIMIT));
+    }
+    if(request.contains("aggregate")) {
+        parsed.aggregate = request["aggregate"].get<bool>() && parsed.valid_range;
+    }
+    if(request.contains("where") && !parse_where(request["where"], parsed)) parsed.rejected = true;
+    if(request.contains("fields") && !parse_field_list(request["fields"], parsed)) parsed.rejected = true;
+}
+
+PhoneRequest parse_request(const std::string& request_str) {
+    PhoneRequest parsed;
+    try {
+        auto request = json::parse(request_str);
+        if(request.contains("batch") && request["batch"].is_array()) {
+            parsed.batch = true;
+            for(const auto& item : request["batch"]) {
+                PhoneRequest query;
+                try {
+                    parse_fields(item, query);
+                } catch (...) {}
+                query.rejected = query.rejected || !item.is_object() || item.contains("batch") || query.sync ||
+                                 parsed.queries.size() >= BATCH_MAX_QUERIES;
+                parsed.queries.push_back(std::move(query));
+            }
+            return parsed;
+        }
+        parse_fields(request, parsed);
+    } catch (...) {}
+    return parsed;
+}
+
+PhoneResponse execute_request(const PhoneRequest& request, PhoneContext& ctx, Database& db,
+                              const std::string& client_ip) {
+    const std::string& device = request.device;
+    try {
+        if(request.sync) {
+            SyncPage page;
+            int64_t since = 0;
+            try {
+                SyncCursor cursor = request.sync_token.empty() ? start_sync(db, request.sync_since)
+                                                               : decode_sync_token(device, request.sync_token);
+                page = fetch_sync_page(db, device, cursor, request.page_size);
+                since = cursor.since_unix;
+            } catch(const std::runtime_error& e) {
+                std::cerr << "Sync request from " << client_ip << " rejected: " << e.what() << std::endl;
+            }
+            PhoneResponse response = sync_page_response(page);
+            response.unix_from = since;
+            response.device = device;
+            response.fresh = !page.has_more;
+            return response;
+        }
+        if(request.aggregate) {
+            PhoneResponse response = aggregate_response(db.get_aggregate(request.unix_from, request.unix_to, device));
+            response.unix_from = request.unix_from;
+            response.unix_to = request.unix_to;
+            response.device = device;
+            return response;
+        }
+        if(request.intervals) {
+            PhoneResponse response = intervals_response(collect_intervals(
+                db, ctx.cache, ctx.days, ctx.records, device, request.unix_from, request.unix_to, request.where, ctx.pool));
+            response.unix_from = request.unix_from;
+            response.unix_to = request.unix_to;
+            response.device = device;
+            return response;
+        }
+        PhoneResponse response = request.valid_range
+            ? range_response(ctx, db, device, request.unix_from, request.unix_to, request.max_points, request.fields)
+            : records_response({db.get_latest_data(device)}, request.fields);
+        response.device = device;
+        response.fresh |= !request.valid_range;
+        return response;
+    }
+    catch(const std::exception& e) {
+        PhoneResponse response = records_response({db.get_latest_data(device)}, request.fields);
+        response.device = device;
+        return response;
+    }
+}
+
+// Стоимость запроса для допуска - оценка числа строк ответа (итогов - прочитанных строк,
+// пакета - сумма подзапросов)
+int64_t estimate_rows(const PhoneRequest& request, PhoneContext& ctx) {
+    if(request.batch) {
+        int64_t rows = 0;
+        for(const auto& query : request.queries) {
+            if(!query.rejected) rows += estimate_rows(query, ctx);
+        }
+        return rows;
+    }
+    if(request.sync) return request.page_size <= 0 ? SYNC_DEFAULT_PAGE_SIZE : std::min(request.page_size, SYNC_MAX_PAGE_SIZE);
+    if(!request.valid_range) return 1;
+    return ctx.limiter.estimate_rows(ctx.db, request.device, request.unix_from, request.unix_to);
+}
+
+// "Занято": u32 0xFFFFFFFF вместо счётчика записей, затем u32 - через сколько миллисекунд повторить
+PhoneResponse busy_response(const PhoneRequest& request, int64_t retry_after_ms) {
+    PhoneResponse response;
+    std::vector<char> bytes(2 * sizeof(uint32_t));
+    uint32_t marker = htonl(BUSY_MARKER);
+    uint32_t retry = htonl(static_cast<uint32_t>(std::min<int64_t>(retry_after_ms, UINT32_MAX)));
+    memcpy(bytes.data(), &marker, sizeof(marker));
+    memcpy(bytes.data() + sizeof(marker), &retry, sizeof(retry));
+    response.segments.push_back({make_chunk(std::move(bytes)), nullptr});
+    response.unix_from = request.unix_from;
+    response.unix_to = request.unix_to;
+    response.device = request.device;
+    response.busy = true;
+    return response;
+}
+
+// Последние участки пути показания (первые - в data.cpp):
+//   query - выполнение запроса
+//   delivery_age - от показания (время устройства) до выдачи телефону, только для запросов
+//   свежих данных: отсюда видно, сколько показание ждёт очередного опроса телефона
+void record_latency(PhoneContext& ctx, const PhoneResponse& response, std::chrono::steady_clock::time_point started) {
+    auto now = std::chrono::system_clock::now();
+    ctx.latency.add(response.device, "query", std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - started).count());
+    if(response.fresh && response.newest_unix > 0) {
+        int64_t now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()).count();
+        ctx.latency.add(response.device, "delivery_age", now_ms - response.newest_unix * 1000);
+    }
+}
+
+// Кадр пакетного ответа: u16 номер подзапроса в пакете | u8 вид | u32 длина | ответ подзапроса
+// в том же формате, что без пакета. Отклонённый подзапрос - кадр без ответа, записи с выбором
+// полей и промежутки по условию - свои виды
+enum BatchPartKind : uint8_t {
+    PART_REJECTED = 0, PART_RECORDS = 1, PART_AGGREGATE = 2, PART_PROJECTED = 3, PART_INTERVALS = 4
+};
+
+Chunk frame_header(size_t index, BatchPartKind kind, size_t length) {
+    std::vector<char> bytes(sizeof(uint16_t) + 1 + sizeof(uint32_t));
+    uint16_t net_index = htons(static_cast<uint16_t>(index));
+    uint32_t net_length = htonl(static_cast<uint32_t>(length));
+    memcpy(bytes.data(), &net_index, sizeof(net_index));
+    bytes[sizeof(net_index)] = static_cast<char>(kind);
+    memcpy(bytes.data() + sizeof(net_index) + 1, &net_length, sizeof(net_length));
+    return make_chunk(std::move(bytes));
+}
+
+// Пакет: u32 BATCH_MARKER | u16 число подзапросов, затем по кадру на подзапрос - в порядке
+// выполнения, дешёвые первыми. Кадр уходит через emit, как только готов: телефон рисует
+// панель по частям за одно подключение. Подзапросы выполняются на отдельном соединении в одной
+// транзакции чтения и видят одно состояние БД; поэтому и без пула срезов - его соединения
+// вне снимка. Возвращает итог для журнала, все части уже отданы
+PhoneResponse execute_batch(const PhoneRequest& request, PhoneContext& ctx, const std::string& client_ip,
+                            const PartSink& emit) {
+    std::vector<char> head(sizeof(uint32_t) + sizeof(uint16_t));
+    uint32_t marker = htonl(BATCH_MARKER);
+    uint16_t parts = htons(static_cast<uint16_t>(request.queries.size()));
+    memcpy(head.data(), &marker, sizeof(marker));
+    memcpy(head.data() + sizeof(marker), &parts, sizeof(parts));
+    emit({{make_chunk(std::move(head)), nullptr}});
+
+    std::vector<std::pair<int64_t, size_t>> order;
+    for(size_t i = 0; i < request.queries.size(); i++) {
+        const PhoneRequest& query = request.queries[i];
+        order.emplace_back(query.rejected ? 0 : estimate_rows(query, ctx), i);
+    }
+    std::sort(order.begin(), order.end());
+
+    Database snapshot;
+    snapshot.begin_snapshot();
+    PhoneContext snapshot_ctx = ctx;
+    snapshot_ctx.pool = nullptr;
+    PhoneResponse total;
+    for(const auto& [rows, i] : order) {
+        const PhoneRequest& query = request.queries[i];
+        std::vector<Segment> frame;
+        if(query.rejected) {
+            frame.push_back({frame_header(i, PART_REJECTED, 0), nullptr});
+            emit(std::move(frame));
+            continue;
+        }
+        auto started = std::chrono::steady_clock::now();
+        PhoneResponse part = execute_request(query, snapshot_ctx, snapshot, client_ip);
+        record_latency(ctx, part, started);
+        size_t length = 0;
+        for(const auto& segment : part.segments) length += segment.size();
+        BatchPartKind kind = query.aggregate ? PART_AGGREGATE
+                           : query.intervals ? PART_INTERVALS
+                           : query.fields != ALL_FIELDS ? PART_PROJECTED : PART_RECORDS;
+        frame.push_back({frame_header(i, kind, length), nullptr});
+        frame.insert(frame.end(), part.segments.begin(), part.segments.end());
+        emit(std::move(frame));
+
+        total.records += part.records;
+        if(query.valid_range) {
+            total.unix_from = total.unix_to == 0 ? query.unix_from : std::min(total.unix_from, query.unix_from);
+            total.unix_to = std::max(total.unix_to, query.unix_to);
+        }
+    }
+    snapshot.end_snapshot();
+    return total;
+}
+
+// Перед выполнением - допуск (admission.h): вёдра токенов IP и процесса, затем очередь
+// QueryGate, если она есть (у шардов её нет: запрос и так выполняется в цикле кольца).
+// Точечный запрос идёт своей полосой, срезы длинной выборки в пуле уступают ему.
+// Пакет проходит допуск целиком, его части уходят через emit
+PhoneResponse build_response(const std::string& request_str, PhoneContext& ctx, const std::string& client_ip,
+                             const PartSink& emit) {
+    PhoneRequest request = parse_request(request_str);
+    // Отклонённый запрос не выполняется в другом виде: пустой ответ (ноль записей)
+    if(request.rejected) {
+        std::cerr << "Malformed request from " << client_ip << " rejected" << std::endl;
+        return records_response({});
+    }
+    int64_t rows = estimate_rows(request, ctx);
+    Admission admission = ctx.limiter.admit(client_ip, rows);
+    if(!admission.admitted) return busy_response(request, admission.retry_after_ms);
+    QueryGate::Ticket ticket;
+    if(ctx.gate) {
+        ticket = ctx.gate->enter(rows);
+        if(!ticket) return busy_response(request, QueryGate::RETRY_AFTER_MS);
+    }
+    SlicePool::ScanScope scan(ticket.scan());
+    if(request.batch) return execute_batch(request, ctx, client_ip, emit);
+
+    auto started = std::chrono::steady_clock::now();
+    PhoneResponse response = execute_request(request, ctx, ticket.scan() ? ctx.db : ctx.point_db, client_ip);
+    record_latency(ctx, response, started);
+    return response;
+}
+
+// Подряд идущие куски в памяти и отображённые записи - одной gather-записью, запечатанные дни - sendfile
+void write_segments(tcp::socket& socket, const std::vector<Segment>& segments) {
+    std::vector<asio::const_buffer> buffers;
+    for(const auto& segment : segments) {
+        if(segment.in_memory()) {
+            buffers.push_back(asio::buffer(segment.data(), segment.size()));
+            continue;
+        }
+        asio::write(socket, buffers);
+        buffers.clear();
+        sendfile_all(socket.native_handle(), segment.day->binary);
+    }
+    asio::write(socket, buffers);
+}
+
+void report_sent(const PhoneResponse& response, const std::string& client_ip) {
+    if(response.busy) std::cout << "Busy response to " << client_ip << std::endl;
+    else std::cout << "Sent " << response.records << " records to " << client_ip << std::endl;
+}
+
+void handle_client(tcp::socket socket, PhoneContext& ctx, Logger& logger) {
     std::string client_ip = "unknown";
     try {
         client_ip = socket.remote_endpoint().address().to_string();
@@ -185,60 +569,226 @@ void handle_client(tcp::socket socket, Database& db, Logger& logger) {
         std::istream is(&buf);
         std::string request_str;
         std::getline(is, request_str);
-        
-        bool valid_request = false;
-        int64_t unix_from = 0, unix_to = 0;
-        std::vector<SensorData> data;
-
-        try {
-            auto request = json::parse(request_str);
-            if(request.contains("unix_time_from") && request.contains("unix_time_to")) {
-                unix_from = request["unix_time_from"].get<int64_t>();
-                unix_to = request["unix_time_to"].get<int64_t>();
-                if(unix_from <= unix_to) {
-                    data = db.get_data(unix_from, unix_to);
-                    valid_request = true;
-                }
-            }
-        } catch (...) {}
 
-        if(!valid_request) {
-            data.push_back(db.get_latest_data());
-            unix_from = unix_to = 0;
-        }
+        PhoneResponse response = build_response(request_str, ctx, client_ip, [&socket](std::vector<Segment> part) {
+            write_segments(socket, part);
+        });
+        write_segments(socket, response.segments);
 
-        send_binary_data(socket, data);
-        logger.log(client_ip, unix_from, unix_to, data.size());
-        std::cout << "Sent " << data.size() << " records to " << client_ip << std::endl;
+        logger.log(client_ip, response.unix_from, response.unix_to, response.records);
+        report_sent(response, client_ip);
     }
     catch(const std::exception& e) {
         try {
-            std::vector<SensorData> fallback_data{db.get_latest_data()};
+            std::vector<SensorData> fallback_data{ctx.db.get_latest_data()};
             send_binary_data(socket, fallback_data);
             logger.log(client_ip, 0, 0, fallback_data.size());
         } catch (...) {}
     }
 }
 
-int main() {
+// Потоков соединений уже MAX_CONNECTION_THREADS: "занято" прямо из цикла accept.
+// 8 байт в только что принятый сокет уходят в буфер ядра без ожидания
+void reject_busy(tcp::socket& socket, Logger& logger) {
+    std::string client_ip = "unknown";
+    try {
+        client_ip = socket.remote_endpoint().address().to_string();
+        PhoneResponse response = busy_response(PhoneRequest{}, QueryGate::RETRY_AFTER_MS);
+        write_segments(socket, response.segments);
+        logger.log(client_ip, 0, 0, 0);
+        report_sent(response, client_ip);
+    } catch (...) {}
+}
+
+LineResponse uring_response(const std::string& request, const std::string& ip, PhoneContext& ctx,
+                            const PartSink& emit) {
+    PhoneResponse response = build_response(request, ctx, ip, emit);
+    report_sent(response, ip);
+    return LineResponse{std::move(response.segments),
+                        Logger::format_line(ip, response.unix_from, response.unix_to, response.records)};
+}
+
+// Ответ "занято" без разбора запроса - когда нет даже места в очереди
+LineResponse overload_response(const std::string& ip) {
+    PhoneResponse response = busy_response(PhoneRequest{}, QueryGate::RETRY_AFTER_MS);
+    report_sent(response, ip);
+    return LineResponse{std::move(response.segments), Logger::format_line(ip, 0, 0, 0)};
+}
+
+// Бэкенд на io_uring: тот же протокол, лог пишется через кольцо. Рабочих потоков столько,
+// сколько мест в QueryGate (выполняются и ждут), сверх этого запросы ждут в кольце,
+// а при полной очереди кольца сразу получают "занято"
+void run_uring_backend(PhoneContext& ctx) {
+    size_t workers = ctx.gate ? ctx.gate->capacity() : std::max(2u, std::thread::hardware_concurrency());
+    UringServer server(TCP_PORT, LOG_FILE, [&ctx](const std::string& request, const std::string& ip, const PartSink& emit) {
+        return uring_response(request, ip, ctx, emit);
+    }, static_cast<unsigned>(workers));
+    server.set_overload(workers, [](const std::string&, const std::string& ip, const PartSink&) {
+        return overload_response(ip);
+    });
+
+    std::cout << "Data to Phone Service started on port " << TCP_PORT << " (io_uring)" << std::endl;
+    server.run();
+}
+
+// Процессоры, на которых процессу разрешено работать (в контейнере это не обязательно 0..N-1)
+std::vector<int> allowed_cpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if(CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+
+// Шард: свой поток на своём ядре, свой сокет SO_REUSEPORT, кольцо, соединение с БД, кэш и
+// открытые запечатанные дни (файлы дней на диске общие).
+// Общие между шардами только статистика задержек, вёдра токенов и хранилище записей: подключение обслуживается целиком на ядре, куда его отдало ядро ОС
+void run_shard(int cpu, size_t cache_bytes, TraceStats& latency, RateLimiter& limiter, RecordStore* records,
+               std::promise<void> started) {
+    bool running = false;
+    try {
+        if(cpu >= 0) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        }
+        Database db;
+        RangeCache cache(cache_bytes);
+        DayStore days(DAY_STORE_DIR);
+        PhoneContext ctx{db, db, cache, days, records, nullptr, latency, limiter, nullptr};
+        UringServer server(TCP_PORT, LOG_FILE, [&ctx](const std::string& request, const std::string& ip, const PartSink& emit) {
+            return uring_response(request, ip, ctx, emit);
+        }, 0, true);
+        started.set_value();
+        running = true;
+        server.run();
+    } catch(const std::exception& e) {
+        if(!running) started.set_exception(std::current_exception());
+        else std::cerr << "Shard on cpu " << cpu << " stopped: " << e.what() << std::endl;
+    }
+}
+
+// --shards N: N шардов на разных ядрах (0 - по числу доступных ядер). Бросает исключение,
+// если не запустился первый шард - тогда остаётся обычный бэкенд
+void run_sharded_backend(unsigned shard_count, TraceStats& latency, RateLimiter& limiter, RecordStore* records) {
+    std::vector<int> cpus = allowed_cpus();
+    if(shard_count == 0) shard_count = std::max<size_t>(1, cpus.size());
+
+    std::vector<std::thread> shards;
+    for(unsigned i = 0; i < shard_count; i++) {
+        int cpu = cpus.empty() ? -1 : cpus[i % cpus.size()];
+        std::promise<void> started;
+        std::future<void> ready = started.get_future();
+        shards.emplace_back(run_shard, cpu, RANGE_CACHE_MAX_BYTES / shard_count, std::ref(latency),
+                            std::ref(limiter), records, std::move(started));
+        try {
+            ready.get();
+        } catch(const std::exception& e) {
+            shards.back().join();
+            shards.pop_back();
+            if(shards.empty()) throw;
+            std::cerr << "Shard " << i << " failed to start: " << e.what() << std::endl;
+        }
+    }
+
+    std::cout << "Data to Phone Service started on port " << TCP_PORT << " ("
+              << shards.size() << " shards)" << std::endl;
+    for(auto& shard : shards) shard.join();
+}
+
+int main(int argc, char* argv[]) {
     try {
         std::ofstream tmp(LOG_FILE, std::ios::app);
         tmp.close();
 
         Database database;
+        Database point_database;
+        RangeCache cache(RANGE_CACHE_MAX_BYTES);
+        DayStore days(DAY_STORE_DIR);
+        SlicePool slices(std::max(2u, std::thread::hardware_concurrency()));
+        TraceStats latency;
+        RateLimiter limiter(CLIENT_TOKENS_PER_SEC, CLIENT_BURST_TOKENS, GLOBAL_TOKENS_PER_SEC, GLOBAL_BURST_TOKENS);
+        QueryGate gate(std::max(2u, std::thread::hardware_concurrency()), GATE_POINT_SLOTS, GATE_MAX_WAITING, GATE_MAX_WAIT);
+        slices.set_pause([&gate]() { gate.yield_to_points(); });
+
+        // --io-uring, --shards N и --record-store: необязательные бэкенды; если ядро не даёт
+        // io_uring - обычный поток на соединение, если каталог хранилища недоступен - БД
+        bool use_uring = false;
+        bool use_record_store = false;
+        int shard_count = -1;
+        for(int i = 1; i < argc; i++) {
+            std::string arg = argv[i];
+            if(arg == "--io-uring") use_uring = true;
+            else if(arg == "--shards" && i + 1 < argc) shard_count = std::max(0, std::atoi(argv[++i]));
+            else if(arg == "--record-store") use_record_store = true;
+            else std::cerr << "Unknown option " << arg << std::endl;
+        }
+        std::unique_ptr<RecordStore> records;
+        if(use_record_store) {
+            try {
+                records = std::make_unique<RecordStore>(RECORD_STORE_DIR);
+            } catch(const std::exception& e) {
+                std::cerr << "Record store unavailable, using database: " << e.what() << std::endl;
+            }
+        }
+
+        PhoneContext ctx{database, point_database, cache, days, records.get(), &slices, latency, limiter, &gate};
         Logger logger;
+
+        // Гистограммы задержек - в latency_stats, рядом с участками data.cpp
+        std::thread([&database, &latency]() {
+            int64_t started_unix = std::time(nullptr);
+            while(true) {
+                std::this_thread::sleep_for(std::chrono::seconds(LATENCY_SAVE_INTERVAL_SEC));
+                for(const auto& e : latency.snapshot()) {
+                    if(!database.save_latency("logs", e.device, e.hop, started_unix, std::time(nullptr), e.histogram)) {
+                        std::cerr << "Cannot save latency stats" << std::endl;
+                        break;
+                    }
+                }
+            }
+        }).detach();
         
+        // HTTP API работает рядом с бинарным протоколом на тех же БД и кэше
+        http_api::HttpApi http(database, cache, days, &slices, &limiter, &gate, &point_database, records.get());
+        std::thread([&http]() {
+            try {
+                http.run(HTTP_PORT);
+            } catch(const std::exception& e) {
+                std::cerr << "HTTP API error: " << e.what() << std::endl;
+            }
+        }).detach();
+
+        try {
+            if(shard_count >= 0) run_sharded_backend(static_cast<unsigned>(shard_count), latency, limiter, records.get());
+            else if(use_uring) run_uring_backend(ctx);
+        } catch(const std::exception& e) {
+            std::cerr << "io_uring backend unavailable, using threads: " << e.what() << std::endl;
+        }
+
         asio::io_context io_context;
         tcp::acceptor acceptor(io_context, tcp::endpoint(tcp::v4(), TCP_PORT));
 
         std::cout << "Data to Phone Service started on port " << TCP_PORT << std::endl;
 
+        std::atomic<int> connection_threads{0};
         while(true) {
             tcp::socket socket(io_context);
             acceptor.accept(socket);
-            
-            std::thread([s = std::move(socket), &database, &logger]() mutable {
-                handle_client(std::move(s), database, logger);
+
+            if(connection_threads.load() >= MAX_CONNECTION_THREADS) {
+                reject_busy(socket, logger);
+                continue;
+            }
+            connection_threads++;
+            std::thread([s = std::move(socket), &ctx, &logger, &connection_threads]() mutable {
+                handle_client(std::move(s), ctx, logger);
+                connection_threads--;
             }).detach();
         }
     }
@@ -1 +1 @@
-g++ -std=c++17 -pthread -o LOGS logs.cpp -I/usr/include/boost -lboost_system -lboost_thread -lsqlite3
+g++ -std=c++17 -O2 -pthread -o LOGS logs.cpp -I/usr/include/boost -lboost_system -lboost_thread -lsqlite3 -lz
@@ -0,0 +1,115 @@
+#pragma once
+
+// LRU-кэш закодированных ответов на запросы диапазонов.
+// Ключ - (device, from, to, format). Часть диапазона не новее отметки приёма
+// (ingest_state.ts_watermark, её пишет data.cpp) уже не меняется, поэтому хранится
+// готовыми байтами и отдаётся по указателю. Для "открытого" диапазона при следующем
+// запросе из БД дочитываются только новые строки хвоста и добавляются отдельным куском.
+// Если data.cpp записал строку старше отметки (late_epoch изменился), кэш сбрасывается
+
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <cstdint>
+
+struct RangeKey {
+    std::string device;
+    int64_t unix_from;
+    int64_t unix_to;
+    std::string format;
+
+    bool operator<(const RangeKey& other) const {
+        return std::tie(device, unix_from, unix_to, format) <
+               std::tie(other.device, other.unix_from, other.unix_to, other.format);
+    }
+};
+
+using Chunk = std::shared_ptr<const std::vector<char>>;
+
+struct CachedRange {
+    std::vector<Chunk> chunks;  // закодированные записи по порядку времени
+    uint32_t count = 0;         // число записей во всех кусках
+    int64_t covered_to = 0;     // записи с временем <= covered_to уже в кусках
+    size_t bytes = 0;
+
+    void append(std::vector<char> encoded, uint32_t records, int64_t new_covered_to) {
+        covered_to = new_covered_to;
+        if(records == 0) return;
+        bytes += encoded.size();
+        count += records;
+        chunks.push_back(std::make_shared<const std::vector<char>>(std::move(encoded)));
+        // Много мелких хвостов склеиваем, чтобы не раздувать gather-запись
+        if(chunks.size() > MAX_CHUNKS) {
+            auto merged = std::make_shared<std::vector<char>>();
+            merged->reserve(bytes);
+            for(const auto& c : chunks) merged->insert(merged->end(), c->begin(), c->end());
+            chunks.assign(1, std::move(merged));
+        }
+    }
+
+    static constexpr size_t MAX_CHUNKS = 16;
+};
+
+class RangeCache {
+    using LruList = std::list<RangeKey>;
+
+    struct Slot {
+        CachedRange range;
+        LruList::iterator lru;
+    };
+
+    std::map<RangeKey, Slot> entries;
+    LruList lru;                        // в начале - самые свежие
+    size_t max_bytes;
+    size_t used_bytes = 0;
+    int64_t late_epoch = 0;
+    std::mutex mtx;
+
+    void erase(std::map<RangeKey, Slot>::iterator it) {
+        used_bytes -= it->second.range.bytes;
+        lru.erase(it->second.lru);
+        entries.erase(it);
+    }
+
+public:
+    explicit RangeCache(size_t max_bytes) : max_bytes(max_bytes) {}
+
+    // Возвращает копию записи (куски общие, данные не копируются). Эпоха только растёт:
+    // запрос, прочитавший отметки до её увеличения, кэш не сбрасывает и не пополняет
+    bool lookup(const RangeKey& key, int64_t epoch, CachedRange& out) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if(epoch < late_epoch) return false;
+        if(epoch > late_epoch) {
+            entries.clear();
+            lru.clear();
+            used_bytes = 0;
+            late_epoch = epoch;
+            return false;
+        }
+        auto it = entries.find(key);
+        if(it == entries.end()) return false;
+        lru.splice(lru.begin(), lru, it->second.lru);
+        out = it->second.range;
+        return true;
+    }
+
+    void store(const RangeKey& key, int64_t epoch, const CachedRange& range) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if(epoch != late_epoch || range.bytes > max_bytes) return;
+
+        auto it = entries.find(key);
+        if(it != entries.end()) erase(it);
+
+        lru.push_front(key);
+        entries[key] = Slot{range, lru.begin()};
+        used_bytes += range.bytes;
+
+        while(used_bytes > max_bytes && !lru.empty()) {
+            erase(entries.find(lru.back()));
+        }
+    }
+};
@@ -0,0 +1,14 @@
+// Расширение SQLite с виртуальной таблицей record_store (см. record_vtab.h):
+//   sqlite3 data.db
+//   .load ./record_sql
+//   CREATE VIRTUAL TABLE temp.records USING record_store('/home/tovarichkek/services/logs_to_phone/records');
+
+#include <sqlite3ext.h>
+SQLITE_EXTENSION_INIT1
+
+#include "record_vtab.h"
+
+extern "C" int sqlite3_recordsql_init(sqlite3* db, char**, const sqlite3_api_routines* api) {
+    SQLITE_EXTENSION_INIT2(api);
+    return register_record_module(db);
+}
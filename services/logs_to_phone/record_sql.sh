@@ -0,0 +1 @@
+g++ -std=c++17 -O2 -shared -fPIC -o record_sql.so record_sql.cpp -lz
@@ -0,0 +1,421 @@
+#pragma once
+
+// Хранилище записей в формате порта 1488 (--record-store). Записи устройства (и "_all" - всех
+// устройств) лежат по времени в файлах-сегментах <каталог>/<late_epoch>/<устройство>/<n>.seg
+// фиксированной ёмкости, отображённых в память: заголовок на первой странице, дальше записи
+// по 56 байт в сетевом порядке. Хранилище дописывается из БД до отметки приёма - эта часть
+// истории не меняется, пока не вырастет late_epoch; тогда хранилище начинается заново в новом
+// каталоге. Разреженный индекс - время каждой INDEX_STRIDE-й записи. Диапазон находится двумя
+// интерполяционными поисками (по индексу, затем внутри блока) и отдаётся прямо из
+// отображения - без SQLite, разбора строк и кодирования. Зоны по ZONE_RECORDS записей хранят
+// минимум и максимум каждого поля - запрос промежутков по условию на значение пропускает зоны,
+// не читая записей (intervals.h). Хвост новее отметки приёма
+// читается из БД (см. collect_mapped_range в history.h). Другие процессы читают сегменты
+// через snapshot (виртуальная таблица SQLite, см. record_vtab.h)
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <filesystem>
+#include <stdexcept>
+#include <system_error>
+#include <cstring>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "database.h"
+#include "day_store.h"
+#include "encoding.h"
+
+// Первая позиция в [lo, hi) со временем не меньше key (или hi). Позиция берётся по линейной
+// интерполяции между краями отрезка; если шаг не сократил отрезок хотя бы вдвое
+// (неравномерные данные), следующий шаг - деление пополам
+template<class Timestamp>
+size_t interpolation_lower_bound(Timestamp ts, size_t lo, size_t hi, int64_t key) {
+    bool bisect = false;
+    while(lo < hi) {
+        int64_t first = ts(lo);
+        int64_t last = ts(hi - 1);
+        if(key <= first) return lo;
+        if(key > last) return hi;
+        size_t before = hi - lo;
+        size_t mid = bisect ? lo + (hi - lo) / 2
+                            : lo + static_cast<size_t>(static_cast<double>(key - first) /
+                                                       static_cast<double>(last - first) * static_cast<double>(hi - 1 - lo));
+        mid = std::min(mid, hi - 1);
+        if(ts(mid) < key) lo = mid + 1;
+        else hi = mid;
+        bisect = hi - lo > before / 2;
+    }
+    return lo;
+}
+
+class RecordStore {
+public:
+    static constexpr size_t RECORD_SIZE = sizeof(SensorData);
+    static constexpr size_t SEGMENT_RECORDS = 1 << 18;          // 14 МБ, месяц показаний одного устройства
+    static constexpr size_t INDEX_STRIDE = 64;                  // блок индекса - страница записей
+    static constexpr int64_t CATCH_UP_SPAN_SEC = 7 * 86400;     // дописывание из БД - кусками по неделе
+    static constexpr size_t ZONE_RECORDS = 1024;                // 56 КБ записей, 256 зон на сегмент
+    static constexpr int64_t NOT_COVERED = INT64_MIN;
+
+    // Минимум и максимум каждого поля записей зоны
+    struct FieldZone {
+        double min[6];
+        double max[6];
+    };
+
+private:
+    static constexpr size_t HEADER_SIZE = 4096;
+    static constexpr char MAGIC[8] = {'I', 'O', 'P', 'R', 'E', 'C', '0', '1'};
+
+    // Заголовок сегмента (порядок байт хоста): count и covered_to обновляются после записей
+    struct SegmentHeader {
+        char magic[8];
+        uint64_t count;
+        int64_t covered_to;
+    };
+
+    // Отображённый сегмент. Записи до опубликованного count и их индекс больше не меняются
+    struct MappedSegment {
+        int fd = -1;
+        char* map = nullptr;
+        std::vector<int64_t> index;  // пустой у сегментов снимка (snapshot)
+        std::vector<FieldZone> zones;  // как и индекс; зона не меняется, когда заполнена
+        size_t count = 0;           // опубликованное число записей, под DeviceLog::mtx
+
+        ~MappedSegment() {
+            if(map) munmap(map, HEADER_SIZE + SEGMENT_RECORDS * RECORD_SIZE);
+            if(fd >= 0) close(fd);
+        }
+
+        SegmentHeader* header() const { return reinterpret_cast<SegmentHeader*>(map); }
+        const char* records() const { return map + HEADER_SIZE; }
+        int64_t timestamp(size_t i) const {
+            uint64_t net;
+            memcpy(&net, records() + i * RECORD_SIZE, sizeof(net));
+            return static_cast<int64_t>(ntohll(net));
+        }
+
+        // Зоны записей [from, to) - после записи, до публикации
+        void update_zones(size_t from, size_t to) {
+            for(size_t i = from; i < to; i++) {
+                FieldZone& zone = zones[i / ZONE_RECORDS];
+                const char* record = records() + i * RECORD_SIZE;
+                bool first = i % ZONE_RECORDS == 0;
+                for(size_t f = 0; f < 6; f++) {
+                    double value = load_net_double(record + sizeof(uint64_t) * (1 + f));
+                    if(first || value < zone.min[f]) zone.min[f] = value;
+                    if(first || value > zone.max[f]) zone.max[f] = value;
+                }
+            }
+        }
+
+        // Первая запись из первых n со временем не меньше key
+        size_t lower_bound(size_t n, int64_t key) const {
+            if(n == 0) return 0;
+            if(index.empty()) return interpolation_lower_bound([this](size_t i) { return timestamp(i); }, 0, n, key);
+            size_t blocks = (n + INDEX_STRIDE - 1) / INDEX_STRIDE;
+            size_t block = interpolation_lower_bound([this](size_t i) { return index[i]; }, 0, blocks, key);
+            if(block == 0) return 0;
+            size_t from = (block - 1) * INDEX_STRIDE;
+            size_t to = std::min(n, block * INDEX_STRIDE);
+            return interpolation_lower_bound([this](size_t i) { return timestamp(i); }, from, to, key);
+        }
+    };
+
+    using SegmentRef = std::shared_ptr<MappedSegment>;
+
+    // Записи одного устройства. append_mtx - дописывание (один писатель), mtx - публикация
+    struct DeviceLog {
+        std::string path;
+        std::vector<SegmentRef> segments;
+        int64_t covered_to = NOT_COVERED;   // записи не новее covered_to все в хранилище
+        std::mutex append_mtx;
+        std::mutex mtx;
+    };
+
+    std::string dir;
+    int lock_fd = -1;
+    int64_t epoch = -1;
+    std::map<std::string, std::shared_ptr<DeviceLog>> devices;
+    std::mutex mtx;
+
+    std::string epoch_dir() const {
+        return dir + "/" + std::to_string(epoch);
+    }
+
+    static SegmentRef map_segment(const std::string& path, bool create, bool writable = true) {
+        auto segment = std::make_shared<MappedSegment>();
+        const size_t file_size = HEADER_SIZE + SEGMENT_RECORDS * RECORD_SIZE;
+        segment->fd = open(path.c_str(), (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0644);
+        if(segment->fd < 0) return nullptr;
+        struct stat st;
+        // Файл создаётся разреженным: место на диске занимают только записанные страницы
+        if(create && ftruncate(segment->fd, static_cast<off_t>(file_size)) != 0) return nullptr;
+        if(fstat(segment->fd, &st) != 0 || static_cast<size_t>(st.st_size) != file_size) return nullptr;
+        void* map = mmap(nullptr, file_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, segment->fd, 0);
+        if(map == MAP_FAILED) return nullptr;
+        segment->map = static_cast<char*>(map);
+        if(writable) {
+            segment->index.resize((SEGMENT_RECORDS + INDEX_STRIDE - 1) / INDEX_STRIDE);
+            segment->zones.resize(SEGMENT_RECORDS / ZONE_RECORDS);
+        }
+        return segment;
+    }
+
+    // Сегменты устройства с диска - при первом обращении к устройству. Индекс строится заново;
+    // если время где-то убывает или заголовок не сходится (сбой посреди записи), записи
+    // устройства собираются заново
+    static void load(DeviceLog& log) {
+        for(size_t n = 0;; n++) {
+            std::string path = log.path + "/" + std::to_string(n) + ".seg";
+            if(access(path.c_str(), F_OK) != 0) return;
+            SegmentRef segment = map_segment(path, false);
+            bool valid = segment && memcmp(segment->header()->magic, MAGIC, sizeof(MAGIC)) == 0 &&
+                         segment->header()->count <= SEGMENT_RECORDS &&
+                         (log.segments.empty() || log.segments.back()->count == SEGMENT_RECORDS);
+            if(valid) {
+                segment->count = segment->header()->count;
+                int64_t previous = log.segments.empty() || log.segments.back()->count == 0
+                    ? INT64_MIN : log.segments.back()->timestamp(SEGMENT_RECORDS - 1);
+                for(size_t i = 0; valid && i < segment->count; i++) {
+                    int64_t ts = segment->timestamp(i);
+                    if(i % INDEX_STRIDE == 0) segment->index[i / INDEX_STRIDE] = ts;
+                    valid = ts >= previous;
+                    previous = ts;
+                }
+                if(valid) segment->update_zones(0, segment->count);
+            }
+            if(!valid) {
+                log.segments.clear();
+                std::error_code ignored;
+                std::filesystem::remove_all(log.path, ignored);
+                log.covered_to = NOT_COVERED;
+                return;
+            }
+            log.covered_to = segment->header()->covered_to;
+            log.segments.push_back(segment);
+        }
+    }
+
+    // nullptr - запрос прочитал отметки до увеличения late_epoch другим запросом: эпоха только
+    // растёт, хранилище не начинается заново со старой
+    std::shared_ptr<DeviceLog> device_log(const std::string& device, int64_t late_epoch) {
+        std::lock_guard<std::mutex> lock(mtx);
+        if(late_epoch < epoch) return nullptr;
+        if(late_epoch > epoch) {
+            // Старые сегменты держат их читатели (shared_ptr), файлы удаляются сразу
+            devices.clear();
+            epoch = late_epoch;
+            std::error_code ignored;
+            for(const auto& entry : std::filesystem::directory_iterator(dir, ignored)) {
+                if(entry.is_directory(ignored) && entry.path().filename() != std::to_string(epoch)) {
+                    std::filesystem::remove_all(entry.path(), ignored);
+                }
+            }
+            mkdir(epoch_dir().c_str(), 0755);
+        }
+        auto& log = devices[device];
+        if(!log) {
+            log = std::make_shared<DeviceLog>();
+            log->path = epoch_dir() + "/" + (device.empty() ? "_all" : device);
+            load(*log);
+        }
+        return log;
+    }
+
+    // Записи в сегменты (вызывается под append_mtx). Новые записи не видны читателям до publish
+    void append(DeviceLog& log, const std::vector<char>& bytes, std::vector<SegmentRef>& segments, size_t& last_count) {
+        size_t records = bytes.size() / RECORD_SIZE;
+        size_t done = 0;
+        while(done < records) {
+            if(segments.empty() || last_count == SEGMENT_RECORDS) {
+                if(segments.empty()) mkdir(log.path.c_str(), 0755);
+                std::string path = log.path + "/" + std::to_string(segments.size()) + ".seg";
+                SegmentRef segment = map_segment(path, true);
+                if(!segment) throw std::runtime_error("Cannot create record segment " + path + ": " + strerror(errno));
+                memcpy(segment->header()->magic, MAGIC, sizeof(MAGIC));
+                segment->header()->covered_to = log.covered_to;
+                segments.push_back(segment);
+                last_count = 0;
+            }
+            MappedSegment& segment = *segments.back();
+            size_t n = std::min(records - done, SEGMENT_RECORDS - last_count);
+            memcpy(segment.map + HEADER_SIZE + last_count * RECORD_SIZE, bytes.data() + done * RECORD_SIZE, n * RECORD_SIZE);
+            for(size_t i = (last_count + INDEX_STRIDE - 1) / INDEX_STRIDE * INDEX_STRIDE; i < last_count + n; i += INDEX_STRIDE) {
+                segment.index[i / INDEX_STRIDE] = segment.timestamp(i);
+            }
+            segment.update_zones(last_count, last_count + n);
+            last_count += n;
+            done += n;
+        }
+    }
+
+    void publish(DeviceLog& log, const std::vector<SegmentRef>& segments, size_t last_count, int64_t covered_to) {
+        // Заголовок на диске - после записей: после сбоя процесса count не больше записанного
+        for(size_t i = 0; i < segments.size(); i++) {
+            segments[i]->header()->count = i + 1 < segments.size() ? SEGMENT_RECORDS : last_count;
+        }
+        // covered_to - последним: snapshot читает его раньше count
+        if(!segments.empty()) __atomic_store_n(&segments.back()->header()->covered_to, covered_to, __ATOMIC_RELEASE);
+        std::lock_guard<std::mutex> lock(log.mtx);
+        for(size_t i = 0; i < segments.size(); i++) {
+            segments[i]->count = i + 1 < segments.size() ? SEGMENT_RECORDS : last_count;
+        }
+        log.segments = segments;
+        log.covered_to = covered_to;
+    }
+
+    // Дописывание до watermark кусками по CATCH_UP_SPAN_SEC, каждый кусок сразу виден читателям
+    void catch_up(Database& db, DeviceLog& log, const std::string& device, int64_t watermark) {
+        std::vector<SegmentRef> segments;
+        int64_t covered_to;
+        {
+            std::lock_guard<std::mutex> lock(log.mtx);
+            segments = log.segments;
+            covered_to = log.covered_to;
+        }
+        size_t last_count = segments.empty() ? 0 : segments.back()->count;
+        if(covered_to == NOT_COVERED) {
+            int64_t first_ts = db.get_first_timestamp(device);
+            if(first_ts < 0) return;
+            covered_to = first_ts - 1;
+        }
+        while(covered_to < watermark) {
+            int64_t to = std::min(watermark, covered_to + CATCH_UP_SPAN_SEC);
+            append(log, encode_records(db.get_data(covered_to + 1, to, device)), segments, last_count);
+            covered_to = to;
+            publish(log, segments, last_count, covered_to);
+        }
+    }
+
+public:
+    // Снимок записей устройства: отдаёт части диапазона без блокировок
+    class View {
+        friend class RecordStore;
+        std::vector<std::pair<SegmentRef, size_t>> parts;   // сегмент и число его записей в снимке
+
+    public:
+        int64_t covered_to = NOT_COVERED;
+
+        // Записи [unix_from, unix_to] не новее covered_to - по части на сегмент
+        std::vector<Segment> slices(int64_t unix_from, int64_t unix_to, uint32_t& count) const {
+            std::vector<Segment> result;
+            unix_to = std::min(unix_to, covered_to);
+            if(unix_from > unix_to) return result;
+            for(const auto& [segment, n] : parts) {
+                if(n == 0 || segment->timestamp(0) > unix_to || segment->timestamp(n - 1) < unix_from) continue;
+                size_t from = segment->lower_bound(n, unix_from);
+                size_t to = segment->lower_bound(n, unix_to + 1);
+                if(from >= to) continue;
+                MappedSlice slice{segment, segment->records() + from * RECORD_SIZE, (to - from) * RECORD_SIZE};
+                result.push_back({nullptr, nullptr, slice});
+                count += static_cast<uint32_t>(to - from);
+            }
+            return result;
+        }
+
+        // Записи [unix_from, unix_to] не новее covered_to по зонам: visit(записи, число, зона).
+        // Зона - минимумы и максимумы всей зоны (на краях диапазона в ней и записи вне его),
+        // nullptr - у незаполненной зоны и в снимке другого процесса
+        template<class Visit>
+        void zones(int64_t unix_from, int64_t unix_to, Visit visit) const {
+            unix_to = std::min(unix_to, covered_to);
+            if(unix_from > unix_to) return;
+            for(const auto& [segment, n] : parts) {
+                if(n == 0 || segment->timestamp(0) > unix_to || segment->timestamp(n - 1) < unix_from) continue;
+                size_t from = segment->lower_bound(n, unix_from);
+                size_t to = segment->lower_bound(n, unix_to + 1);
+                while(from < to) {
+                    size_t zone = from / ZONE_RECORDS;
+                    size_t end = std::min(to, (zone + 1) * ZONE_RECORDS);
+                    bool filled = !segment->zones.empty() && (zone + 1) * ZONE_RECORDS <= n;
+                    visit(segment->records() + from * RECORD_SIZE, end - from, filled ? &segment->zones[zone] : nullptr);
+                    from = end;
+                }
+            }
+        }
+    };
+
+    // Каталог берётся одним процессом: второй LOGS с тем же каталогом получает исключение
+    explicit RecordStore(std::string dir) : dir(std::move(dir)) {
+        mkdir(this->dir.c_str(), 0755);
+        std::string lock_path = this->dir + "/lock";
+        lock_fd = open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if(lock_fd < 0) throw std::runtime_error("Cannot open " + lock_path + ": " + strerror(errno));
+        if(flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+            close(lock_fd);
+            throw std::runtime_error(this->dir + " is used by another process");
+        }
+    }
+
+    ~RecordStore() {
+        if(lock_fd >= 0) close(lock_fd);
+    }
+
+    RecordStore(const RecordStore&) = delete;
+    RecordStore& operator=(const RecordStore&) = delete;
+
+    // Снимок устройства, предварительно дописанный до отметки приёма. Если дописывает другой
+    // поток, запрос его не ждёт: не покрытая хранилищем часть диапазона читается из БД.
+    // Устройства без данных и с именем, не годным для пути, не хранятся (covered_to = NOT_COVERED),
+    // запрос с устаревшей late_epoch тоже читает всё из БД
+    View view(Database& db, const std::string& device, const IngestState& state) {
+        View view;
+        if(!device.empty() && !safe_device_name(device)) return view;
+        std::shared_ptr<DeviceLog> log = device_log(device, state.late_epoch);
+        if(!log) return view;
+        {
+            std::unique_lock<std::mutex> append_lock(log->append_mtx, std::try_to_lock);
+            if(append_lock) {
+                try {
+                    catch_up(db, *log, device, state.ts_watermark);
+                } catch(const std::exception& e) {
+                    std::cerr << "Record store: " << e.what() << std::endl;
+                }
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(log->mtx);
+            view.covered_to = log->covered_to;
+            for(const auto& segment : log->segments) view.parts.emplace_back(segment, segment->count);
+        }
+        if(view.covered_to == NOT_COVERED) {
+            std::lock_guard<std::mutex> lock(mtx);
+            auto it = devices.find(device);
+            if(it != devices.end() && it->second == log) devices.erase(it);
+        }
+        return view;
+    }
+
+    // Снимок устройства для другого процесса: сегменты эпохи late_epoch только читаются - без
+    // блокировки каталога, дописывания и индекса (поиск интерполяцией прямо по записям, так
+    // открытие не трогает страниц записей). covered_to каждого сегмента читается раньше его
+    // count, поэтому снимок не обещает записей, которых в нём нет. Недописанный сегмент
+    // (заголовок ещё не записан) и всё после него в снимок не входят
+    static View snapshot(const std::string& dir, const std::string& device, int64_t late_epoch) {
+        View view;
+        if(!device.empty() && !safe_device_name(device)) return view;
+        std::string path = dir + "/" + std::to_string(late_epoch) + "/" + (device.empty() ? "_all" : device);
+        for(size_t n = 0;; n++) {
+            SegmentRef segment = map_segment(path + "/" + std::to_string(n) + ".seg", false, false);
+            if(!segment || memcmp(segment->header()->magic, MAGIC, sizeof(MAGIC)) != 0) break;
+            int64_t covered_to = __atomic_load_n(&segment->header()->covered_to, __ATOMIC_ACQUIRE);
+            uint64_t count = __atomic_load_n(&segment->header()->count, __ATOMIC_RELAXED);
+            if(count > SEGMENT_RECORDS) break;
+            segment->count = count;
+            view.covered_to = covered_to;
+            view.parts.emplace_back(segment, segment->count);
+            if(count < SEGMENT_RECORDS) break;
+        }
+        return view;
+    }
+};
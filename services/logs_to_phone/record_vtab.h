@@ -0,0 +1,370 @@
+#pragma once
+
+// Виртуальная таблица SQLite record_store поверх хранилища записей (record_store.h):
+//   CREATE VIRTUAL TABLE temp.records USING record_store('/path/records');
+//   SELECT timestamp_unix, humidity FROM records
+//   WHERE device = 'farm001' AND timestamp_unix BETWEEN ? AND ?;
+// Колонки - как у sensor_data, device - скрытая (можно и records('farm001')). Условия на
+// время (=, <, <=, >, >=) и device = уходят в xBestIndex: часть диапазона до covered_to
+// читается из отображённых сегментов (snapshot, без блокировки LOGS), хвост новее - из
+// sensor_data того же соединения, только нужные колонки (colUsed). Строки идут по времени,
+// ORDER BY timestamp_unix не требует сортировки. Если нужна колонка device, а условия на неё
+// нет (в хранилище "_all" устройства не записаны), всё читается из sensor_data
+
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include "database.h"
+#include "day_store.h"
+#include "record_store.h"
+
+const int RECORD_TIMESTAMP_COLUMN = 0;
+const int RECORD_DEVICE_COLUMN = 7;
+const int RECORD_COLUMNS = 8;
+const int RECORD_SQL_ONLY = 1 << 8;     // idxNum: мимо хранилища; младшие 8 бит - colUsed
+
+struct RecordTable : sqlite3_vtab {
+    sqlite3* db = nullptr;
+    std::string dir;
+};
+
+struct RecordCursor : sqlite3_vtab_cursor {
+    std::vector<Segment> slices;
+    size_t slice = 0;
+    const char* record = nullptr;               // текущая запись хранилища
+    const char* slice_end = nullptr;
+    sqlite3_stmt* tail = nullptr;               // строки новее covered_to
+    bool in_tail = false;
+    bool eof = true;
+    int tail_column[RECORD_COLUMNS];            // колонка таблицы -> колонка tail, -1 - не выбрана
+    std::string device;
+    bool has_device = false;
+    sqlite3_int64 rowid = 0;
+
+    void reset() {
+        if(tail) sqlite3_finalize(tail);
+        tail = nullptr;
+        slices.clear();
+        slice = 0;
+        record = slice_end = nullptr;
+        in_tail = false;
+        eof = true;
+        rowid = 0;
+    }
+
+    // Следующая строка: записи текущей части, следующая часть, затем хвост из БД
+    int advance() {
+        if(!in_tail) {
+            if(record) record += RecordStore::RECORD_SIZE;
+            while(!record || record >= slice_end) {
+                if(slice == slices.size()) {
+                    in_tail = true;
+                    break;
+                }
+                record = slices[slice].mapped.data;
+                slice_end = record + slices[slice].mapped.length;
+                slice++;
+            }
+            if(!in_tail) return SQLITE_OK;
+        }
+        if(!tail) {
+            eof = true;
+            return SQLITE_OK;
+        }
+        int rc = sqlite3_step(tail);
+        eof = rc != SQLITE_ROW;
+        return rc == SQLITE_ROW || rc == SQLITE_DONE ? SQLITE_OK : rc;
+    }
+};
+
+// Условие на время -> целые границы [from, to]. false - условию не удовлетворяет ни одна строка
+inline bool record_time_bound(char op, sqlite3_value* value, int64_t& from, int64_t& to) {
+    int64_t floor_value, ceil_value;
+    switch(sqlite3_value_numeric_type(value)) {
+        case SQLITE_INTEGER:
+            floor_value = ceil_value = sqlite3_value_int64(value);
+            break;
+        case SQLITE_FLOAT: {
+            double d = sqlite3_value_double(value);
+            const double LIMIT = 9.2e18;
+            if(d > LIMIT) return op == '<' || op == 'l';
+            if(d < -LIMIT) return op == '>' || op == 'g';
+            floor_value = static_cast<int64_t>(std::floor(d));
+            ceil_value = static_cast<int64_t>(std::ceil(d));
+            break;
+        }
+        case SQLITE_NULL:
+            return false;
+        default:
+            // Текст и BLOB больше любого числа
+            return op == '<' || op == 'l';
+    }
+    switch(op) {
+        case '=':
+            if(floor_value != ceil_value) return false;
+            from = std::max(from, floor_value);
+            to = std::min(to, floor_value);
+            break;
+        case '>':
+            if(floor_value == INT64_MAX) return false;
+            from = std::max(from, floor_value + 1);
+            break;
+        case 'g':
+            from = std::max(from, ceil_value);
+            break;
+        case '<':
+            if(ceil_value == INT64_MIN) return false;
+            to = std::min(to, ceil_value - 1);
+            break;
+        case 'l':
+            to = std::min(to, floor_value);
+            break;
+    }
+    return from <= to;
+}
+
+inline bool record_late_epoch(sqlite3* db, int64_t& late_epoch) {
+    sqlite3_stmt* stmt;
+    if(sqlite3_prepare_v2(db, "SELECT value FROM ingest_state WHERE name = 'late_epoch';", -1, &stmt, nullptr) != SQLITE_OK) {
+        return false;
+    }
+    late_epoch = 0;
+    int rc = sqlite3_step(stmt);
+    if(rc == SQLITE_ROW) late_epoch = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_ROW || rc == SQLITE_DONE;
+}
+
+inline int record_connect(sqlite3* db, void*, int argc, const char* const* argv, sqlite3_vtab** vtab, char** err) {
+    if(argc != 4) {
+        *err = sqlite3_mprintf("record_store: expected one argument - the record store directory");
+        return SQLITE_ERROR;
+    }
+    std::string dir = argv[3];
+    if(dir.size() >= 2 && (dir.front() == '\'' || dir.front() == '"') && dir.back() == dir.front()) {
+        dir = dir.substr(1, dir.size() - 2);
+    }
+    int rc = sqlite3_declare_vtab(db,
+        "CREATE TABLE x(timestamp_unix INTEGER, temperature_DHT22 REAL, temperature_DS18B20 REAL, "
+        "humidity REAL, water_level REAL, soil_moisture REAL, light_intensity REAL, device TEXT HIDDEN)");
+    if(rc != SQLITE_OK) return rc;
+    auto table = new RecordTable();
+    table->db = db;
+    table->dir = dir;
+    *vtab = table;
+    return SQLITE_OK;
+}
+
+// Без отдельного xCreate таблица была бы одноимённой (eponymous) - без каталога хранилища
+inline int record_create(sqlite3* db, void* aux, int argc, const char* const* argv, sqlite3_vtab** vtab, char** err) {
+    return record_connect(db, aux, argc, argv, vtab, err);
+}
+
+inline int record_disconnect(sqlite3_vtab* vtab) {
+    delete static_cast<RecordTable*>(vtab);
+    return SQLITE_OK;
+}
+
+// Условия, которые берёт таблица, записываются в idxStr по символу на аргумент xFilter:
+// '=', '>', 'g' (>=), '<', 'l' (<=) - время, 'd' - device =. SQLite их больше не проверяет
+inline int record_best_index(sqlite3_vtab*, sqlite3_index_info* info) {
+    std::string ops;
+    bool device = false, lower = false, upper = false, exact = false;
+    for(int i = 0; i < info->nConstraint; i++) {
+        const auto& constraint = info->aConstraint[i];
+        if(!constraint.usable) continue;
+        char op = 0;
+        if(constraint.iColumn == RECORD_TIMESTAMP_COLUMN) {
+            switch(constraint.op) {
+                case SQLITE_INDEX_CONSTRAINT_EQ: op = '='; exact = true; break;
+                case SQLITE_INDEX_CONSTRAINT_GT: op = '>'; lower = true; break;
+                case SQLITE_INDEX_CONSTRAINT_GE: op = 'g'; lower = true; break;
+                case SQLITE_INDEX_CONSTRAINT_LT: op = '<'; upper = true; break;
+                case SQLITE_INDEX_CONSTRAINT_LE: op = 'l'; upper = true; break;
+            }
+        } else if(constraint.iColumn == RECORD_DEVICE_COLUMN && constraint.op == SQLITE_INDEX_CONSTRAINT_EQ) {
+            op = 'd';
+            device = true;
+        }
+        if(!op) continue;
+        ops += op;
+        info->aConstraintUsage[i].argvIndex = static_cast<int>(ops.size());
+        info->aConstraintUsage[i].omit = 1;
+    }
+
+    double rows = 1e6;
+    if(device) rows /= 10;
+    if(exact) rows /= 1e4;
+    if(lower) rows /= 4;
+    if(upper) rows /= 4;
+    info->estimatedRows = static_cast<sqlite3_int64>(std::max(rows, 1.0));
+    info->estimatedCost = std::max(rows, 1.0);
+
+    bool device_used = (info->colUsed & (1ull << RECORD_DEVICE_COLUMN)) != 0;
+    info->idxNum = static_cast<int>(info->colUsed & 0xFF) | (device_used && !device ? RECORD_SQL_ONLY : 0);
+    if(!ops.empty()) {
+        info->idxStr = sqlite3_mprintf("%s", ops.c_str());
+        info->needToFreeIdxStr = 1;
+    }
+    if(info->nOrderBy == 1 && info->aOrderBy[0].iColumn == RECORD_TIMESTAMP_COLUMN && !info->aOrderBy[0].desc) {
+        info->orderByConsumed = 1;
+    }
+    return SQLITE_OK;
+}
+
+inline int record_open(sqlite3_vtab*, sqlite3_vtab_cursor** cursor) {
+    *cursor = new RecordCursor();
+    return SQLITE_OK;
+}
+
+inline int record_close(sqlite3_vtab_cursor* base) {
+    auto cursor = static_cast<RecordCursor*>(base);
+    cursor->reset();
+    delete cursor;
+    return SQLITE_OK;
+}
+
+// Хвост [from, to] из sensor_data: время и колонки из col_used, по времени
+inline int record_prepare_tail(RecordTable& table, RecordCursor& cursor, int col_used, int64_t from, int64_t to) {
+    std::string sql = "SELECT timestamp_unix";
+    int next = 1;
+    std::fill(cursor.tail_column, cursor.tail_column + RECORD_COLUMNS, -1);
+    cursor.tail_column[RECORD_TIMESTAMP_COLUMN] = 0;
+    for(int f = 0; f < 6; f++) {
+        if(!(col_used & (1 << (f + 1)))) continue;
+        sql += std::string(", ") + FIELD_NAMES[f];
+        cursor.tail_column[f + 1] = next++;
+    }
+    if(col_used & (1 << RECORD_DEVICE_COLUMN)) {
+        sql += ", device";
+        cursor.tail_column[RECORD_DEVICE_COLUMN] = next++;
+    }
+    sql += " FROM sensor_data WHERE timestamp_unix BETWEEN ?1 AND ?2";
+    if(cursor.has_device) sql += " AND device = ?3";
+    sql += " ORDER BY timestamp_unix;";
+
+    int rc = sqlite3_prepare_v2(table.db, sql.c_str(), -1, &cursor.tail, nullptr);
+    if(rc != SQLITE_OK) {
+        sqlite3_free(table.zErrMsg);
+        table.zErrMsg = sqlite3_mprintf("record_store: %s", sqlite3_errmsg(table.db));
+        return rc;
+    }
+    sqlite3_bind_int64(cursor.tail, 1, from);
+    sqlite3_bind_int64(cursor.tail, 2, to);
+    if(cursor.has_device) sqlite3_bind_text(cursor.tail, 3, cursor.device.c_str(), -1, SQLITE_TRANSIENT);
+    return SQLITE_OK;
+}
+
+inline int record_filter(sqlite3_vtab_cursor* base, int idx_num, const char* idx_str, int argc, sqlite3_value** argv) {
+    auto cursor = static_cast<RecordCursor*>(base);
+    auto& table = *static_cast<RecordTable*>(base->pVtab);
+    cursor->reset();
+    cursor->device.clear();
+    cursor->has_device = false;
+
+    int64_t from = INT64_MIN, to = INT64_MAX;
+    bool empty = false;
+    for(int i = 0; i < argc && !empty; i++) {
+        char op = idx_str[i];
+        if(op != 'd') {
+            empty = !record_time_bound(op, argv[i], from, to);
+            continue;
+        }
+        if(sqlite3_value_type(argv[i]) == SQLITE_NULL) {
+            empty = true;
+            continue;
+        }
+        std::string device(reinterpret_cast<const char*>(sqlite3_value_text(argv[i])),
+                           static_cast<size_t>(sqlite3_value_bytes(argv[i])));
+        empty = cursor->has_device && device != cursor->device;
+        cursor->device = device;
+        cursor->has_device = true;
+    }
+    if(empty) return SQLITE_OK;
+
+    try {
+        int64_t tail_from = from;
+        int64_t late_epoch;
+        // device = '' - не "_all": такие строки хранилище не выделяет
+        bool use_store = !(idx_num & RECORD_SQL_ONLY) && !(cursor->has_device && cursor->device.empty());
+        if(use_store && record_late_epoch(table.db, late_epoch)) {
+            RecordStore::View view = RecordStore::snapshot(table.dir, cursor->device, late_epoch);
+            uint32_t count = 0;
+            cursor->slices = view.slices(from, to, count);
+            if(view.covered_to != RecordStore::NOT_COVERED) tail_from = std::max(from, view.covered_to + 1);
+        }
+        if(tail_from <= to) {
+            int rc = record_prepare_tail(table, *cursor, idx_num & 0xFF, tail_from, to);
+            if(rc != SQLITE_OK) return rc;
+        }
+    } catch(const std::exception& e) {
+        sqlite3_free(table.zErrMsg);
+        table.zErrMsg = sqlite3_mprintf("record_store: %s", e.what());
+        return SQLITE_ERROR;
+    }
+    cursor->eof = false;
+    return cursor->advance();
+}
+
+inline int record_next(sqlite3_vtab_cursor* base) {
+    auto cursor = static_cast<RecordCursor*>(base);
+    cursor->rowid++;
+    return cursor->advance();
+}
+
+inline int record_eof(sqlite3_vtab_cursor* base) {
+    return static_cast<RecordCursor*>(base)->eof;
+}
+
+inline int record_column(sqlite3_vtab_cursor* base, sqlite3_context* context, int column) {
+    auto cursor = static_cast<RecordCursor*>(base);
+    if(cursor->in_tail) {
+        int index = cursor->tail_column[column];
+        if(index >= 0) sqlite3_result_value(context, sqlite3_column_value(cursor->tail, index));
+        return SQLITE_OK;
+    }
+    if(column == RECORD_DEVICE_COLUMN) {
+        if(cursor->has_device) sqlite3_result_text(context, cursor->device.c_str(), -1, SQLITE_TRANSIENT);
+        return SQLITE_OK;
+    }
+    uint64_t net;
+    memcpy(&net, cursor->record + sizeof(uint64_t) * column, sizeof(net));
+    uint64_t bits = ntohll(net);
+    if(column == RECORD_TIMESTAMP_COLUMN) {
+        sqlite3_result_int64(context, static_cast<sqlite3_int64>(bits));
+    } else {
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        sqlite3_result_double(context, value);
+    }
+    return SQLITE_OK;
+}
+
+inline int record_rowid(sqlite3_vtab_cursor* base, sqlite3_int64* rowid) {
+    *rowid = static_cast<RecordCursor*>(base)->rowid;
+    return SQLITE_OK;
+}
+
+// Регистрирует модуль в соединении с БД приёма (нужны sensor_data и ingest_state)
+inline int register_record_module(sqlite3* db) {
+    static sqlite3_module module = {
+        0,                      // iVersion
+        record_create,
+        record_connect,         // xConnect
+        record_best_index,
+        record_disconnect,      // xDisconnect
+        record_disconnect,      // xDestroy: файлы хранилища принадлежат LOGS
+        record_open,
+        record_close,
+        record_filter,
+        record_next,
+        record_eof,
+        record_column,
+        record_rowid,
+        nullptr, nullptr, nullptr, nullptr, nullptr, nullptr, nullptr
+    };
+    return sqlite3_create_module_v2(db, "record_store", &module, nullptr, nullptr);
+}
@@ -0,0 +1,170 @@
+#pragma once
+
+// Пул для параллельного выполнения срезов длинного диапазона. У каждого потока пула
+// своё соединение с БД только для чтения (SQLite в WAL читает из разных соединений
+// одновременно). Задачи набора раскладываются по очередям потоков по кругу; поток,
+// у которого очередь опустела, забирает задачи с конца чужой очереди (work stealing),
+// поэтому плотные и пустые срезы не оставляют ядра без работы. Вызывающий поток ждёт
+// весь набор, результаты задачи пишут в свои ячейки - порядок сохраняется.
+// Набор длинной выборки (поток вызывающего внутри ScanScope) перед каждой задачей вызывает
+// pause (set_pause) - так выборка уступает точечным запросам на границах срезов
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include <exception>
+#include "database.h"
+
+class SlicePool {
+public:
+    using Task = std::function<void(Database&)>;
+
+private:
+    struct Batch {
+        std::atomic<size_t> left{0};
+        bool pausable = false;
+        std::mutex mtx;
+        std::condition_variable done;
+        std::exception_ptr error;
+    };
+
+    struct Item {
+        Task task;
+        std::shared_ptr<Batch> batch;
+    };
+
+    struct Queue {
+        std::deque<Item> items;
+        std::mutex mtx;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::unique_ptr<Database>> connections;
+    std::vector<std::thread> threads;
+    std::mutex idle_mtx;
+    std::condition_variable idle_cv;
+    size_t queued = 0;                  // под idle_mtx
+    std::atomic<size_t> next_queue{0};
+    std::function<void()> pause;
+
+    static inline thread_local bool scan_caller = false;
+
+    // Своя очередь - с начала, чужие - с конца
+    bool take(size_t self, Item& out) {
+        for(size_t i = 0; i < queues.size(); i++) {
+            Queue& q = *queues[(self + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(q.mtx);
+            if(q.items.empty()) continue;
+            if(i == 0) {
+                out = std::move(q.items.front());
+                q.items.pop_front();
+            } else {
+                out = std::move(q.items.back());
+                q.items.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    static void execute(Item& item, Database& db) {
+        try {
+            item.task(db);
+        } catch(...) {
+            std::lock_guard<std::mutex> lock(item.batch->mtx);
+            if(!item.batch->error) item.batch->error = std::current_exception();
+        }
+        if(--item.batch->left == 0) {
+            std::lock_guard<std::mutex> lock(item.batch->mtx);
+            item.batch->done.notify_all();
+        }
+    }
+
+    void worker(size_t self) {
+        Database& db = *connections[self];
+        while(true) {
+            {
+                std::unique_lock<std::mutex> lock(idle_mtx);
+                idle_cv.wait(lock, [this] { return queued > 0; });
+                queued--;
+            }
+            // Задача уже учтена: она есть в одной из очередей, пока её не забрали
+            Item item;
+            while(!take(self, item)) std::this_thread::yield();
+            if(item.batch->pausable && pause) pause();
+            execute(item, db);
+        }
+    }
+
+public:
+    // Соединения открываются здесь: если БД недоступна, исключение получит вызывающий
+    explicit SlicePool(unsigned thread_count) {
+        for(unsigned i = 0; i < thread_count; i++) {
+            queues.push_back(std::make_unique<Queue>());
+            connections.push_back(std::make_unique<Database>());
+        }
+        for(unsigned i = 0; i < thread_count; i++) {
+            threads.emplace_back(&SlicePool::worker, this, static_cast<size_t>(i));
+        }
+    }
+
+    ~SlicePool() {
+        // Пул живёт до конца процесса
+        for(auto& t : threads) t.detach();
+    }
+
+    SlicePool(const SlicePool&) = delete;
+    SlicePool& operator=(const SlicePool&) = delete;
+
+    size_t size() const { return threads.size(); }
+
+    // Вызывается до первых задач
+    void set_pause(std::function<void()> hook) {
+        pause = std::move(hook);
+    }
+
+    // Пока жив, наборы этого потока - длинная выборка
+    class ScanScope {
+        bool previous;
+
+    public:
+        explicit ScanScope(bool scan) : previous(scan_caller) { scan_caller = scan; }
+        ~ScanScope() { scan_caller = previous; }
+        ScanScope(const ScanScope&) = delete;
+        ScanScope& operator=(const ScanScope&) = delete;
+    };
+
+    // Выполняет все задачи и возвращается, когда они завершены. Исключение первой
+    // упавшей задачи пробрасывается. Одна задача выполняется сразу на соединении вызывающего
+    void run_all(std::vector<Task> tasks, Database& caller_db) {
+        if(tasks.empty()) return;
+        if(tasks.size() == 1 || threads.empty()) {
+            for(auto& task : tasks) task(caller_db);
+            return;
+        }
+
+        auto batch = std::make_shared<Batch>();
+        batch->left = tasks.size();
+        batch->pausable = scan_caller;
+        size_t start = next_queue.fetch_add(1);
+        for(size_t i = 0; i < tasks.size(); i++) {
+            Queue& q = *queues[(start + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(q.mtx);
+            q.items.push_back({std::move(tasks[i]), batch});
+        }
+        {
+            std::lock_guard<std::mutex> lock(idle_mtx);
+            queued += tasks.size();
+        }
+        idle_cv.notify_all();
+
+        std::unique_lock<std::mutex> lock(batch->mtx);
+        batch->done.wait(lock, [&batch] { return batch->left == 0; });
+        if(batch->error) std::rethrow_exception(batch->error);
+    }
+};
@@ -0,0 +1,86 @@
+#pragma once
+
+// Инкрементальная синхронизация истории для телефона.
+// Телефон присылает либо время, до которого данные у него уже есть (sync_since),
+// либо токен продолжения из прошлого ответа (sync_token). Сервер отдаёт строки
+// в порядке записи в БД страницами по page_size и токен на следующую страницу.
+// Токен непрозрачен для клиента: после прерванной передачи запрос с последним
+// сохранённым токеном продолжает ровно с той же строки, а токен последней
+// страницы - это отметка для следующей фоновой синхронизации (в неё попадут и
+// опоздавшие показания со старым временем, т.к. курсор идёт по id, а не по времени)
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <stdexcept>
+#include "database.h"
+
+const int SYNC_DEFAULT_PAGE_SIZE = 1000;
+const int SYNC_MAX_PAGE_SIZE = 10000;
+
+struct SyncCursor {
+    int64_t last_id = 0;        // последняя отданная строка
+    int64_t since_unix = 0;     // нижняя граница времени из первого запроса
+};
+
+struct SyncPage {
+    std::vector<SensorData> records;
+    std::string next_token;
+    bool has_more = false;
+};
+
+// Подпись токена привязывает его к фильтру устройства и защищает от случайного мусора
+inline uint64_t sync_token_hash(const std::string& device, const SyncCursor& cursor) {
+    std::string identity = device + "|" + std::to_string(cursor.last_id) + "|" + std::to_string(cursor.since_unix);
+    uint64_t hash = 1469598103934665603ull;
+    for(unsigned char c : identity) {
+        hash ^= c;
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+inline std::string encode_sync_token(const std::string& device, const SyncCursor& cursor) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "1.%llx.%llx.%016llx",
+             static_cast<unsigned long long>(cursor.last_id),
+             static_cast<unsigned long long>(cursor.since_unix),
+             static_cast<unsigned long long>(sync_token_hash(device, cursor)));
+    return buf;
+}
+
+inline SyncCursor decode_sync_token(const std::string& device, const std::string& token) {
+    unsigned long long last_id, since_unix, hash;
+    char tail;
+    if(sscanf(token.c_str(), "1.%llx.%llx.%llx%c", &last_id, &since_unix, &hash, &tail) != 3) {
+        throw std::runtime_error("Malformed sync token");
+    }
+    SyncCursor cursor{static_cast<int64_t>(last_id), static_cast<int64_t>(since_unix)};
+    if(sync_token_hash(device, cursor) != hash) {
+        throw std::runtime_error("Sync token does not match request");
+    }
+    return cursor;
+}
+
+inline SyncCursor start_sync(Database& db, int64_t since_unix) {
+    return SyncCursor{db.sync_start_id(since_unix), since_unix};
+}
+
+inline SyncPage fetch_sync_page(Database& db, const std::string& device, SyncCursor cursor, int page_size) {
+    if(page_size <= 0) page_size = SYNC_DEFAULT_PAGE_SIZE;
+    if(page_size > SYNC_MAX_PAGE_SIZE) page_size = SYNC_MAX_PAGE_SIZE;
+
+    SyncPage page;
+    std::vector<int64_t> ids;
+    // Одна лишняя строка показывает, есть ли следующая страница
+    page.records = db.get_rows_after(cursor.last_id, cursor.since_unix, device, page_size + 1, ids);
+    if(static_cast<int>(page.records.size()) > page_size) {
+        page.records.resize(page_size);
+        ids.resize(page_size);
+        page.has_more = true;
+    }
+    if(!ids.empty()) cursor.last_id = ids.back();
+    page.next_token = encode_sync_token(device, cursor);
+    return page;
+}
@@ -0,0 +1,148 @@
+#pragma once
+
+// Минимальная обёртка io_uring на системных вызовах (liburing на сервере нет).
+// Кольца SQ/CQ отображаются в память один раз; SQE готовятся без системных
+// вызовов, а submit() отправляет всё накопленное одним io_uring_enter
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+
+class IoUring {
+    int ring_fd = -1;
+    io_uring_params params{};
+
+    void* sq_ptr = nullptr;
+    void* cq_ptr = nullptr;
+    size_t sq_size = 0;
+    size_t cq_size = 0;
+    io_uring_sqe* sqes = nullptr;
+    size_t sqes_size = 0;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+
+    unsigned local_tail = 0;    // подготовленные, но ещё не опубликованные в кольце SQE
+    unsigned to_submit = 0;
+
+    static unsigned load_acquire(const unsigned* p) {
+        return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+    }
+
+    static void store_release(unsigned* p, unsigned v) {
+        __atomic_store_n(p, v, __ATOMIC_RELEASE);
+    }
+
+    void flush_sq() {
+        store_release(sq_tail, local_tail);
+    }
+
+public:
+    explicit IoUring(unsigned entries) {
+        ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if(ring_fd < 0) throw std::runtime_error(std::string("io_uring_setup: ") + strerror(errno));
+
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if(single_mmap) sq_size = cq_size = std::max(sq_size, cq_size);
+
+        sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if(sq_ptr == MAP_FAILED) {
+            close(ring_fd);
+            throw std::runtime_error("io_uring: cannot map SQ ring");
+        }
+        cq_ptr = single_mmap ? sq_ptr
+                             : mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                                ring_fd, IORING_OFF_SQES));
+        if(cq_ptr == MAP_FAILED || sqes == MAP_FAILED) {
+            close(ring_fd);
+            throw std::runtime_error("io_uring: cannot map rings");
+        }
+
+        char* sq = static_cast<char*>(sq_ptr);
+        char* cq = static_cast<char*>(cq_ptr);
+        sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        local_tail = *sq_tail;
+    }
+
+    ~IoUring() {
+        munmap(sqes, sqes_size);
+        if(cq_ptr != sq_ptr) munmap(cq_ptr, cq_size);
+        munmap(sq_ptr, sq_size);
+        close(ring_fd);
+    }
+
+    IoUring(const IoUring&) = delete;
+    IoUring& operator=(const IoUring&) = delete;
+
+    // Буферы для READ_FIXED / WRITE_FIXED: страницы закрепляются один раз, а не на каждой операции
+    bool register_buffers(const iovec* buffers, unsigned count) {
+        return syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS, buffers, count) == 0;
+    }
+
+    // Свободный SQE; если кольцо заполнено, накопленное отправляется в ядро
+    io_uring_sqe* get_sqe() {
+        if(local_tail - load_acquire(sq_head) >= params.sq_entries) {
+            submit(0);
+            if(local_tail - load_acquire(sq_head) >= params.sq_entries) return nullptr;
+        }
+        unsigned index = local_tail & *sq_mask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sq_array[index] = index;
+        local_tail++;
+        to_submit++;
+        return sqe;
+    }
+
+    // Один системный вызов: отправка всех подготовленных SQE и ожидание wait_nr завершений
+    int submit(unsigned wait_nr) {
+        flush_sq();
+        unsigned flags = wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0;
+        int ret;
+        do {
+            ret = static_cast<int>(syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr, flags, nullptr, 0));
+        } while(ret < 0 && errno == EINTR);
+        if(ret >= 0) to_submit -= std::min<unsigned>(to_submit, static_cast<unsigned>(ret));
+        return ret;
+    }
+
+    // Обход готовых завершений без системных вызовов. Слот освобождается до вызова fn:
+    // обработчик может готовить новые SQE, и их завершениям должно хватить места
+    template<class Fn>
+    unsigned for_each_cqe(Fn fn) {
+        unsigned head = *cq_head;
+        unsigned tail = load_acquire(cq_tail);
+        unsigned seen = 0;
+        for(; head != tail; seen++) {
+            io_uring_cqe cqe = cqes[head & *cq_mask];
+            store_release(cq_head, ++head);
+            fn(cqe);
+        }
+        return seen;
+    }
+};
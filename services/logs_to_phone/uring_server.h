@@ -0,0 +1,583 @@
+#pragma once
+
+// Бэкенд порта 1488 на io_uring (включается флагом --io-uring).
+// Один поток ведёт все соединения: accept, чтение строки запроса, gather-отправка
+// ответа, закрытие и дозапись лог-файла - это операции одного кольца, и всё, что
+// подготовлено за проход по завершениям, уходит в ядро одним io_uring_enter.
+// Строки запросов читаются в заранее зарегистрированные буферы (READ_FIXED).
+// Запросы к SQLite блокируют, поэтому выполняются пулом рабочих потоков; готовый
+// ответ возвращается в кольцо через eventfd. Протокол тот же, что у handle_client.
+// Без рабочих потоков (worker_count = 0) обработчик вызывается прямо в цикле кольца -
+// так работают шарды --shards, у каждого свой сокет SO_REUSEPORT и своё соединение с БД.
+// Запечатанные дни (DayStore) идут из файла в сокет через канал соединения: SPLICE
+// файл -> pipe и pipe -> сокет, данные не проходят через память процесса.
+// Очередь запросов к рабочим потокам ограничена (set_overload): сверх предела кольцо сразу
+// отвечает обработчиком перегрузки, не дожидаясь потоков.
+// Обработчик может отдавать ответ частями (PartSink, пакетный запрос): каждая часть
+// дописывается к отправке соединения, соединение закрывается после последней
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <iostream>
+#include <cstring>
+#include <cstdint>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include "day_store.h"
+#include "uring.h"
+
+// Ответ на строку запроса: части для отправки и строка для лог-файла.
+// more - ответ продолжается, следующие части придут отдельно
+struct LineResponse {
+    std::vector<Segment> segments;
+    std::string log_line;
+    bool more = false;
+};
+
+// Часть ответа, готовая раньше остальных: уходит клиенту сразу
+using PartSink = std::function<void(std::vector<Segment>)>;
+using LineHandler = std::function<LineResponse(const std::string& request, const std::string& client_ip,
+                                               const PartSink& emit)>;
+
+class UringServer {
+public:
+    static constexpr unsigned RING_ENTRIES = 4096;
+    static constexpr size_t REQUEST_BUFFER_SIZE = 4096;
+    static constexpr unsigned FIXED_BUFFERS = 1024;
+    static constexpr unsigned ACCEPT_SLOTS = 32;     // одновременно ожидающих accept: всплески подключений
+    static constexpr int LISTEN_BACKLOG = 1024;
+    static constexpr int PIPE_SIZE = 256 * 1024;    // ёмкость канала splice, если ядро разрешит
+
+private:
+    enum Op : uint64_t { ACCEPT = 1, READ, SEND, CLOSE, LOG_WRITE, WAKE, SPLICE_IN, SPLICE_OUT };
+
+    struct Connection {
+        int fd;
+        std::string ip;
+        int buffer = -1;                // номер зарегистрированного буфера, -1 - обычный буфер
+        std::vector<char> heap_buffer;
+        size_t received = 0;
+        LineResponse response;
+        size_t segment_pos = 0;         // следующая неотправленная часть ответа
+        bool sending = false;           // идёт отправка, новые части подхватит send_next
+        bool complete = false;          // получена последняя часть ответа
+        std::vector<iovec> iov;
+        size_t iov_pos = 0;
+        msghdr msg{};
+        int pipe_fds[2] = {-1, -1};
+        size_t pipe_size = 0;
+        uint64_t file_offset = 0;
+        uint64_t file_left = 0;
+        size_t pipe_bytes = 0;          // прочитано из файла в канал, но ещё не ушло в сокет
+    };
+
+    struct AcceptSlot {
+        sockaddr_in addr;
+        socklen_t addr_len;
+    };
+
+    struct Job {
+        uint64_t conn_id;
+        std::string request;
+        std::string ip;
+    };
+
+    IoUring ring;
+    LineHandler handler;
+    LineHandler overload_handler;
+    size_t max_queued_jobs = SIZE_MAX;
+    int listen_fd = -1;
+    int log_fd;
+    int wake_fd = -1;
+    uint64_t wake_value = 0;
+
+    std::vector<char> fixed_memory;
+    std::vector<int> free_buffers;
+    bool fixed_registered = false;
+
+    AcceptSlot accept_slots[ACCEPT_SLOTS];
+    std::map<uint64_t, std::unique_ptr<Connection>> connections;
+    uint64_t next_conn_id = 1;
+
+    // Лог-файл дописывается одной операцией за раз, строки копятся между ними
+    std::string log_pending;
+    std::string log_inflight;
+    size_t log_written = 0;
+
+    std::vector<std::thread> workers;
+    std::deque<Job> jobs;
+    std::mutex jobs_mutex;
+    std::condition_variable jobs_cv;
+    std::deque<std::pair<uint64_t, LineResponse>> results;
+    std::mutex results_mutex;
+
+    static uint64_t tag(uint64_t id, Op op) {
+        return (id << 8) | op;
+    }
+
+    io_uring_sqe* sqe_or_throw() {
+        io_uring_sqe* sqe = ring.get_sqe();
+        if(!sqe) throw std::runtime_error("io_uring: submission queue is full");
+        return sqe;
+    }
+
+    char* request_buffer(Connection& c) {
+        if(c.buffer >= 0) return fixed_memory.data() + static_cast<size_t>(c.buffer) * REQUEST_BUFFER_SIZE;
+        return c.heap_buffer.data();
+    }
+
+    void release_buffer(Connection& c) {
+        if(c.buffer >= 0) free_buffers.push_back(c.buffer);
+        c.buffer = -1;
+        c.heap_buffer.clear();
+        c.heap_buffer.shrink_to_fit();
+    }
+
+    void arm_accept(unsigned slot) {
+        AcceptSlot& s = accept_slots[slot];
+        s.addr_len = sizeof(s.addr);
+        io_uring_sqe* sqe = sqe_or_throw();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listen_fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&s.addr);
+        sqe->addr2 = reinterpret_cast<uint64_t>(&s.addr_len);
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = tag(slot, ACCEPT);
+    }
+
+    void arm_wake() {
+        io_uring_sqe* sqe = sqe_or_throw();
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = wake_fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&wake_value);
+        sqe->len = sizeof(wake_value);
+        sqe->user_data = tag(0, WAKE);
+    }
+
+    void arm_read(uint64_t id, Connection& c) {
+        io_uring_sqe* sqe = sqe_or_throw();
+        sqe->fd = c.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(request_buffer(c) + c.received);
+        sqe->len = static_cast<uint32_t>(REQUEST_BUFFER_SIZE - c.received);
+        if(c.buffer >= 0) {
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->buf_index = static_cast<uint16_t>(c.buffer);
+        } else {
+            sqe->opcode = IORING_OP_RECV;
+        }
+        sqe->user_data = tag(id, READ);
+    }
+
+    void arm_send(uint64_t id, Connection& c) {
+        c.msg = msghdr{};
+        c.msg.msg_iov = c.iov.data() + c.iov_pos;
+        c.msg.msg_iovlen = c.iov.size() - c.iov_pos;
+        io_uring_sqe* sqe = sqe_or_throw();
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = c.fd;
+        sqe->addr = reinterpret_cast<uint64_t>(&c.msg);
+        sqe->msg_flags = MSG_NOSIGNAL;
+        sqe->user_data = tag(id, SEND);
+    }
+
+    const SealedFile& current_file(const Connection& c) {
+        return c.response.segments[c.segment_pos].day->binary;
+    }
+
+    void arm_splice_in(uint64_t id, Connection& c) {
+        io_uring_sqe* sqe = sqe_or_throw();
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->splice_fd_in = current_file(c).fd;
+        sqe->splice_off_in = c.file_offset;
+        sqe->fd = c.pipe_fds[1];
+        sqe->off = static_cast<uint64_t>(-1);
+        sqe->len = static_cast<uint32_t>(std::min<uint64_t>(c.file_left, c.pipe_size));
+        sqe->splice_flags = SPLICE_F_MOVE;
+        sqe->user_data = tag(id, SPLICE_IN);
+    }
+
+    void arm_splice_out(uint64_t id, Connection& c) {
+        io_uring_sqe* sqe = sqe_or_throw();
+        sqe->opcode = IORING_OP_SPLICE;
+        sqe->splice_fd_in = c.pipe_fds[0];
+        sqe->splice_off_in = static_cast<uint64_t>(-1);
+        sqe->fd = c.fd;
+        sqe->off = static_cast<uint64_t>(-1);
+        sqe->len = static_cast<uint32_t>(c.pipe_bytes);
+        sqe->splice_flags = SPLICE_F_MOVE;
+        sqe->user_data = tag(id, SPLICE_OUT);
+    }
+
+    // Следующая часть ответа: подряд идущие куски в памяти - одним SENDMSG, запечатанный день - splice
+    void send_next(uint64_t id, Connection& c) {
+        const auto& segments = c.response.segments;
+        c.iov.clear();
+        c.iov_pos = 0;
+        while(c.segment_pos < segments.size() && segments[c.segment_pos].in_memory()) {
+            const Segment& segment = segments[c.segment_pos++];
+            if(segment.size() > 0) c.iov.push_back({const_cast<char*>(segment.data()), segment.size()});
+        }
+        if(!c.iov.empty()) {
+            arm_send(id, c);
+            return;
+        }
+        if(c.segment_pos == segments.size()) {
+            if(c.complete) close_connection(id);
+            else c.sending = false;
+            return;
+        }
+        if(c.pipe_fds[0] < 0) {
+            if(pipe2(c.pipe_fds, O_CLOEXEC) != 0) {
+                std::cerr << "io_uring: pipe2 failed: " << strerror(errno) << std::endl;
+                close_connection(id);
+                return;
+            }
+            fcntl(c.pipe_fds[1], F_SETPIPE_SZ, PIPE_SIZE);
+            int size = fcntl(c.pipe_fds[1], F_GETPIPE_SZ);
+            c.pipe_size = size > 0 ? static_cast<size_t>(size) : 65536;
+        }
+        c.file_offset = current_file(c).offset;
+        c.file_left = current_file(c).length;
+        c.pipe_bytes = 0;
+        if(c.file_left == 0) {
+            c.segment_pos++;
+            send_next(id, c);
+            return;
+        }
+        arm_splice_in(id, c);
+    }
+
+    void close_connection(uint64_t id) {
+        auto it = connections.find(id);
+        if(it == connections.end()) return;
+        release_buffer(*it->second);
+        for(int& fd : it->second->pipe_fds) {
+            if(fd >= 0) close(fd);
+            fd = -1;
+        }
+        io_uring_sqe* sqe = sqe_or_throw();
+        sqe->opcode = IORING_OP_CLOSE;
+        sqe->fd = it->second->fd;
+        sqe->user_data = tag(id, CLOSE);
+        connections.erase(it);
+    }
+
+    void flush_log() {
+        if(!log_inflight.empty() || log_pending.empty() || log_fd < 0) return;
+        log_inflight.swap(log_pending);
+        log_written = 0;
+        arm_log_write();
+    }
+
+    void arm_log_write() {
+        io_uring_sqe* sqe = sqe_or_throw();
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->fd = log_fd;
+        sqe->addr = reinterpret_cast<uint64_t>(log_inflight.data() + log_written);
+        sqe->len = static_cast<uint32_t>(log_inflight.size() - log_written);
+        sqe->off = static_cast<uint64_t>(-1);     // текущая позиция файла (O_APPEND)
+        sqe->user_data = tag(0, LOG_WRITE);
+    }
+
+    void on_accept(unsigned slot, int res) {
+        if(res < 0) {
+            std::cerr << "io_uring accept error: " << strerror(-res) << std::endl;
+            arm_accept(slot);
+            return;
+        }
+        auto c = std::make_unique<Connection>();
+        c->fd = res;
+        char ip[INET_ADDRSTRLEN];
+        c->ip = inet_ntop(AF_INET, &accept_slots[slot].addr.sin_addr, ip, sizeof(ip)) ? ip : "unknown";
+        if(fixed_registered && !free_buffers.empty()) {
+            c->buffer = free_buffers.back();
+            free_buffers.pop_back();
+        } else {
+            c->heap_buffer.resize(REQUEST_BUFFER_SIZE);
+        }
+        uint64_t id = next_conn_id++;
+        arm_read(id, *c);
+        connections.emplace(id, std::move(c));
+        // Адрес слота прочитан - можно снова ждать подключения
+        arm_accept(slot);
+    }
+
+    void on_read(uint64_t id, int res) {
+        auto it = connections.find(id);
+        if(it == connections.end()) return;
+        Connection& c = *it->second;
+        if(res <= 0) {
+            close_connection(id);
+            return;
+        }
+        size_t scanned = c.received;
+        c.received += res;
+        char* buf = request_buffer(c);
+        void* newline = memchr(buf + scanned, '\n', c.received - scanned);
+        if(!newline && c.received < REQUEST_BUFFER_SIZE) {
+            arm_read(id, c);
+            return;
+        }
+        // Строка без перевода в конце буфера обрабатывается как есть: некорректный запрос
+        size_t len = newline ? static_cast<char*>(newline) - buf : c.received;
+        Job job{id, std::string(buf, len), c.ip};
+        release_buffer(c);
+        if(workers.empty()) {
+            start_send(id, call_handler(job));
+            return;
+        }
+        bool queued = false;
+        {
+            std::lock_guard<std::mutex> lock(jobs_mutex);
+            if(jobs.size() < max_queued_jobs || !overload_handler) {
+                jobs.push_back(std::move(job));
+                queued = true;
+            }
+        }
+        if(queued) jobs_cv.notify_one();
+        else start_send(id, call_handler(job, overload_handler));
+    }
+
+    LineResponse call_handler(const Job& job) {
+        return call_handler(job, handler);
+    }
+
+    // Части из рабочего потока идут в кольцо через очередь результатов - по порядку, перед
+    // последней; в цикле кольца (шарды) ставятся в отправку сразу
+    LineResponse call_handler(const Job& job, const LineHandler& h) {
+        uint64_t id = job.conn_id;
+        PartSink emit = [this, id](std::vector<Segment> segments) {
+            LineResponse part{std::move(segments), "", true};
+            if(!workers.empty()) {
+                post_result(id, std::move(part));
+                return;
+            }
+            start_send(id, std::move(part));
+            ring.submit(0);
+        };
+        try {
+            return h(job.request, job.ip, emit);
+        } catch(const std::exception& e) {
+            std::cerr << "Request from " << job.ip << " failed: " << e.what() << std::endl;
+        }
+        return {};
+    }
+
+    void start_send(uint64_t id, LineResponse response) {
+        auto it = connections.find(id);
+        if(it == connections.end()) return;
+        Connection& c = *it->second;
+        log_pending += response.log_line;
+        for(auto& segment : response.segments) c.response.segments.push_back(std::move(segment));
+        c.complete = !response.more;
+        if(c.sending) return;
+        c.sending = true;
+        send_next(id, c);
+    }
+
+    void post_result(uint64_t id, LineResponse response) {
+        bool first;
+        {
+            std::lock_guard<std::mutex> lock(results_mutex);
+            first = results.empty();
+            results.emplace_back(id, std::move(response));
+        }
+        // Пока кольцо не забрало прошлые ответы, будить его ещё раз не нужно
+        if(first) {
+            uint64_t one = 1;
+            if(write(wake_fd, &one, sizeof(one)) < 0) std::cerr << "eventfd write error" << std::endl;
+        }
+    }
+
+    void on_wake() {
+        arm_wake();
+        std::deque<std::pair<uint64_t, LineResponse>> ready;
+        {
+            std::lock_guard<std::mutex> lock(results_mutex);
+            ready.swap(results);
+        }
+        for(auto& [id, response] : ready) start_send(id, std::move(response));
+    }
+
+    void on_send(uint64_t id, int res) {
+        auto it = connections.find(id);
+        if(it == connections.end()) return;
+        Connection& c = *it->second;
+        if(res < 0) {
+            close_connection(id);
+            return;
+        }
+        // Частичная отправка: сдвигаем iovec на отправленное и продолжаем
+        size_t sent = static_cast<size_t>(res);
+        while(c.iov_pos < c.iov.size() && sent >= c.iov[c.iov_pos].iov_len) {
+            sent -= c.iov[c.iov_pos].iov_len;
+            c.iov_pos++;
+        }
+        if(c.iov_pos == c.iov.size()) {
+            send_next(id, c);
+            return;
+        }
+        c.iov[c.iov_pos].iov_base = static_cast<char*>(c.iov[c.iov_pos].iov_base) + sent;
+        c.iov[c.iov_pos].iov_len -= sent;
+        arm_send(id, c);
+    }
+
+    void on_splice_in(uint64_t id, int res) {
+        auto it = connections.find(id);
+        if(it == connections.end()) return;
+        Connection& c = *it->second;
+        if(res <= 0) {
+            if(res < 0) std::cerr << "io_uring splice error: " << strerror(-res) << std::endl;
+            close_connection(id);
+            return;
+        }
+        c.file_offset += static_cast<uint64_t>(res);
+        c.file_left -= static_cast<uint64_t>(res);
+        c.pipe_bytes = static_cast<size_t>(res);
+        arm_splice_out(id, c);
+    }
+
+    void on_splice_out(uint64_t id, int res) {
+        auto it = connections.find(id);
+        if(it == connections.end()) return;
+        Connection& c = *it->second;
+        if(res <= 0) {
+            close_connection(id);
+            return;
+        }
+        c.pipe_bytes -= static_cast<size_t>(res);
+        if(c.pipe_bytes > 0) {
+            arm_splice_out(id, c);
+        } else if(c.file_left > 0) {
+            arm_splice_in(id, c);
+        } else {
+            c.segment_pos++;
+            send_next(id, c);
+        }
+    }
+
+    void on_log_write(int res) {
+        if(res < 0) {
+            std::cerr << "io_uring log write error: " << strerror(-res) << std::endl;
+            log_inflight.clear();
+            return;
+        }
+        log_written += static_cast<size_t>(res);
+        if(log_written < log_inflight.size() && res > 0) {
+            arm_log_write();
+            return;
+        }
+        log_inflight.clear();
+    }
+
+    void dispatch(const io_uring_cqe& cqe) {
+        uint64_t id = cqe.user_data >> 8;
+        switch(static_cast<Op>(cqe.user_data & 0xFF)) {
+            case ACCEPT: on_accept(static_cast<unsigned>(id), cqe.res); break;
+            case READ: on_read(id, cqe.res); break;
+            case SEND: on_send(id, cqe.res); break;
+            case LOG_WRITE: on_log_write(cqe.res); break;
+            case WAKE: on_wake(); break;
+            case SPLICE_IN: on_splice_in(id, cqe.res); break;
+            case SPLICE_OUT: on_splice_out(id, cqe.res); break;
+            case CLOSE: break;
+        }
+    }
+
+    void worker_loop() {
+        while(true) {
+            Job job;
+            {
+                std::unique_lock<std::mutex> lock(jobs_mutex);
+                jobs_cv.wait(lock, [this] { return !jobs.empty(); });
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            post_result(job.conn_id, call_handler(job));
+        }
+    }
+
+public:
+    // Бросает исключение, если io_uring недоступен (старое ядро, seccomp) - тогда остаётся обычный бэкенд.
+    // reuse_port: несколько серверов слушают один порт, подключения распределяет ядро
+    UringServer(unsigned short port, const std::string& log_path, LineHandler handler, unsigned worker_count,
+                bool reuse_port = false)
+        : ring(RING_ENTRIES), handler(std::move(handler)) {
+        listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if(reuse_port && setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+            throw std::runtime_error(std::string("io_uring backend: SO_REUSEPORT: ") + strerror(errno));
+        }
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons(port);
+        if(listen_fd < 0 || bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+           listen(listen_fd, LISTEN_BACKLOG) != 0) {
+            throw std::runtime_error(std::string("io_uring backend: cannot listen: ") + strerror(errno));
+        }
+
+        log_fd = open(log_path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if(log_fd < 0) std::cerr << "Cannot open log file " << log_path << std::endl;
+
+        wake_fd = eventfd(0, EFD_CLOEXEC);
+        if(wake_fd < 0) throw std::runtime_error("io_uring backend: eventfd failed");
+
+        // Буферы запросов закрепляются в ядре один раз; если лимит memlock не позволяет - обычные
+        fixed_memory.resize(static_cast<size_t>(FIXED_BUFFERS) * REQUEST_BUFFER_SIZE);
+        std::vector<iovec> iov(FIXED_BUFFERS);
+        for(unsigned i = 0; i < FIXED_BUFFERS; i++) {
+            iov[i] = {fixed_memory.data() + static_cast<size_t>(i) * REQUEST_BUFFER_SIZE, REQUEST_BUFFER_SIZE};
+            free_buffers.push_back(static_cast<int>(FIXED_BUFFERS - 1 - i));
+        }
+        fixed_registered = ring.register_buffers(iov.data(), FIXED_BUFFERS);
+        if(!fixed_registered) {
+            std::cerr << "io_uring: buffers not registered (" << strerror(errno) << "), using plain recv" << std::endl;
+            fixed_memory.clear();
+            free_buffers.clear();
+        }
+
+        for(unsigned i = 0; i < worker_count; i++) {
+            workers.emplace_back(&UringServer::worker_loop, this);
+        }
+    }
+
+    ~UringServer() {
+        // Цикл run() бесконечен: деструктор вызывается только при ошибке запуска
+        for(auto& w : workers) w.detach();
+        if(wake_fd >= 0) close(wake_fd);
+        if(log_fd >= 0) close(log_fd);
+        if(listen_fd >= 0) close(listen_fd);
+    }
+
+    // Больше max_jobs запросов ждут рабочих потоков - новый получает ответ busy прямо в кольце.
+    // busy вызывается в потоке кольца и не должен блокировать
+    void set_overload(size_t max_jobs, LineHandler busy) {
+        max_queued_jobs = max_jobs;
+        overload_handler = std::move(busy);
+    }
+
+    void run() {
+        for(unsigned i = 0; i < ACCEPT_SLOTS; i++) arm_accept(i);
+        arm_wake();
+        while(true) {
+            flush_log();
+            if(ring.submit(1) < 0 && errno != EBUSY) {
+                throw std::runtime_error(std::string("io_uring_enter: ") + strerror(errno));
+            }
+            ring.for_each_cqe([this](const io_uring_cqe& cqe) { dispatch(cqe); });
+        }
+    }
+};
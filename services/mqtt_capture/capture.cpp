@@ -0,0 +1,407 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <algorithm>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <csignal>
+#include <cstring>
+#include <cstdint>
+#include <unistd.h>
+#include <zlib.h>
+#include <mqtt/async_client.h>
+
+// Запись MQTT-трафика ферм в файл и воспроизведение на локальный брокер
+// с исходной формой промежутков между сообщениями (1x, 10x, ... или без пауз).
+//
+// Формат файла (gzip): заголовок "IOPCAP01" | start_unix_ms i64, затем записи
+//   delta_us varint | flags u8 (qos | retained << 2) | topic_ref varint [| topic_len varint | topic]
+//   | payload_len varint | payload
+// delta_us - от предыдущей записи. topic_ref = 0 - новый топик (следом строка, получает следующий номер),
+// иначе номер уже встречавшегося топика + 1: повторяющиеся топики занимают 1 байт
+
+const std::string DEFAULT_BROKER = "tcp://localhost:1883";
+const std::vector<std::string> DEFAULT_TOPICS = {"/+/data", "/+/log", "/+/config", "/+/command"};
+// Команды и конфигурации воспроизводятся только по --topics: иначе насосы и лампы живых
+// ферм получили бы записанные команды
+const std::vector<std::string> DEFAULT_REPLAY_TOPICS = {"/+/data", "/+/log"};
+const char CAPTURE_MAGIC[8] = {'I', 'O', 'P', 'C', 'A', 'P', '0', '1'};
+// Сжатый поток сбрасывается на диск раз в секунду: оборванная запись читается до последнего сброса
+const int64_t CAPTURE_FLUSH_INTERVAL_MS = 1000;
+// Сколько публикаций QoS>0 может ждать подтверждения брокера при воспроизведении
+const size_t REPLAY_MAX_INFLIGHT = 1000;
+
+std::atomic<bool> stop_requested{false};
+
+void on_signal(int) {
+    stop_requested = true;
+}
+
+int64_t now_us() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+int64_t unix_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+class CaptureWriter {
+    gzFile file;
+    std::map<std::string, uint64_t> topic_ids;
+    std::vector<unsigned char> record;
+    int64_t last_us;
+    int64_t last_flush_us;
+    uint64_t messages = 0;
+
+    void put_varint(uint64_t value) {
+        while (value >= 0x80) {
+            record.push_back(static_cast<unsigned char>(value | 0x80));
+            value >>= 7;
+        }
+        record.push_back(static_cast<unsigned char>(value));
+    }
+
+    void put_bytes(const std::string& s) {
+        put_varint(s.size());
+        record.insert(record.end(), s.begin(), s.end());
+    }
+
+public:
+    explicit CaptureWriter(const std::string& path) {
+        file = gzopen(path.c_str(), "wb6");
+        if (!file) throw std::runtime_error("Cannot create " + path);
+        int64_t start_ms = unix_ms();
+        gzwrite(file, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+        gzwrite(file, &start_ms, sizeof(start_ms));
+        last_us = last_flush_us = now_us();
+    }
+
+    ~CaptureWriter() {
+        gzclose(file);
+    }
+
+    void write(const std::string& topic, const std::string& payload, int qos, bool retained) {
+        int64_t t = now_us();
+        record.clear();
+        put_varint(static_cast<uint64_t>(t - last_us));
+        record.push_back(static_cast<unsigned char>((qos & 3) | (retained ? 4 : 0)));
+
+        auto it = topic_ids.find(topic);
+        if (it == topic_ids.end()) {
+            put_varint(0);
+            put_bytes(topic);
+            topic_ids.emplace(topic, topic_ids.size());
+        } else {
+            put_varint(it->second + 1);
+        }
+        put_bytes(payload);
+
+        if (gzwrite(file, record.data(), static_cast<unsigned>(record.size())) == 0) {
+            throw std::runtime_error("Capture write error");
+        }
+        last_us = t;
+        messages++;
+        if (t - last_flush_us >= CAPTURE_FLUSH_INTERVAL_MS * 1000) {
+            gzflush(file, Z_SYNC_FLUSH);
+            last_flush_us = t;
+        }
+    }
+
+    uint64_t count() const { return messages; }
+};
+
+struct CapturedMessage {
+    int64_t offset_us;      // от начала записи
+    int qos;
+    bool retained;
+    std::string topic;
+    std::string payload;
+};
+
+class CaptureReader {
+    gzFile file;
+    std::vector<std::string> topics;
+    int64_t offset_us = 0;
+    int64_t start_ms = 0;
+
+    bool get_byte(unsigned char& b) {
+        int c = gzgetc(file);
+        if (c < 0) return false;
+        b = static_cast<unsigned char>(c);
+        return true;
+    }
+
+    bool get_varint(uint64_t& value) {
+        value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            unsigned char b;
+            if (!get_byte(b)) return false;
+            value |= static_cast<uint64_t>(b & 0x7F) << shift;
+            if (!(b & 0x80)) return true;
+        }
+        return false;
+    }
+
+    bool get_bytes(std::string& s) {
+        uint64_t len;
+        if (!get_varint(len)) return false;
+        s.resize(len);
+        return len == 0 || gzread(file, &s[0], static_cast<unsigned>(len)) == static_cast<int>(len);
+    }
+
+public:
+    explicit CaptureReader(const std::string& path) {
+        file = gzopen(path.c_str(), "rb");
+        if (!file) throw std::runtime_error("Cannot open " + path);
+        gzbuffer(file, 256 * 1024);
+        char magic[sizeof(CAPTURE_MAGIC)];
+        if (gzread(file, magic, sizeof(magic)) != sizeof(magic) ||
+            memcmp(magic, CAPTURE_MAGIC, sizeof(magic)) != 0 ||
+            gzread(file, &start_ms, sizeof(start_ms)) != sizeof(start_ms)) {
+            gzclose(file);
+            throw std::runtime_error(path + " is not a capture file");
+        }
+    }
+
+    ~CaptureReader() {
+        gzclose(file);
+    }
+
+    int64_t started_unix_ms() const { return start_ms; }
+
+    // false - конец файла или оборванная запись в хвосте
+    bool next(CapturedMessage& msg) {
+        uint64_t delta, ref;
+        unsigned char flags;
+        if (!get_varint(delta) || !get_byte(flags) || !get_varint(ref)) return false;
+        if (ref == 0) {
+            std::string topic;
+            if (!get_bytes(topic)) return false;
+            topics.push_back(topic);
+            msg.topic = topic;
+        } else {
+            if (ref > topics.size()) return false;
+            msg.topic = topics[ref - 1];
+        }
+        if (!get_bytes(msg.payload)) return false;
+        offset_us += static_cast<int64_t>(delta);
+        msg.offset_us = offset_us;
+        msg.qos = flags & 3;
+        msg.retained = flags & 4;
+        return true;
+    }
+};
+
+class CaptureListener : public virtual mqtt::callback {
+    CaptureWriter& writer;
+    std::mutex mtx;
+
+public:
+    explicit CaptureListener(CaptureWriter& writer) : writer(writer) {}
+
+    void message_arrived(mqtt::const_message_ptr msg) override {
+        std::lock_guard<std::mutex> lock(mtx);
+        try {
+            writer.write(msg->get_topic(), msg->get_payload(), msg->get_qos(), msg->is_retained());
+        }
+        catch (const std::exception& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            stop_requested = true;
+        }
+    }
+};
+
+int record(const std::string& path, const std::string& broker,
+           const std::vector<std::string>& topics, int64_t duration_sec) {
+    CaptureWriter writer(path);
+    CaptureListener listener(writer);
+
+    mqtt::async_client client(broker, "mqtt_capture_" + std::to_string(getpid()));
+    client.set_callback(listener);
+    client.connect()->wait();
+    for (const auto& topic : topics) client.subscribe(topic, 1)->wait();
+
+    std::cerr << "Recording " << topics.size() << " topic filters to " << path
+              << " (Ctrl+C to stop)" << std::endl;
+
+    auto started = std::chrono::steady_clock::now();
+    while (!stop_requested) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        if (duration_sec > 0 && std::chrono::steady_clock::now() - started >= std::chrono::seconds(duration_sec)) break;
+    }
+
+    for (const auto& topic : topics) client.unsubscribe(topic)->wait();
+    client.disconnect()->wait();
+    std::cerr << "Recorded " << writer.count() << " messages" << std::endl;
+    return 0;
+}
+
+// Фильтр MQTT: + - один уровень, # - все оставшиеся
+bool topic_matches(const std::string& filter, const std::string& topic) {
+    size_t f = 0, t = 0;
+    while (f < filter.size()) {
+        if (filter[f] == '#') return true;
+        if (filter[f] == '+') {
+            while (t < topic.size() && topic[t] != '/') t++;
+            f++;
+            continue;
+        }
+        if (t >= topic.size() || filter[f] != topic[t]) return false;
+        f++;
+        t++;
+    }
+    return t == topic.size();
+}
+
+// speed <= 0 - без пауз, иначе промежутки между сообщениями делятся на speed.
+// Воспроизводятся только сообщения с топиками под фильтрами topics
+int replay(const std::string& path, const std::string& broker, const std::vector<std::string>& topics,
+           double speed, bool loop) {
+    mqtt::async_client client(broker, "mqtt_replay_" + std::to_string(getpid()));
+    auto options = mqtt::connect_options_builder()
+        .clean_session()
+        .max_inflight(static_cast<int>(REPLAY_MAX_INFLIGHT))
+        .finalize();
+    client.connect(options)->wait();
+
+    std::deque<mqtt::delivery_token_ptr> inflight;
+    uint64_t sent = 0, skipped = 0;
+    int64_t max_lag_us = 0;
+    int64_t begin_us = now_us();
+
+    do {
+        CaptureReader reader(path);
+        CapturedMessage msg;
+        int64_t pass_start_us = now_us();
+        while (!stop_requested && reader.next(msg)) {
+            bool selected = std::any_of(topics.begin(), topics.end(),
+                                        [&](const std::string& filter) { return topic_matches(filter, msg.topic); });
+            if (!selected) {
+                skipped++;
+                continue;
+            }
+            if (speed > 0) {
+                int64_t due_us = pass_start_us + static_cast<int64_t>(msg.offset_us / speed);
+                int64_t wait_us = due_us - now_us();
+                if (wait_us > 0) std::this_thread::sleep_for(std::chrono::microseconds(wait_us));
+                else max_lag_us = std::max(max_lag_us, -wait_us);
+            }
+
+            auto token = client.publish(mqtt::make_message(msg.topic, msg.payload, msg.qos, msg.retained));
+            if (msg.qos > 0) {
+                inflight.push_back(token);
+                if (inflight.size() >= REPLAY_MAX_INFLIGHT) {
+                    inflight.front()->wait();
+                    inflight.pop_front();
+                }
+            }
+            sent++;
+        }
+    } while (loop && !stop_requested);
+
+    for (auto& token : inflight) token->wait();
+    client.disconnect()->wait();
+
+    double elapsed = (now_us() - begin_us) / 1e6;
+    std::cerr << "Replayed " << sent << " messages in " << elapsed << " s ("
+              << (elapsed > 0 ? sent / elapsed : 0) << " msg/s), max lag behind schedule "
+              << max_lag_us / 1000 << " ms, skipped by topic " << skipped << std::endl;
+    return 0;
+}
+
+int info(const std::string& path) {
+    CaptureReader reader(path);
+    CapturedMessage msg;
+    std::map<std::string, uint64_t> per_topic;
+    uint64_t total = 0, bytes = 0;
+    int64_t last_offset = 0;
+    while (reader.next(msg)) {
+        per_topic[msg.topic]++;
+        total++;
+        bytes += msg.payload.size();
+        last_offset = msg.offset_us;
+    }
+    std::cout << "Started: " << reader.started_unix_ms() / 1000 << " (unix)\n"
+              << "Duration: " << last_offset / 1e6 << " s\n"
+              << "Messages: " << total << ", payload bytes: " << bytes << "\n";
+    for (const auto& [topic, count] : per_topic) std::cout << "  " << topic << ": " << count << "\n";
+    return 0;
+}
+
+void print_usage() {
+    std::cerr << "Usage: MQTTCAP record <file> [--broker <url>] [--topics t1,t2,...] [--duration <sec>]\n"
+              << "       MQTTCAP replay <file> --broker <url> [--topics t1,t2,...] [--speed <x>|max] [--loop]\n"
+              << "       MQTTCAP info <file>\n"
+              << "Default topics: /+/data, /+/log, /+/config, /+/command (replay: /+/data, /+/log)\n"
+              << "Replay has no default broker: " << DEFAULT_BROKER << " is the production one" << std::endl;
+}
+
+std::vector<std::string> split_list(const std::string& list) {
+    std::vector<std::string> items;
+    size_t begin = 0;
+    while (begin <= list.size()) {
+        size_t end = list.find(',', begin);
+        if (end == std::string::npos) end = list.size();
+        if (end > begin) items.push_back(list.substr(begin, end - begin));
+        begin = end + 1;
+    }
+    return items;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        print_usage();
+        return 1;
+    }
+    std::string mode = argv[1];
+    std::string path = argv[2];
+    std::string broker;
+    std::vector<std::string> topics;
+    int64_t duration_sec = 0;
+    double speed = 1.0;
+    bool loop = false;
+
+    try {
+        for (int i = 3; i < argc; i++) {
+            std::string arg = argv[i];
+            auto value = [&]() -> std::string {
+                if (i + 1 >= argc) throw std::runtime_error("Missing value for " + arg);
+                return argv[++i];
+            };
+            if (arg == "--broker") broker = value();
+            else if (arg == "--topics") topics = split_list(value());
+            else if (arg == "--duration") duration_sec = std::stoll(value());
+            else if (arg == "--speed") {
+                std::string v = value();
+                speed = v == "max" ? 0 : std::stod(v);
+            }
+            else if (arg == "--loop") loop = true;
+            else throw std::runtime_error("Unknown option " + arg);
+        }
+
+        std::signal(SIGINT, on_signal);
+        std::signal(SIGTERM, on_signal);
+
+        if (mode == "record") {
+            return record(path, broker.empty() ? DEFAULT_BROKER : broker, topics.empty() ? DEFAULT_TOPICS : topics,
+                          duration_sec);
+        }
+        if (mode == "replay") {
+            if (broker.empty()) throw std::runtime_error("replay needs --broker (not the production one)");
+            return replay(path, broker, topics.empty() ? DEFAULT_REPLAY_TOPICS : topics, speed, loop);
+        }
+        if (mode == "info") return info(path);
+        print_usage();
+        return 1;
+    }
+    catch (const std::exception& e) {
+        std::cerr << "Fatal error: " << e.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1 @@
+g++ -std=c++17 -pthread -o MQTTCAP capture.cpp     -lz     -lpaho-mqttpp3     -lpaho-mqtt3as
@@ -0,0 +1,247 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+// Нагрузочный клиент для порта 1488 (logs.service): держит N одновременных
+// соединений, каждое - "подключиться, отправить строку запроса, дочитать ответ
+// до закрытия", и сразу открывает следующее. Один поток на epoll, чтобы
+// клиент сам не был узким местом при тысячах соединений.
+// С --pid дополнительно считает по /proc переключения контекста и CPU сервера
+// за время прогона - для сравнения бэкендов (потоки / --io-uring)
+
+struct LoadOptions {
+    std::string host = "127.0.0.1";
+    int port = 1488;
+    int connections = 100;
+    int64_t requests = 10000;
+    std::string request = "{\"unix_time_from\": 0, \"unix_time_to\": 0}";
+    int pid = 0;
+};
+
+struct ProcessCounters {
+    uint64_t voluntary_switches = 0;
+    uint64_t involuntary_switches = 0;
+    uint64_t utime_ticks = 0;
+    uint64_t stime_ticks = 0;
+};
+
+struct Client {
+    int fd = -1;
+    size_t sent = 0;
+    uint64_t received = 0;
+    std::chrono::steady_clock::time_point started;
+};
+
+int64_t elapsed_us(std::chrono::steady_clock::time_point since) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - since).count();
+}
+
+// Сумма по всем потокам процесса
+ProcessCounters read_counters(int pid) {
+    ProcessCounters c;
+    std::string task_dir = "/proc/" + std::to_string(pid) + "/task";
+    DIR* d = opendir(task_dir.c_str());
+    if (!d) return c;
+    while (dirent* e = readdir(d)) {
+        if (e->d_name[0] == '.') continue;
+        std::ifstream status(task_dir + "/" + e->d_name + "/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line.rfind("voluntary_ctxt_switches:", 0) == 0) c.voluntary_switches += std::stoull(line.substr(24));
+            if (line.rfind("nonvoluntary_ctxt_switches:", 0) == 0) c.involuntary_switches += std::stoull(line.substr(27));
+        }
+    }
+    closedir(d);
+
+    // utime и stime процесса уже включают все потоки (поля 14 и 15 /proc/pid/stat)
+    std::ifstream stat("/proc/" + std::to_string(pid) + "/stat");
+    std::string content((std::istreambuf_iterator<char>(stat)), std::istreambuf_iterator<char>());
+    size_t close_paren = content.rfind(')');
+    if (close_paren != std::string::npos) {
+        std::istringstream fields(content.substr(close_paren + 2));
+        std::string skip;
+        for (int i = 3; i < 14; i++) fields >> skip;
+        fields >> c.utime_ticks >> c.stime_ticks;
+    }
+    return c;
+}
+
+void print_usage() {
+    std::cerr << "Usage: PHONE_LOAD [--host <ip>] [--port <port>] [--connections N] [--requests N]\n"
+              << "                  [--request '<json line>'] [--pid <server pid>]" << std::endl;
+}
+
+LoadOptions parse_args(int argc, char* argv[]) {
+    LoadOptions opts;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) throw std::runtime_error("Missing value for " + arg);
+        std::string value = argv[++i];
+        if (arg == "--host") opts.host = value;
+        else if (arg == "--port") opts.port = std::stoi(value);
+        else if (arg == "--connections") opts.connections = std::stoi(value);
+        else if (arg == "--requests") opts.requests = std::stoll(value);
+        else if (arg == "--request") opts.request = value;
+        else if (arg == "--pid") opts.pid = std::stoi(value);
+        else throw std::runtime_error("Unknown option " + arg);
+    }
+    return opts;
+}
+
+int main(int argc, char* argv[]) {
+    LoadOptions opts;
+    try {
+        opts = parse_args(argc, argv);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        print_usage();
+        return 1;
+    }
+    std::string line = opts.request + "\n";
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(opts.port);
+    inet_pton(AF_INET, opts.host.c_str(), &addr.sin_addr);
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    std::vector<Client> clients(opts.connections);
+    std::vector<int64_t> latencies;
+    latencies.reserve(opts.requests);
+    int64_t started = 0, failed = 0;
+    uint64_t bytes = 0;
+
+    auto start_request = [&](size_t index) {
+        Client& c = clients[index];
+        c = Client{};
+        c.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        c.started = std::chrono::steady_clock::now();
+        int r = connect(c.fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr));
+        if (r != 0 && errno != EINPROGRESS) {
+            close(c.fd);
+            c.fd = -1;
+            failed++;
+            return;
+        }
+        epoll_event ev{};
+        ev.events = EPOLLOUT | EPOLLIN | EPOLLRDHUP;
+        ev.data.u64 = index;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c.fd, &ev);
+        started++;
+    };
+
+    auto finish = [&](size_t index, bool ok) {
+        Client& c = clients[index];
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c.fd, nullptr);
+        close(c.fd);
+        c.fd = -1;
+        if (ok) {
+            latencies.push_back(elapsed_us(c.started));
+            bytes += c.received;
+        } else {
+            failed++;
+        }
+    };
+
+    ProcessCounters before = opts.pid ? read_counters(opts.pid) : ProcessCounters{};
+    auto run_started = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < clients.size() && started < opts.requests; i++) start_request(i);
+
+    std::vector<epoll_event> events(1024);
+    std::vector<char> buf(256 * 1024);
+    int64_t active = started;
+    while (active > 0) {
+        int n = epoll_wait(epoll_fd, events.data(), static_cast<int>(events.size()), 5000);
+        if (n <= 0) {
+            std::cerr << "Timeout waiting for responses" << std::endl;
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            size_t index = events[i].data.u64;
+            Client& c = clients[index];
+            if (c.fd < 0) continue;
+
+            if (c.sent < line.size() && (events[i].events & EPOLLOUT)) {
+                ssize_t w = send(c.fd, line.data() + c.sent, line.size() - c.sent, MSG_NOSIGNAL);
+                if (w > 0) c.sent += w;
+                if (c.sent == line.size()) {
+                    epoll_event ev{};
+                    ev.events = EPOLLIN | EPOLLRDHUP;
+                    ev.data.u64 = index;
+                    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c.fd, &ev);
+                }
+            }
+
+            bool done = false, ok = false;
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                while (true) {
+                    ssize_t r = recv(c.fd, buf.data(), buf.size(), 0);
+                    if (r > 0) {
+                        c.received += r;
+                        continue;
+                    }
+                    if (r == 0) {
+                        done = true;
+                        ok = c.received > 0;
+                    } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                        done = true;
+                    }
+                    break;
+                }
+            }
+            if (!done) continue;
+
+            finish(index, ok);
+            active--;
+            if (started < opts.requests) {
+                start_request(index);
+                if (clients[index].fd >= 0) active++;
+            }
+        }
+    }
+
+    double seconds = elapsed_us(run_started) / 1e6;
+    ProcessCounters after = opts.pid ? read_counters(opts.pid) : ProcessCounters{};
+
+    std::sort(latencies.begin(), latencies.end());
+    auto pct = [&](double q) -> double {
+        if (latencies.empty()) return 0;
+        return latencies[static_cast<size_t>(q * (latencies.size() - 1))] / 1000.0;
+    };
+
+    std::cout << "Connections: " << opts.connections << ", completed: " << latencies.size()
+              << ", failed: " << failed << "\n"
+              << "Time: " << seconds << " s, " << latencies.size() / seconds << " req/s, "
+              << bytes / seconds / (1024 * 1024) << " MiB/s\n"
+              << "Latency ms: p50 " << pct(0.5) << ", p90 " << pct(0.9) << ", p99 " << pct(0.99)
+              << ", max " << pct(1.0) << "\n";
+    if (opts.pid && !latencies.empty()) {
+        long hz = sysconf(_SC_CLK_TCK);
+        double per_request = 1.0 / latencies.size();
+        std::cout << "Server per request: "
+                  << (after.voluntary_switches - before.voluntary_switches) * per_request << " voluntary + "
+                  << (after.involuntary_switches - before.involuntary_switches) * per_request
+                  << " involuntary context switches, "
+                  << (after.utime_ticks - before.utime_ticks) * 1e6 / hz * per_request << " us user, "
+                  << (after.stime_ticks - before.stime_ticks) * 1e6 / hz * per_request << " us system CPU\n";
+    }
+    close(epoll_fd);
+    return failed > 0 ? 1 : 0;
+}
@@ -0,0 +1 @@
+g++ -std=c++17 -O2 -o PHONE_LOAD load.cpp